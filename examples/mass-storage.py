@@ -9,22 +9,31 @@ import logging
 from facedancer import main
 from facedancer.devices.umass import RawDiskImage
 from facedancer.devices.umass import USBMassStorageDevice
+from facedancer.devices.umass.trace import BlockAccessTracer
 
 
 # usage instructions
 if len(sys.argv)==1:
-    print("Usage: mass-storage.py disk.img")
+    print("Usage: mass-storage.py disk.img [block_size [trace_file]]")
     sys.exit(1)
 
-# get disk image filename and clear arguments
-filename = sys.argv[1]
-sys.argv = [sys.argv[0]]
+# get disk image filename, block size and trace filename, and clear arguments
+filename   = sys.argv[1]
+block_size = int(sys.argv[2]) if len(sys.argv) > 2 else 512
+trace_file = sys.argv[3] if len(sys.argv) > 3 else "mass-storage.trace"
+sys.argv   = [sys.argv[0]]
 
-# open our disk image
-disk_image = RawDiskImage(filename, 512, verbose=3)
+# open our disk image; use a block size of 4096 to emulate a native 4Kn drive
+disk_image = RawDiskImage(filename, block_size)
+
+# record every block command the host issues; once we're done, see what it did with:
+#
+#    python -m facedancer.devices.umass.trace mass-storage.trace
+#
+tracer = BlockAccessTracer(trace_file)
 
 # create the device
-device = USBMassStorageDevice(disk_image)
+device = USBMassStorageDevice(disk_image, tracer=tracer)
 
 
 async def hello():
@@ -21,7 +21,7 @@ from .magic import use_automatically, use_inner_classes_automatically
 
 # Alias objects to make them easier to import.
 from .backends import *
-from .core     import FacedancerUSBApp, FacedancerUSBHostApp, FacedancerBasicScheduler
+from .core     import FacedancerUSBApp, FacedancerUSBHostApp, FacedancerBasicScheduler, FacedancerScheduler
 from .devices  import default_main as main
 
 # Wildcard import.
@@ -6,7 +6,9 @@ import time
 
 from ..core import FacedancerApp
 
-class MAXUSBApp(FacedancerApp):
+from .base  import FacedancerBackend
+
+class MAXUSBApp(FacedancerApp, FacedancerBackend):
     reg_ep0_fifo                    = 0x00
     reg_ep1_out_fifo                = 0x01
     reg_ep2_in_fifo                 = 0x02
@@ -181,27 +183,33 @@ class MAXUSBApp(FacedancerApp):
             req = self.connected_device.create_request(b)
             self.connected_device.handle_request(req)
 
-        if irq & self.is_out1_data_avail:
+        # If the device has held EP1 OUT, leave its data in the chip's FIFO; so the chip NAKs the host until it's read.
+        if irq & self.is_out1_data_avail and not self.out_endpoint_held(1):
             data = self.read_from_endpoint(1)
             if data:
                 self.connected_device.handle_data_available(1, data)
             self.clear_irq_bit(self.reg_endpoint_irq, self.is_out1_data_avail)
 
+        # Refill the IN buffers straight from their transmit FIFOs, where we have queued data.
         if irq & self.is_in2_buffer_avail:
-            self.connected_device.handle_buffer_available(2)
+            if not self.prime_from_tx_fifo(2):
+                self.connected_device.handle_buffer_available(2)
 
         if irq & self.is_in3_buffer_avail:
-            self.connected_device.handle_buffer_available(3)
+            if not self.prime_from_tx_fifo(3):
+                self.connected_device.handle_buffer_available(3)
 
         # Check to see if we've NAK'd on either of our IN endpoints,
         # and generate the relevant events.
 
         if in_nak & self.ep2_in_nak:
-            self.connected_device.handle_nak(2)
+            if not self.prime_from_tx_fifo(2):
+                self.connected_device.handle_nak(2)
             self.clear_irq_bit(self.reg_pin_control, in_nak | self.ep2_in_nak)
 
         if in_nak & self.ep3_in_nak:
-            self.connected_device.handle_nak(3)
+            if not self.prime_from_tx_fifo(3):
+                self.connected_device.handle_nak(3)
             self.clear_irq_bit(self.reg_pin_control, in_nak | self.ep3_in_nak)
 
 
@@ -230,5 +238,5 @@ class MAXUSBApp(FacedancerApp):
 
         # For the MAXUSB case, we don't need to do anything, though it might
         # be nice to print a message or store the active configuration for
-        # use by the USBDevice, etc. etc.
-        pass
+        # use by the USBDevice, etc. etc. We do drop anything queued for the old configuration.
+        self.flush_tx_fifos()
@@ -6,4 +6,5 @@ __all__ = [
     "greathost",
     "libusbhost",
     "moondancer",
+    "virtual",
 ]
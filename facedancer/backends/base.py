@@ -1,8 +1,125 @@
-from typing    import List
-from ..        import *
+from typing      import List, Optional
+from collections import deque
+from dataclasses import dataclass
+
+from ..          import *
+
+
+@dataclass
+class ControlDataStage:
+    """
+    Collects the data stage of a control OUT request, into a buffer preallocated from its wLength;
+    so large transfers don't grow (and copy) the request's data one packet at a time.
+
+    Args:
+        request     : The control request whose data stage is being received.
+        packet_size : The control endpoint's maximum packet size; used to spot short packets.
+    """
+
+    request     : USBControlRequest
+    packet_size : int
+    buffer      : bytearray = None
+    received    : int       = 0
+
+    def __post_init__(self):
+        if self.buffer is None:
+            self.buffer = bytearray(self.request.length)
+
+
+    def add(self, data: bytes) -> bool:
+        """
+        Adds a packet of data to the data stage.
+
+        Returns true iff the data stage is now complete; in which case, the request's
+        data has been filled in, and it's ready to be handled.
+        """
+
+        count = min(len(data), len(self.buffer) - self.received)
+        self.buffer[self.received:self.received + count] = data[:count]
+        self.received += count
+
+        # The data stage ends once wLength bytes have arrived; or early, on a short packet.
+        complete = (self.received >= len(self.buffer)) or (len(data) < self.packet_size)
+
+        if complete:
+            if self.received < len(self.buffer):
+                del self.buffer[self.received:]
+            self.request.data = self.buffer
+
+        return complete
+
+
+def board_selection(serial_number: str=None) -> dict:
+    """
+    Returns the keyword arguments that select a particular GreatFET-family board (e.g. a
+    Cynthion or a GreatFET) when opening it; or none, which selects the first board found.
+    """
+    return {'serial_number': serial_number} if serial_number else {}
+
+
+def set_bits(bitmap: int):
+    """
+    Yields the index of each set bit in a bitmap, lowest first. Each step isolates and clears
+    the lowest set bit; so walking a status register costs one step per set bit, rather than
+    one per possible endpoint.
+    """
+    while bitmap:
+        lowest  = bitmap & -bitmap
+        bitmap ^= lowest
+        yield lowest.bit_length() - 1
+
+
+class EndpointTable:
+    """
+    Table of a configuration's non-control endpoints, indexed by address; with a bitmap of the
+    IN and OUT endpoint numbers present, which can be masked directly against status registers.
+    """
+
+    def __init__(self, configuration: USBConfiguration=None):
+        self.rebuild(configuration)
+
+
+    def rebuild(self, configuration: USBConfiguration=None):
+        """ Re-indexes the endpoints of the given configuration; or empties the table, if there is none. """
+        self.endpoints = {}
+        self.in_mask   = 0
+        self.out_mask  = 0
+
+        if configuration is None:
+            return
+
+        for interface in configuration.get_interfaces():
+            for endpoint in interface.get_endpoints():
+                self.endpoints[endpoint.get_address()] = endpoint
+
+                if endpoint.direction == USBDirection.IN:
+                    self.in_mask |= 1 << endpoint.number
+                else:
+                    self.out_mask |= 1 << endpoint.number
+
+
+    def get(self, endpoint_number: int, direction: USBDirection) -> USBEndpoint:
+        """ Returns the endpoint with the given number and direction; or None, if there isn't one. """
+        return self.endpoints.get(endpoint_number | (0x80 if direction == USBDirection.IN else 0))
+
+
+    def __iter__(self):
+        return iter(self.endpoints.values())
+
+
+    def __len__(self):
+        return len(self.endpoints)
 
 
 class FacedancerBackend:
+
+    # The largest IN transfer that send_on_endpoint() accepts in a single call; backends that
+    # handle their own packetization raise this so large transfers aren't split up in Python.
+    MAX_TRANSFER_SIZE = 0
+
+    # The number of transfers each IN endpoint's transmit FIFO can hold; see queue_on_endpoint().
+    TX_FIFO_DEPTH = 64
+
     def __init__(self, device: USBDevice=None, verbose: int=0, quirks: List[str]=[]):
         """
         Initializes the backend.
@@ -136,3 +253,168 @@ class FacedancerBackend:
         Facedancer's execution status, and reacts as events occur.
         """
         raise NotImplementedError
+
+
+    #
+    # Transmit FIFOs.
+    #
+    # Backends that support these keep a FIFO of IN transfers for each endpoint, which the device
+    # can fill ahead of time. Whenever the host finds an endpoint idle, the backend primes it
+    # straight from its FIFO; and only calls into the device model once the FIFO has run dry.
+    #
+    # Each FIFO has a single producer (the device) and a single consumer (the backend); so they
+    # can be filled directly from another thread, without locking.
+    #
+
+    def initialize_endpoint_state(self):
+        """
+        Sets up our transmit FIFOs and endpoint table. Backends that support them call this from
+        their __init__.
+        """
+
+        # Maps IN endpoint numbers => the transfers waiting in that endpoint's FIFO.
+        self._tx_fifos       = {}
+        self._endpoint_table = EndpointTable()
+
+        # Bitmap of the OUT endpoints the device has asked us to stop receiving on; see hold_out_endpoint().
+        self._held_out_endpoints = 0
+
+
+    def _tx_fifo(self, endpoint_number: int) -> deque:
+        fifo = self._tx_fifos.get(endpoint_number)
+        if fifo is None:
+            fifo = self._tx_fifos[endpoint_number] = deque()
+
+        return fifo
+
+
+    def tx_fifo_space(self, endpoint_number: int) -> int:
+        """
+        Returns the number of transfers that can currently be added to an endpoint's transmit FIFO.
+
+        Args:
+            endpoint_number : The number of the IN endpoint whose FIFO should be checked.
+        """
+        return max(0, self.TX_FIFO_DEPTH - len(self._tx_fifo(endpoint_number)))
+
+
+    def queue_on_endpoint(self, endpoint_number: int, data: bytes, packet_size: int) -> Optional[int]:
+        """
+        Adds data to an endpoint's transmit FIFO, to be sent as the host asks for it.
+
+        The data is split into transfers of as many whole packets as send_on_endpoint()
+        accepts at once. Only as much as fits in the FIFO is accepted.
+
+        Args:
+            endpoint_number : The number of the IN endpoint on which data should be sent.
+            data            : The data to be sent. Empty data queues a zero-length packet.
+            packet_size     : The endpoint's maximum packet size.
+
+        Returns the number of bytes accepted; which is zero for an accepted zero-length packet.
+        Returns None if the FIFO was full, and nothing could be queued.
+        """
+
+        fifo = self._tx_fifo(endpoint_number)
+
+        if len(fifo) >= self.TX_FIFO_DEPTH:
+            return None
+
+        if not data:
+            fifo.append(b"")
+            return 0
+
+        chunk_size = packet_size
+        if self.MAX_TRANSFER_SIZE > packet_size:
+            chunk_size = self.MAX_TRANSFER_SIZE - (self.MAX_TRANSFER_SIZE % packet_size)
+
+        data     = memoryview(data)
+        accepted = 0
+
+        while accepted < len(data) and len(fifo) < self.TX_FIFO_DEPTH:
+            chunk = bytes(data[accepted:accepted + chunk_size])
+            fifo.append(chunk)
+            accepted += len(chunk)
+
+        return accepted
+
+
+    def prime_from_tx_fifo(self, endpoint_number: int) -> bool:
+        """
+        Primes an IN endpoint with the next transfer in its transmit FIFO, if there is one.
+        Backends call this when an endpoint is found idle, before notifying the device.
+
+        Args:
+            endpoint_number : The number of the IN endpoint to be primed.
+
+        Returns true iff the endpoint was primed.
+        """
+
+        fifo = self._tx_fifos.get(endpoint_number)
+        if not fifo:
+            return False
+
+        self.send_on_endpoint(endpoint_number, fifo.popleft(), blocking=False)
+        return True
+
+
+    def flush_tx_fifos(self):
+        """ Discards all queued transfers; e.g. on bus reset or reconfiguration. """
+        for fifo in self._tx_fifos.values():
+            fifo.clear()
+
+
+    #
+    # Receive flow control.
+    #
+    # A device that can't take any more data on an OUT endpoint can hold it. Backends that support
+    # this stop readying a held endpoint to receive, so the hardware NAKs the host until the device
+    # releases it. Holding and releasing only update a bitmap; so, like the transmit FIFOs, they're
+    # safe to use from the device's thread while the backend is serviced on another.
+    #
+
+    def hold_out_endpoint(self, endpoint_number: int):
+        """
+        Stops accepting data on an OUT endpoint, until it's released.
+
+        Args:
+            endpoint_number : The number of the OUT endpoint to hold.
+        """
+        self._held_out_endpoints |= 1 << endpoint_number
+
+
+    def release_out_endpoint(self, endpoint_number: int):
+        """
+        Resumes accepting data on an OUT endpoint held by hold_out_endpoint().
+
+        Args:
+            endpoint_number : The number of the OUT endpoint to release.
+        """
+        self._held_out_endpoints &= ~(1 << endpoint_number)
+
+
+    def out_endpoint_held(self, endpoint_number: int) -> bool:
+        """ Returns true iff the given OUT endpoint is currently held. """
+        return bool(self._held_out_endpoints & (1 << endpoint_number))
+
+
+    #
+    # Endpoint table.
+    #
+    # Backends that support this index the active configuration's endpoints when it's applied;
+    # so servicing can walk straight from a status bitmap's set bits to the endpoints it names,
+    # rather than scanning every interface and endpoint of the configuration.
+    #
+
+    @property
+    def endpoint_table(self) -> EndpointTable:
+        """ Our index of the active configuration's endpoints. """
+        return self._endpoint_table
+
+
+    def update_endpoint_table(self):
+        """
+        Rebuilds our endpoint table from our active configuration. Called when a configuration is
+        applied; and should be called whenever the active configuration's endpoints change, e.g.
+        on a change of alternate setting.
+        """
+        self.endpoint_table.rebuild(getattr(self, 'configuration', None))
@@ -47,6 +47,9 @@ class GoodfetMaxUSBApp(MAXUSBApp):
 
         self.connected_device = None
 
+        # Transmit FIFOs and the endpoint table start empty; they're filled once we're configured.
+        self.initialize_endpoint_state()
+
         self.enable()
 
         if verbose > 0:
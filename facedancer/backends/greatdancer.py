@@ -10,8 +10,10 @@ from ..types    import *
 
 from ..logging  import log
 
+from .base      import FacedancerBackend, ControlDataStage, board_selection, set_bits
 
-class GreatDancerApp(FacedancerApp):
+
+class GreatDancerApp(FacedancerApp, FacedancerBackend):
     """
     Backend for using GreatFET devices as Facedancers.
     """
@@ -28,6 +30,12 @@ class GreatDancerApp(FacedancerApp):
     # TODO: bump this up when we develop support using USB0 (cables flipped)
     SUPPORTED_ENDPOINTS = 4
 
+    # Mask covering one direction's worth of endpoint bits in a status word.
+    _ENDPOINT_MASK = (1 << SUPPORTED_ENDPOINTS) - 1
+
+    # Largest IN transfer we can send in one pygreat command; the controller packetizes it.
+    MAX_TRANSFER_SIZE = 768
+
     # USB directions
     HOST_TO_DEVICE = 0
     DEVICE_TO_HOST = 1
@@ -42,11 +50,16 @@ class GreatDancerApp(FacedancerApp):
     # Quirk flags
     QUIRK_MANUAL_SET_ADDRESS = 0x01
 
+    # We can be pointed at a particular GreatFET by serial number.
+    SUPPORTS_BOARD_SELECTION = True
+
     @classmethod
-    def appropriate_for_environment(cls, backend_name):
+    def appropriate_for_environment(cls, backend_name, serial_number=None):
         """
         Determines if the current environment seems appropriate
         for using the GreatDancer backend.
+
+        serial_number: If provided, the serial number of the GreatFET we must use.
         """
 
         # Check: if we have a backend name other than greatfet,
@@ -58,7 +71,7 @@ class GreatDancerApp(FacedancerApp):
         # see if there's a connected GreatFET.
         try:
             import greatfet
-            gf = greatfet.GreatFET()
+            gf = greatfet.GreatFET(**board_selection(serial_number))
             return gf.supports_api('greatdancer')
         except ImportError:
             log.info("Skipping GreatFET-based devices, as the greatfet python module isn't installed.")
@@ -67,26 +80,31 @@ class GreatDancerApp(FacedancerApp):
             return False
 
 
-    def __init__(self, device=None, verbose=0, quirks=None):
+    def __init__(self, device=None, verbose=0, quirks=None, serial_number=None):
         """
         Sets up a new GreatFET-backed Facedancer (GreatDancer) application.
 
         device: The GreatFET device that will act as our GreatDancer.
         verbose: The verbosity level of the given application.
+        serial_number: If provided, and no device is, the serial number of the GreatFET to use.
         """
 
         import greatfet
 
         if device is None:
-            device = greatfet.GreatFET()
+            device = greatfet.GreatFET(**board_selection(serial_number))
 
         self.device = device
 
         self.device.comms.get_exclusive_access()
+        self.has_exclusive_access = True
 
         FacedancerApp.__init__(self, device, verbose)
         self.connected_device = None
 
+        # Transmit FIFOs and the endpoint table start empty; they're filled once we're configured.
+        self.initialize_endpoint_state()
+
         # Grab the raw API object from the GreatFET object.
         # This has the low-level RPCs used for raw USB control.
         self.api = self.device.apis.greatdancer
@@ -199,6 +217,11 @@ class GreatDancerApp(FacedancerApp):
 
         self.max_packet_size_ep0 = max_packet_size_ep0
 
+        # If a previous disconnect() gave up the GreatFET, reclaim it; e.g. when cycling connections.
+        if not self.has_exclusive_access:
+            self.device.comms.get_exclusive_access()
+            self.has_exclusive_access = True
+
         quirks = 0
 
         # Compute our quirk flags.
@@ -217,6 +240,7 @@ class GreatDancerApp(FacedancerApp):
         """ Disconnects the GreatDancer from its target host. """
         log.info("Disconnecting from host.")
         self.device.comms.release_exclusive_access()
+        self.has_exclusive_access = False
         self.api.disconnect()
 
 
@@ -374,9 +398,8 @@ class GreatDancerApp(FacedancerApp):
 
         # Otherwise, figure out which endpoints have outstanding setup events,
         # and handle them.
-        for i in range(self.SUPPORTED_ENDPOINTS):
-            if status & (1 << i):
-                self._handle_setup_event_on_endpoint(i)
+        for i in set_bits(status & self._ENDPOINT_MASK):
+            self._handle_setup_event_on_endpoint(i)
 
 
     def _handle_setup_event_on_endpoint(self, endpoint_number):
@@ -408,7 +431,7 @@ class GreatDancerApp(FacedancerApp):
         # in _handle_transfer_complete_on_endpoint.
         if is_out and has_data:
             self._prime_out_endpoint(endpoint_number)
-            self.pending_control_request = request
+            self.pending_control_request = ControlDataStage(request, self.max_packet_size_ep0)
             return
 
         self.connected_device.handle_request(request)
@@ -470,21 +493,22 @@ class GreatDancerApp(FacedancerApp):
         # [Note that it's safe to clean up the transfer descriptors before reading,
         #  here-- the GreatFET's USB controller has transparently moved any data
         #  from OUT transactions into a holding buffer for us. Nice of it!]
-        for i in range(self.SUPPORTED_ENDPOINTS):
-            if status & (1 << i):
-                self._clean_up_transfers_for_endpoint(i, self.HOST_TO_DEVICE)
+        completed_out = status & self._ENDPOINT_MASK
+        completed_in  = (status >> 16) & self._ENDPOINT_MASK
 
-            if status & (1 << (i + 16)):
-                self._clean_up_transfers_for_endpoint(i, self.DEVICE_TO_HOST)
+        for i in set_bits(completed_out):
+            self._clean_up_transfers_for_endpoint(i, self.HOST_TO_DEVICE)
+
+        for i in set_bits(completed_in):
+            self._clean_up_transfers_for_endpoint(i, self.DEVICE_TO_HOST)
 
         # Now that we've cleaned up all relevant transfer descriptors, trigger
         # any events that should occur due to the completed transaction.
-        for i in range(self.SUPPORTED_ENDPOINTS):
-            if status & (1 << i):
-                self._handle_transfer_complete_on_endpoint(i, self.HOST_TO_DEVICE)
+        for i in set_bits(completed_out):
+            self._handle_transfer_complete_on_endpoint(i, self.HOST_TO_DEVICE)
 
-            if status & (1 << (i + 16)):
-                self._handle_transfer_complete_on_endpoint(i, self.DEVICE_TO_HOST)
+        for i in set_bits(completed_in):
+            self._handle_transfer_complete_on_endpoint(i, self.DEVICE_TO_HOST)
 
 
         # Finally, after completing all of the above, we may now have idle
@@ -558,16 +582,11 @@ class GreatDancerApp(FacedancerApp):
                     # the control request.
                     new_data = self._finish_primed_read_on_endpoint(endpoint_number)
 
-                    # Append our new data to the pending control request.
-                    self.pending_control_request.data.extend(new_data)
-
-                    all_data_received = len(self.pending_control_request.data) == self.pending_control_request.length
-                    is_short_packet   = len(new_data) < self.max_packet_size_ep0
-
-                    if all_data_received or is_short_packet:
+                    # Add our new data to the pending control request's data stage.
+                    if self.pending_control_request.add(new_data):
 
                         # Handle the completed setup request...
-                        self.connected_device.handle_request(self.pending_control_request)
+                        self.connected_device.handle_request(self.pending_control_request.request)
 
                         # And clear our pending setup data.
                         self.pending_control_request = None
@@ -622,28 +641,28 @@ class GreatDancerApp(FacedancerApp):
         if not self.configuration:
             return
 
-        # Fetch the endpoint status.
+        # Fetch the endpoint status; a set bit indicates an endpoint that's still primed.
         status = self._fetch_transfer_readiness()
+        table  = self.endpoint_table
 
-        # Check the status of every endpoint /except/ endpoint zero,
-        # which is always a control endpoint and set handled by our
+        # Check the status of every configured endpoint; our table never includes
+        # endpoint zero, which is always a control endpoint and handled by our
         # control transfer handler.
-        for interface in self.configuration.get_interfaces():
-            for endpoint in interface.get_endpoints():
-
-                # Check to see if the endpoint is ready to be primed.
-                if self._is_ready_for_priming(endpoint.number, endpoint.direction):
-
-                    # If this is an IN endpoint, we're ready to accept data to be
-                    # presented on the next IN token.
-                    if endpoint.direction == USBDirection.IN:
-                        self.connected_device.handle_buffer_available(endpoint.number)
-
-                    # If this is an OUT endpoint, we'll need to prime the endpoint to
-                    # accept new data. This provides a place for data to go once the
-                    # host sends an OUT token.
-                    else:
-                        self._prime_out_endpoint(endpoint.number)
+        ready_in  = table.in_mask & ~(status >> 16)
+        ready_out = table.out_mask & ~status & ~self._held_out_endpoints
+
+        # If an IN endpoint is idle, we're ready to accept data to be
+        # presented on the next IN token.
+        for endpoint_number in set_bits(ready_in):
+            if not self.prime_from_tx_fifo(endpoint_number):
+                self.connected_device.handle_buffer_available(endpoint_number)
+
+        # If an OUT endpoint is idle, we'll need to prime the endpoint to
+        # accept new data. This provides a place for data to go once the
+        # host sends an OUT token. Endpoints the device has held are left
+        # unprimed; so the host is NAK'd until they're released.
+        for endpoint_number in set_bits(ready_out):
+            self._prime_out_endpoint(endpoint_number)
 
 
     def _is_ready_for_priming(self, ep_num, direction):
@@ -705,6 +724,7 @@ class GreatDancerApp(FacedancerApp):
         """
         Triggers the GreatFET to handle its side of a bus reset.
         """
+        self.flush_tx_fifos()
         self.api.bus_reset()
 
 
@@ -723,17 +743,10 @@ class GreatDancerApp(FacedancerApp):
         # Fetch the endpoint status.
         status = self._fetch_endpoint_nak_status()
 
-        # Iterate over each usable endpoint.
-        for interface in self.configuration.get_interfaces():
-            for endpoint in interface.get_endpoints():
-
-                # Skip OUT endpoints
-                if endpoint.direction == self.HOST_TO_DEVICE:
-                    continue
-
-                # If the endpoint has NAK'd, issued the relevant callback.
-                if self._has_issued_nak(status, endpoint.number, endpoint.direction):
-                    self.connected_device.handle_nak(endpoint.number)
+        # Iterate over each configured IN endpoint that has NAK'd, and issue the relevant callback.
+        for endpoint_number in set_bits(self.endpoint_table.in_mask & (status >> 16)):
+            if not self.prime_from_tx_fifo(endpoint_number):
+                self.connected_device.handle_nak(endpoint_number)
 
 
 
@@ -761,8 +774,10 @@ class GreatDancerApp(FacedancerApp):
         Args:
             configuration: The configuration applied by the SET_CONFIG request.
         """
+        self.flush_tx_fifos()
         self._configure_endpoints(configuration)
         self.configuration = configuration
+        self.update_endpoint_table()
 
         # If we've just set up endpoints, check to see if any of them
         # need to be primed, or have NAKs waiting.
@@ -0,0 +1,394 @@
+#
+# This file is part of Facedancer.
+#
+""" Runs a backend on a dedicated I/O thread.
+
+Normally, every backend RPC -- polling for events, and every send, stall or acknowledgement --
+happens on the asyncio thread, interleaved with any user coroutines; so application code that
+does real work delays USB servicing, and slow RPCs delay application code.
+
+An :class:`IOThread` moves all backend work onto a thread of its own. The backend's events are
+passed to the asyncio loop through a bounded single-producer / single-consumer queue, and are
+handled there exactly as usual; any backend calls the device makes in response are passed back
+to the I/O thread through a second queue, and are performed in order; calls whose results are
+needed, like ``read_from_endpoint()``, wait for the I/O thread to return them. This is normally
+used by passing ``io_thread=True`` to :meth:`USBDevice.emulate`, :meth:`USBDevice.run_with`, or
+:meth:`USBDevice.run`.
+
+Control transfers become asynchronous: the hardware NAKs the host until the device's response
+has made its way back to the I/O thread. Backends that need a response within the same
+``service_irqs()`` call won't work in this mode.
+"""
+
+import time
+import asyncio
+import threading
+
+from collections        import deque
+from concurrent.futures import Future, CancelledError, TimeoutError
+
+from ..logging   import log
+
+
+class SPSCQueue:
+    """ Bounded queue with exactly one producer thread and one consumer thread.
+
+    Neither side takes a lock: we rely on deque's append() and popleft() being atomic. When the
+    queue is full, the producer can either wait for space, which applies backpressure to its
+    thread, or use try_put() and decide for itself what to do.
+    """
+
+    def __init__(self, capacity: int = 1024):
+        self.capacity = capacity
+        self._items   = deque()
+
+
+    def put(self, item, *, running=lambda: True) -> bool:
+        """ Adds an item to the queue; waiting for space if it's full.
+
+        Args:
+            item    : The item to enqueue.
+            running : Callable that returns False if we should give up waiting for space.
+
+        Returns false iff we gave up waiting for space.
+        """
+
+        while len(self._items) >= self.capacity:
+            if not running():
+                return False
+            time.sleep(0)
+
+        self._items.append(item)
+        return True
+
+
+    def try_put(self, item) -> bool:
+        """ Adds an item to the queue if there's space for it; never blocks. Returns false iff the queue was full. """
+
+        if len(self._items) >= self.capacity:
+            return False
+
+        self._items.append(item)
+        return True
+
+
+    def drain(self):
+        """ Yields every item currently in the queue, in order; never blocks. """
+        while True:
+            try:
+                yield self._items.popleft()
+            except IndexError:
+                return
+
+
+    def __len__(self):
+        return len(self._items)
+
+
+
+class _DeviceEventProxy:
+    """ Stands in for the device, from the backend's point of view; forwarding its events to the asyncio loop. """
+
+    # Device callbacks that are deferred to the asyncio thread. Anything else (e.g. create_request)
+    # is harmless to call directly, and is passed straight through to the device.
+    DEFERRED_EVENTS = ('handle_request', 'handle_data_available', 'handle_nak',
+        'handle_buffer_available', 'handle_bus_reset')
+
+    # Events the backend re-reports each time it polls, until they're handled; we only queue one of each.
+    COALESCED_EVENTS = ('handle_nak', 'handle_buffer_available')
+
+    def __init__(self, thread: 'IOThread'):
+        self._thread = thread
+
+        for name in self.DEFERRED_EVENTS:
+            setattr(self, name, self._deferred(name))
+
+
+    def _deferred(self, name):
+        handler   = getattr(self._thread.device, name)
+        coalesced = name in self.COALESCED_EVENTS
+
+        def defer(*args):
+            if coalesced:
+                key = (name, *args)
+                if key in self._thread.pending:
+                    return
+                self._thread.pending.add(key)
+            else:
+                key = None
+
+            self._thread.post_event(handler, args, key)
+
+        return defer
+
+
+    def __getattr__(self, name):
+        return getattr(self._thread.device, name)
+
+
+
+class _BackendCallProxy:
+    """ Stands in for the backend, from the device's point of view; forwarding its calls to the I/O thread. """
+
+    # Backend methods that are already safe to call from the asyncio thread, and are called directly.
+    # The transmit FIFOs are themselves single-producer / single-consumer queues; and holding an
+    # OUT endpoint only updates a bitmap the I/O thread reads.
+    DIRECT_CALLS = ('queue_on_endpoint', 'tx_fifo_space', 'hold_out_endpoint', 'release_out_endpoint',
+        'out_endpoint_held')
+
+    # Backend methods that return a result. Calls to these wait for the I/O thread to perform them,
+    # and return what they returned; every other call returns None.
+    RESULT_CALLS = ('get_version', 'read_from_endpoint', 'prime_from_tx_fifo')
+
+    def __init__(self, thread: 'IOThread'):
+        self._thread = thread
+
+
+    def __getattr__(self, name):
+        value = getattr(self._thread.backend, name)
+
+        # Constants (e.g. MAX_TRANSFER_SIZE) are read directly; methods become queued calls.
+        if not callable(value) or name in self.DIRECT_CALLS:
+            return value
+
+        wants_result = name in self.RESULT_CALLS
+
+        def enqueue(*args, **kwargs):
+            done = Future() if wants_result or kwargs.get('blocking') else None
+            self._thread.post_call(value, args, kwargs, done)
+
+            # Blocking calls keep their meaning: we wait until the backend has performed them.
+            if done is None:
+                return None
+
+            result = self._thread.wait_for_call(done)
+
+            # A call that never reached the backend has no result; don't pretend it returned None.
+            if wants_result and done.cancelled():
+                raise RuntimeError(f"{name}() can't be performed; the I/O thread has stopped")
+
+            return result
+
+        return enqueue
+
+
+
+class IOThread:
+    """ Services a device's backend from a dedicated thread; see the module documentation.
+
+    Args:
+        device   : The connected device whose backend should be serviced.
+        capacity : The depth of each of the event and call queues.
+    """
+
+    # How often a blocking call checks that the I/O thread is still alive to perform it, in seconds.
+    CALL_WAIT_INTERVAL = 0.1
+
+    def __init__(self, device, *, capacity: int = 1024):
+        self.device  = device
+        self.backend = device.backend
+
+        # Events from the backend, to be handled on the asyncio thread; and calls to the backend, from it.
+        self.events  = SPSCQueue(capacity)
+        self.calls   = SPSCQueue(capacity)
+
+        # Coalesced events currently sitting in the event queue.
+        self.pending = set()
+
+        # Events that didn't fit in the event queue; held by the I/O thread until there's space.
+        self._overflow = deque()
+
+        self._loop    = None
+        self._wakeup  = None
+        self._thread  = None
+        self._running = False
+        self._error   = None
+
+        # True iff the asyncio thread has been asked to drain the event queue, and hasn't yet started.
+        self._signalled = False
+
+        self._device_proxy  = _DeviceEventProxy(self)
+        self._backend_proxy = _BackendCallProxy(self)
+
+
+    #
+    # Queue plumbing.
+    #
+
+    def post_event(self, handler, args, key=None):
+        """ Called on the I/O thread: queues an event to be handled on the asyncio thread.
+
+        Never blocks: the asyncio thread may itself be waiting on us, to perform a blocking call.
+        If the queue is full, the event is held back until there's space; and we stop polling the
+        backend for more until then.
+        """
+
+        if self._overflow or not self.events.try_put((handler, args, key)):
+            self._overflow.append((handler, args, key))
+
+        self._signal()
+
+
+    def _flush_overflow(self):
+        """ Called on the I/O thread: moves any held-back events into the event queue, as space allows. """
+
+        while self._overflow and self.events.try_put(self._overflow[0]):
+            self._overflow.popleft()
+
+        self._signal()
+
+
+    def _signal(self):
+        """ Called on the I/O thread: wakes the asyncio thread to drain the event queue. """
+
+        # Only wake the loop if it isn't already due to drain the queue. The consumer clears this
+        # flag before draining, and we check it after enqueueing; so an event can't be stranded.
+        if not self._signalled:
+            self._signalled = True
+            self._loop.call_soon_threadsafe(self._wakeup.set)
+
+
+    def post_call(self, method, args, kwargs, done=None):
+        """ Called on the asyncio thread: queues a call to be made on the backend by the I/O thread. """
+
+        # If the I/O thread has died, there's no one to make the call; don't leave the caller waiting.
+        if not self._running:
+            if done is not None:
+                done.cancel()
+            return
+
+        self.calls.put((method, args, kwargs, done), running=self._is_running)
+
+
+    def _is_running(self):
+        return self._running
+
+
+    def wait_for_call(self, done: Future):
+        """ Called on the asyncio thread: waits for a call to be performed; and returns its result.
+
+        If the I/O thread stops first, the call never will be; so we stop waiting, and raise
+        whatever stopped it. If it stopped cleanly, the call is left cancelled, and we return None.
+        """
+
+        while True:
+            try:
+                return done.result(self.CALL_WAIT_INTERVAL)
+            except TimeoutError:
+                if not self._running:
+                    self._release_waiters()
+            except CancelledError:
+                if self._error is not None:
+                    raise self._error
+                return None
+
+
+    #
+    # I/O thread.
+    #
+
+    def _perform_calls(self):
+        for method, args, kwargs, done in self.calls.drain():
+            try:
+                result = method(*args, **kwargs)
+            except BaseException as e:
+                if done is not None:
+                    done.set_exception(e)
+                raise
+
+            if done is not None:
+                done.set_result(result)
+
+
+    def _service(self):
+        """ Main loop of the I/O thread. """
+
+        try:
+            while self._running:
+                self._perform_calls()
+
+                # Only poll for new events once the asyncio thread has caught up with the old ones;
+                # until then, the hardware NAKs the host for us.
+                if self._overflow:
+                    self._flush_overflow()
+                else:
+                    self.backend.service_irqs()
+
+                # Give the asyncio thread a chance to take the interpreter lock.
+                time.sleep(0)
+
+            # Flush anything the device queued before we were stopped; e.g. a final response.
+            self._perform_calls()
+
+        except BaseException as e:
+            self._error   = e
+            self._running = False
+            self._release_waiters()
+            self._loop.call_soon_threadsafe(self._wakeup.set)
+
+
+    #
+    # asyncio side.
+    #
+
+    def start(self):
+        """ Starts the I/O thread, and routes the device's backend traffic through it. """
+
+        self._loop    = asyncio.get_running_loop()
+        self._wakeup  = asyncio.Event()
+        self._running = True
+
+        self.device.backend = self._backend_proxy
+        self.backend.connected_device = self._device_proxy
+
+        self._thread = threading.Thread(target=self._service, name="facedancer-io", daemon=True)
+        self._thread.start()
+
+
+    def stop(self):
+        """ Stops the I/O thread, and returns the device and backend to talking to each other directly. """
+
+        self._running = False
+        if self._thread is not None:
+            self._thread.join()
+            self._thread = None
+
+        self.device.backend = self.backend
+        self.backend.connected_device = self.device
+
+        self._release_waiters()
+
+
+    def _release_waiters(self):
+        """ Releases anyone still waiting on a blocking call that will never make it to the backend. """
+        for _method, _args, _kwargs, done in self.calls.drain():
+            if done is not None:
+                done.cancel()
+
+
+    async def run(self):
+        """ Handles the backend's events on the current event loop, until cancelled. """
+
+        self.start()
+
+        try:
+            while True:
+                await self._wakeup.wait()
+                self._wakeup.clear()
+                self._signalled = False
+
+                if self._error is not None:
+                    raise self._error
+
+                for handler, args, key in self.events.drain():
+                    if key is not None:
+                        self.pending.discard(key)
+
+                    handler(*args)
+
+                    # Let any other coroutines run between events, so a burst can't starve them.
+                    await asyncio.sleep(0)
+
+        finally:
+            self.stop()
+            log.debug("I/O thread stopped")
@@ -15,7 +15,7 @@ from ..types          import DeviceSpeed, USBDirection
 
 from ..logging        import log
 
-from .base            import FacedancerBackend
+from .base            import FacedancerBackend, ControlDataStage, board_selection, set_bits
 
 
 # Quirk flags
@@ -83,13 +83,20 @@ class MoondancerApp(FacedancerApp, FacedancerBackend):
     # Number of supported USB endpoints.
     SUPPORTED_ENDPOINTS = 16
 
-    def __init__(self, device: USBDevice=None, verbose: int=0, quirks: List[str]=[]):
+    # Largest IN transfer we can hand to write_endpoint(); the firmware packetizes it.
+    MAX_TRANSFER_SIZE = 768
+
+    # We can be pointed at a particular Cynthion by serial number.
+    SUPPORTS_BOARD_SELECTION = True
+
+    def __init__(self, device: USBDevice=None, verbose: int=0, quirks: List[str]=[], serial_number: str=None):
         """
         Sets up a new Cynthion-backed Facedancer (Moondancer) application.
 
         Args:
-            device  : The Cynthion device that will act as our Moondancer.
-            verbose : The verbosity level of the given application.
+            device        : The Cynthion device that will act as our Moondancer.
+            verbose       : The verbosity level of the given application.
+            serial_number : If provided, and no device is, the serial number of the Cynthion to use.
         """
 
         log.info("Using the Moondancer backend.")
@@ -97,15 +104,22 @@ class MoondancerApp(FacedancerApp, FacedancerBackend):
         import cynthion
 
         if device is None:
-            device = cynthion.Cynthion()
+            device = cynthion.Cynthion(**board_selection(serial_number))
 
         self.device = device
 
         self.device.comms.get_exclusive_access()
+        self.has_exclusive_access = True
 
         FacedancerApp.__init__(self, device, verbose)
         self.connected_device = None
 
+        # Transmit FIFOs and the endpoint table start empty; they're filled once we're configured.
+        self.initialize_endpoint_state()
+
+        # Bitmap of held OUT endpoints we've left unprimed; we prime them once they're released.
+        self._unprimed_out_endpoints = 0
+
         # Grab the raw API object from the Cynthion object.
         # This has the low-level RPCs used for raw USB control.
         self.api = self.device.apis.moondancer
@@ -143,10 +157,14 @@ class MoondancerApp(FacedancerApp, FacedancerBackend):
     # - Facedancer backend methods --------------------------------------------
 
     @classmethod
-    def appropriate_for_environment(cls, backend_name: str) -> bool:
+    def appropriate_for_environment(cls, backend_name: str, serial_number: str=None) -> bool:
         """
         Determines if the current environment seems appropriate
         for using the Moondancer backend.
+
+        Args:
+            backend_name  : Backend name being requested. (Optional)
+            serial_number : Serial number of the Cynthion we must use. (Optional)
         """
 
         # Check: if we have a backend name other than moondancer,
@@ -158,7 +176,7 @@ class MoondancerApp(FacedancerApp, FacedancerBackend):
         # see if there's a connected Cynthion.
         try:
             import cynthion
-            device = cynthion.Cynthion()
+            device = cynthion.Cynthion(**board_selection(serial_number))
             return device.supports_api('moondancer')
         except ImportError:
             log.debug("Skipping Cynthion-based devices, as the cynthion python module isn't installed.")
@@ -193,6 +211,11 @@ class MoondancerApp(FacedancerApp, FacedancerBackend):
 
         self.max_packet_size_ep0 = max_packet_size_ep0
 
+        # If a previous disconnect() gave up the Cynthion, reclaim it; e.g. when cycling connections.
+        if not self.has_exclusive_access:
+            self.device.comms.get_exclusive_access()
+            self.has_exclusive_access = True
+
         # compute our quirk flags
         quirks = 0
         if 'manual_set_address' in self.quirks:
@@ -215,6 +238,7 @@ class MoondancerApp(FacedancerApp, FacedancerBackend):
         log.info("Disconnecting from target host.")
 
         self.device.comms.release_exclusive_access()
+        self.has_exclusive_access = False
 
         # disconnect from target host
         self.api.disconnect()
@@ -228,6 +252,8 @@ class MoondancerApp(FacedancerApp, FacedancerBackend):
 
         log.debug(f"moondancer.bus_reset()")
 
+        self.flush_tx_fifos()
+        self._unprimed_out_endpoints = 0
         self.api.bus_reset()
 
 
@@ -261,6 +287,8 @@ class MoondancerApp(FacedancerApp, FacedancerBackend):
             log.error("Target host configuration could not be applied.")
             return
 
+        self.flush_tx_fifos()
+
         # If we need to issue a configuration command, issue one.
         # (If there are no endpoints other than control, this command will be
         #  empty, and we can skip this.)
@@ -281,6 +309,7 @@ class MoondancerApp(FacedancerApp, FacedancerBackend):
 
         # save configuration
         self.configuration = configuration
+        self.update_endpoint_table()
 
         # If we've just set up endpoints, check to see if any of them
         # have NAKs waiting.
@@ -394,6 +423,13 @@ class MoondancerApp(FacedancerApp, FacedancerBackend):
         Moondancer's execution status, and reacts as events occur.
         """
 
+        # Prime any OUT endpoints the device has released since we last left them unprimed.
+        released = self._unprimed_out_endpoints & ~self._held_out_endpoints
+        if released:
+            self._unprimed_out_endpoints &= ~released
+            for endpoint_number in set_bits(released):
+                self.api.ep_out_prime_receive(endpoint_number)
+
         # Get latest interrupt events
         events: List[Tuple[int, int]] = self.api.get_interrupt_events()
 
@@ -471,7 +507,7 @@ class MoondancerApp(FacedancerApp, FacedancerBackend):
         # in handle_transfer_complete_on_endpoint.
         if is_out and has_data:
             log.debug(f"  setup packet has data - queueing read")
-            self.pending_control_request = request
+            self.pending_control_request = ControlDataStage(request, self.max_packet_size_ep0)
             self.api.ep_out_prime_receive(endpoint_number)
             return
 
@@ -508,15 +544,10 @@ class MoondancerApp(FacedancerApp, FacedancerBackend):
             log.debug(f"  handling control data stage: {len(new_data)} bytes")
             log.trace(f"  moondancer.api.read_endpoint({endpoint_number}) -> {len(new_data)}")
 
-            # Append our new data to the pending control request.
-            self.pending_control_request.data.extend(new_data)
-
-            all_data_received = len(self.pending_control_request.data) == self.pending_control_request.length
-            is_short_packet   = len(new_data) < self.max_packet_size_ep0
-
-            if all_data_received or is_short_packet:
+            # Add our new data to the pending control request's data stage.
+            if self.pending_control_request.add(new_data):
                 # Handle the completed setup request...
-                self.connected_device.handle_request(self.pending_control_request)
+                self.connected_device.handle_request(self.pending_control_request.request)
 
                 # And clear our pending setup data.
                 self.pending_control_request = None
@@ -541,8 +572,12 @@ class MoondancerApp(FacedancerApp, FacedancerBackend):
         # Pass it to the device's handler
         self.connected_device.handle_data_available(endpoint_number, data)
 
-        # Finally, Prime endpoint to receive again.
-        self.api.ep_out_prime_receive(endpoint_number)
+        # Finally, Prime endpoint to receive again; unless the device has no room for more data,
+        # in which case the host is NAK'd until it's released.
+        if self.out_endpoint_held(endpoint_number):
+            self._unprimed_out_endpoints |= 1 << endpoint_number
+        else:
+            self.api.ep_out_prime_receive(endpoint_number)
 
 
     # USB0_SEND_COMPLETE
@@ -552,8 +587,11 @@ class MoondancerApp(FacedancerApp, FacedancerBackend):
 
     # Handle pending data requests on EP_IN
     def handle_ep_in_nak_status(self, nak_status: int):
-        nakked_endpoints = [epno for epno in range(self.SUPPORTED_ENDPOINTS) if (nak_status >> epno) & 1]
-        for endpoint_number in nakked_endpoints:
-            if endpoint_number != 0:
-                log.trace(f"Received IN NAK on ep{endpoint_number}")
+        # Walk only the set bits of our configured IN endpoints; this skips endpoint zero,
+        # whose NAKs are handled by the control logic.
+        for endpoint_number in set_bits(nak_status & self.endpoint_table.in_mask):
+            log.trace(f"Received IN NAK on ep{endpoint_number}")
+
+            # Prime straight from the endpoint's transmit FIFO if we can; only asking the device if it's empty.
+            if not self.prime_from_tx_fifo(endpoint_number):
                 self.connected_device.handle_nak(endpoint_number)
@@ -54,6 +54,9 @@ class RaspdancerMaxUSBApp(MAXUSBApp):
         FacedancerApp.__init__(self, device, verbose)
 
         self.connected_device = None
+
+        # Transmit FIFOs and the endpoint table start empty; they're filled once we're configured.
+        self.initialize_endpoint_state()
         self.enable()
 
         if verbose > 0:
@@ -0,0 +1,486 @@
+#
+# This file is part of Facedancer.
+#
+""" A simulated USB host, running on a virtual clock.
+
+The virtual backend connects an emulated device to a host model implemented in Python,
+rather than to real hardware. The host enumerates the device, polls its interrupt and
+isochronous IN endpoints at their descriptor-specified intervals, and accepts OUT data and
+control transfers from test code.
+
+Time is simulated: each call to ``service_irqs()`` moves a virtual clock straight to the next
+thing that can happen -- an endpoint poll, or a timer on the event loop, such as a device
+coroutine's ``asyncio.sleep()`` -- without waiting. When run on the event loop from
+:meth:`VirtualHostBackend.create_event_loop`, ``asyncio.sleep()`` and ``loop.time()`` both use the
+virtual clock; so interactions that take hours of device time complete as fast as Python can
+process them, and do so deterministically. On any other event loop, the virtual clock never runs
+ahead of the loop's own::
+
+    device  = USBKeyboardDevice()
+    results = simulate(device, device.type_string("hello"))
+
+Select this backend with ``BACKEND=virtual``; ``emulate()`` then runs on virtual time as well.
+"""
+
+import heapq
+import asyncio
+import selectors
+
+from collections   import defaultdict, deque
+from typing        import Iterable, List
+
+from ..core        import FacedancerApp
+from ..types       import DeviceSpeed, USBDirection, USBTransferType
+from ..logging     import log
+
+from .base         import FacedancerBackend
+
+
+class VirtualClock:
+    """ Simulated time, in seconds; divided into (micro)frames like the USB bus it simulates. """
+
+    def __init__(self, frame_period: float = 0.001):
+        self.now          = 0.0
+        self.frame_period = frame_period
+
+
+    @property
+    def frame_number(self) -> int:
+        """ The current 11-bit SOF frame number. """
+        return int(self.now / self.frame_period) & 0x7ff
+
+
+    def advance_to(self, when: float):
+        """ Moves the clock forward to the given time; never backwards. """
+        if when > self.now:
+            self.now = when
+
+
+    def advance(self, duration: float):
+        self.now += duration
+
+
+
+class _VirtualTimeSelector(selectors.DefaultSelector):
+    """ Selector that, rather than sleeping until the event loop's next timer, advances the virtual clock to it. """
+
+    def __init__(self, clock: VirtualClock):
+        super().__init__()
+        self._clock = clock
+
+
+    def select(self, timeout=None):
+
+        # With nothing to wait for but timers, skip straight to the first one; after a quick check
+        # for real I/O, such as a call_soon_threadsafe() wakeup.
+        if timeout is not None and timeout > 0:
+            events = super().select(0)
+            if not events:
+                self._clock.advance(timeout)
+            return events
+
+        return super().select(timeout)
+
+
+
+class VirtualClockEventLoop(asyncio.SelectorEventLoop):
+    """ Event loop whose time is a VirtualClock; so sleeps complete instantly, in simulated time. """
+
+    def __init__(self, clock: VirtualClock):
+        self.clock = clock
+        super().__init__(_VirtualTimeSelector(clock))
+
+        # Heap of (when, sequence, handle) for every timer scheduled; so we can tell when the next one is due.
+        self._timers   = []
+        self._sequence = 0
+
+
+    def time(self):
+        return self.clock.now
+
+
+    def call_at(self, when, callback, *args, **kwargs):
+        handle = super().call_at(when, callback, *args, **kwargs)
+
+        self._sequence += 1
+        heapq.heappush(self._timers, (when, self._sequence, handle))
+
+        return handle
+
+
+    def next_timer(self) -> float:
+        """ Returns the time at which the next live timer is due; or None if there are none. """
+
+        while self._timers:
+            when, _, handle = self._timers[0]
+
+            # Timers in the past have already been run by the time we're asked.
+            if handle.cancelled() or when < self.clock.now:
+                heapq.heappop(self._timers)
+                continue
+
+            return when
+
+        return None
+
+
+
+class VirtualHostBackend(FacedancerApp, FacedancerBackend):
+    """ Backend that connects the emulated device to a simulated host; see the module documentation. """
+
+    app_name = "Virtual host"
+
+    # The address the simulated host assigns during enumeration.
+    DEVICE_ADDRESS = 1
+
+
+    @classmethod
+    def appropriate_for_environment(cls, backend_name: str) -> bool:
+        # Never picked automatically; only when explicitly requested.
+        return backend_name == "virtual"
+
+
+    def __init__(self, device=None, verbose: int=0, quirks: List[str]=None, max_received: int=None):
+        """
+        Sets up a new simulated host.
+
+        Args:
+            device       : Unused; present for compatibility with other backends.
+            verbose      : The verbosity level of the given application.
+            max_received : If provided, the most packets to keep per IN endpoint, when nothing reads
+                           them; the oldest are dropped first.
+        """
+
+        FacedancerApp.__init__(self, device, verbose)
+        self.quirks = quirks or []
+
+        self.clock            = VirtualClock()
+        self.connected_device = None
+
+        # Transmit FIFOs and the endpoint table start empty; they're filled once we're configured.
+        self.initialize_endpoint_state()
+
+        # Whether the host should enumerate and configure the device by itself, once connected.
+        self.auto_enumerate = True
+        self.enumerated     = False
+
+        # Device state, as the host sees it.
+        self.address        = 0
+        self.configuration  = None
+        self.stalled        = set()
+
+        # Data the device has sent on each IN endpoint, and data waiting to be sent to each OUT endpoint.
+        self.received       = defaultdict(lambda: deque(maxlen=max_received))
+        self.pending_out    = defaultdict(deque)
+
+        # Maps IN endpoint numbers => [poll period, next poll time]; for each endpoint the host is polling.
+        self.polling        = {}
+
+        # Everything the device has sent on the control endpoint in the current control transfer.
+        self._control_data  = None
+
+        # On an ordinary event loop: the loop time at which our virtual clock read zero.
+        self._loop_epoch    = None
+
+
+    def create_event_loop(self) -> VirtualClockEventLoop:
+        """ Creates an event loop that runs on this host's virtual clock. """
+        return VirtualClockEventLoop(self.clock)
+
+
+    def get_version(self):
+        return None
+
+
+    #
+    # Device-facing interface.
+    #
+
+    def connect(self, usb_device, max_packet_size_ep0: int=64, device_speed: DeviceSpeed=DeviceSpeed.FULL):
+        self.connected_device    = usb_device
+        self.max_packet_size_ep0 = max_packet_size_ep0
+        self.device_speed        = device_speed
+
+        # High speed buses run on 125us microframes; everything else, on 1ms frames.
+        self.clock.frame_period = 0.000125 if device_speed == DeviceSpeed.HIGH else 0.001
+
+        self.enumerated = False
+
+
+    def disconnect(self):
+        self.connected_device = None
+        self.configuration    = None
+        self.polling.clear()
+
+
+    def reset(self):
+        self.address       = 0
+        self.configuration = None
+        self.stalled.clear()
+        self.polling.clear()
+        self.flush_tx_fifos()
+
+
+    def set_address(self, address: int, defer: bool=False):
+        self.address = address
+
+
+    def configured(self, configuration):
+        self.flush_tx_fifos()
+        self.configuration = configuration
+        self.polling.clear()
+
+        if configuration is None:
+            return
+
+        # Like a real host, poll each periodic IN endpoint at the interval its descriptor requests.
+        for interface in configuration.get_interfaces():
+            for endpoint in interface.get_endpoints():
+                if endpoint.direction != USBDirection.IN:
+                    continue
+                if endpoint.transfer_type in (USBTransferType.INTERRUPT, USBTransferType.ISOCHRONOUS):
+                    self.start_polling(endpoint.number, self._poll_period(endpoint))
+
+
+    def read_from_endpoint(self, endpoint_number: int) -> bytes:
+        packets = self.pending_out[endpoint_number]
+        return packets.popleft() if packets else b""
+
+
+    def send_on_endpoint(self, endpoint_number: int, data: bytes, blocking: bool=True):
+        if endpoint_number == 0:
+            if self._control_data is not None:
+                self._control_data += data
+            return
+
+        self.received[endpoint_number].append(bytes(data))
+
+
+    def ack_status_stage(self, direction: USBDirection=USBDirection.OUT, endpoint_number:int =0, blocking: bool=False):
+        pass
+
+
+    def stall_endpoint(self, endpoint_number: int, direction: USBDirection=USBDirection.OUT):
+        self.stalled.add(endpoint_number)
+
+
+    def service_irqs(self):
+        """ Runs the host for one step; then moves the clock on to the next time anything can happen. """
+
+        device = self.connected_device
+        if device is None:
+            self.clock.advance_to(self._next_event_time(self.clock.now))
+            return
+
+        if self.auto_enumerate and not self.enumerated:
+            self.enumerate()
+
+        now = self.clock.now
+
+        # Deliver one packet to each OUT endpoint with data waiting, and room for it...
+        for endpoint_number, packets in self.pending_out.items():
+            if packets and not self.out_endpoint_held(endpoint_number):
+                device.handle_data_available(endpoint_number, packets.popleft())
+
+        # ... and issue an IN token to each endpoint whose poll is due.
+        for endpoint_number, schedule in list(self.polling.items()):
+            period, due = schedule
+            if due <= now:
+                self.poll(endpoint_number)
+                schedule[1] = max(due + period, now)
+
+        self.clock.advance_to(self._next_event_time(now))
+
+
+    def _next_event_time(self, now: float) -> float:
+        """ Figures out when the next thing can happen; so we can skip any idle time before it. """
+
+        candidates = [due for _, due in self.polling.values()]
+
+        if any(self.pending_out.values()):
+            candidates.append(now + self.clock.frame_period)
+
+        try:
+            loop = asyncio.get_running_loop()
+        except RuntimeError:
+            loop = None
+
+        if isinstance(loop, VirtualClockEventLoop):
+            timer = loop.next_timer()
+            if timer is not None:
+                candidates.append(timer)
+
+        # If there's truly nothing scheduled, let a single idle frame go by.
+        next_event = min(candidates) if candidates else now + self.clock.frame_period
+
+        # On an ordinary event loop, everything else runs in real time; so the host must too, or it
+        # would poll the device as fast as we can call it.
+        if loop is not None and not isinstance(loop, VirtualClockEventLoop):
+            if self._loop_epoch is None:
+                self._loop_epoch = loop.time() - now
+            next_event = min(next_event, loop.time() - self._loop_epoch)
+
+        return max(now, next_event)
+
+
+    def _poll_period(self, endpoint) -> float:
+        """ Returns how often the host polls a periodic endpoint; per USB2 [9.6.6]. """
+
+        interval = max(1, endpoint.interval)
+
+        # High speed intervals, and all isochronous intervals, are exponents.
+        if self.device_speed == DeviceSpeed.HIGH or endpoint.transfer_type == USBTransferType.ISOCHRONOUS:
+            return self.clock.frame_period * (1 << (min(interval, 16) - 1))
+
+        return self.clock.frame_period * interval
+
+
+    #
+    # Host-facing interface; for use by tests and simulations.
+    #
+
+    def control_transfer(self, request_type: int, request: int, value: int = 0, index: int = 0,
+            length: int = 0, data: bytes = b"") -> bytes:
+        """ Performs a control transfer, and returns the data stage's contents; or None if the device stalled.
+
+        Args:
+            request_type : The bmRequestType for the request.
+            request      : The bRequest number.
+            value        : The wValue for the request.
+            index        : The wIndex for the request.
+            length       : The wLength for IN requests; the data's length is used for OUT requests.
+            data         : The data stage for OUT requests.
+        """
+
+        if not request_type & 0x80:
+            length = len(data)
+
+        setup = bytes([request_type, request, value & 0xff, value >> 8, index & 0xff, index >> 8,
+            length & 0xff, length >> 8])
+
+        self.stalled.discard(0)
+        self._control_data = bytearray()
+
+        try:
+            device = self.connected_device
+            device.handle_request(device.create_request(setup + bytes(data)))
+            response = self._control_data
+        finally:
+            self._control_data = None
+
+        if 0 in self.stalled:
+            return None
+
+        return bytes(response[:length]) if request_type & 0x80 else bytes(response)
+
+
+    def enumerate(self, configuration: int = 1) -> bool:
+        """ Enumerates and configures the device, as a typical host would. Returns true on success. """
+
+        self.enumerated = True
+
+        device_descriptor = self.control_transfer(0x80, 6, 0x0100, 0, 64)
+        if not device_descriptor:
+            log.warning("virtual host: device didn't provide a device descriptor")
+            return False
+
+        self.control_transfer(0x00, 5, self.DEVICE_ADDRESS)
+        self.control_transfer(0x80, 6, 0x0100, 0, 18)
+
+        header = self.control_transfer(0x80, 6, 0x0200 | (configuration - 1), 0, 9)
+        if not header or len(header) < 4:
+            log.warning("virtual host: device didn't provide a configuration descriptor")
+            return False
+
+        total_length = header[2] | (header[3] << 8)
+        self.control_transfer(0x80, 6, 0x0200 | (configuration - 1), 0, total_length)
+
+        return self.control_transfer(0x00, 9, configuration) is not None
+
+
+    def start_polling(self, endpoint_number: int, period: float = None):
+        """ Starts issuing IN tokens to an endpoint regularly; e.g. to read from a bulk endpoint.
+
+        Args:
+            endpoint_number : The IN endpoint to poll.
+            period          : How often to poll it, in seconds; or every frame if not provided.
+        """
+        period = period or self.clock.frame_period
+        self.polling[endpoint_number] = [period, self.clock.now]
+
+
+    def stop_polling(self, endpoint_number: int):
+        """ Stops polling an IN endpoint. """
+        self.polling.pop(endpoint_number, None)
+
+
+    def poll(self, endpoint_number: int):
+        """ Issues a single IN token to an endpoint; the device's response is added to received[]. """
+
+        if not self.prime_from_tx_fifo(endpoint_number):
+            self.connected_device.handle_nak(endpoint_number)
+
+
+    def send(self, endpoint_number: int, data: bytes, packet_size: int = 64):
+        """ Queues data to be sent to an OUT endpoint, one packet per frame.
+
+        Args:
+            endpoint_number : The OUT endpoint to send to.
+            data            : The data to send.
+            packet_size     : The endpoint's maximum packet size.
+        """
+
+        packets = self.pending_out[endpoint_number]
+
+        for offset in range(0, len(data), packet_size):
+            packets.append(bytes(data[offset:offset + packet_size]))
+
+        if not data:
+            packets.append(b"")
+
+
+    def read(self, endpoint_number: int) -> bytes:
+        """ Returns (and discards) everything the device has sent on an IN endpoint so far. """
+
+        packets = self.received[endpoint_number]
+
+        data = b"".join(packets)
+        packets.clear()
+
+        return data
+
+
+
+def simulate(device, *coroutines: Iterable, backend: VirtualHostBackend = None) -> list:
+    """ Runs a device against a simulated host, on virtual time, until the given coroutines complete.
+
+    Args:
+        device     : The device to simulate.
+        coroutines : Coroutines to run alongside the device; e.g. a test's host-side script.
+        backend    : The simulated host to use; a new VirtualHostBackend is created if not provided.
+
+    Returns the coroutines' results.
+    """
+
+    if backend is None:
+        backend = device.backend if isinstance(device.backend, VirtualHostBackend) else VirtualHostBackend()
+
+    device.backend = backend
+    device.connect()
+
+    async def inner():
+        emulation = asyncio.ensure_future(device.run())
+
+        try:
+            return await asyncio.gather(*coroutines)
+        finally:
+            emulation.cancel()
+            await asyncio.gather(emulation, return_exceptions=True)
+
+    loop = backend.create_event_loop()
+
+    try:
+        return loop.run_until_complete(inner())
+    finally:
+        device.disconnect()
+        loop.close()
@@ -3,11 +3,14 @@
 #
 """ Code for implementing HID classes. """
 
+import struct
+
 from enum        import IntEnum
 from dataclasses import dataclass
 from typing      import Tuple, Iterable
 
-from ...descriptor import USBDescriptor, USBDescriptorTypeNumber
+from ...descriptor import USBDescriptor, USBClassDescriptor, USBDescriptorTypeNumber
+from ..            import USBDeviceClass
 
 
 #
@@ -139,3 +142,33 @@ class HIDReportDescriptor(USBDescriptor):
             raw.extend(field)
 
         return bytes(raw)
+
+
+
+@dataclass
+class HIDClassDescriptor(USBClassDescriptor):
+    """ The HID descriptor found on HID interfaces; from HID1.11 [6.2.1].
+
+    Type 0x21 means something different on other classes' interfaces (e.g. a DFU functional
+    descriptor), so this is only used to parse descriptors found on HID interfaces.
+    """
+
+    DESCRIPTOR_TYPE_NUMBER     = USBDescriptorTypeNumber.HID
+    DESCRIPTOR_INTERFACE_CLASS = USBDeviceClass.HID
+
+    # The bcdHID version, country code, and the (type, length) of each subordinate descriptor.
+    hid_version  : int                         = 0x0111
+    country_code : int                         = 0
+    descriptors  : Tuple[Tuple[int, int], ...] = ()
+
+    @classmethod
+    def from_binary_descriptor(cls, data):
+        raw = bytes(data)
+        hid_version, country_code, count = struct.unpack_from("<HBB", raw, 2)
+
+        # Tolerate descriptors that claim more subordinates than they hold.
+        count       = min(count, (len(raw) - 6) // 3)
+        descriptors = tuple(struct.unpack_from("<BH", raw, 6 + 3 * n) for n in range(count))
+
+        return cls(number=None, raw=raw, type_number=raw[1], hid_version=hid_version,
+            country_code=country_code, descriptors=descriptors)
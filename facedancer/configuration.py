@@ -16,6 +16,9 @@ from .interface   import USBInterface
 from .descriptor  import USBDescribable, USBClassDescriptor
 from .endpoint    import USBEndpoint
 
+# Class-specific descriptor parsers register themselves when they're defined; make sure they are.
+from .classes.hid.descriptor import HIDClassDescriptor
+
 
 
 @dataclass
@@ -31,6 +34,10 @@ class USBConfiguration(USBDescribable, AutoInstantiable, USBRequestHandler):
             The maximum power expected to be drawn by the device when using this interface, in mA. Typically 500mA, for maximum possible.
         supports_remote_wakeup:
             True iff this device should be able to wake the host from suspend.
+
+    Endpoint lookups are served from an index of our interfaces' endpoints, which is rebuilt
+    after ``add_interface`` or ``USBInterface.add_endpoint``; code that modifies ``interfaces``
+    or an interface's ``endpoints`` directly should call ``endpoints_changed()`` afterwards.
     """
 
     DESCRIPTOR_TYPE_NUMBER  = 0x02
@@ -47,6 +54,9 @@ class USBConfiguration(USBDescribable, AutoInstantiable, USBRequestHandler):
     parent                 : USBDescribable = None
     interfaces             : USBInterface   = field(default_factory=dict)
 
+    # Maps endpoint address -> (endpoint, owning interface); or None if it needs to be rebuilt.
+    _endpoint_index        : dict           = field(default=None, init=False, repr=False, compare=False)
+
 
     @classmethod
     def from_binary_descriptor(cls, data):
@@ -58,11 +68,12 @@ class USBConfiguration(USBDescribable, AutoInstantiable, USBRequestHandler):
             data: The raw bytes for the descriptor to be parsed.
         """
 
+        data   = memoryview(data)
         length = data[0]
 
         # Unpack the main collection of data into the descriptor itself.
         descriptor_type, total_length, num_interfaces, index, string_index, \
-            attributes, max_power = struct.unpack_from('<xBHBBBBB', data[0:length])
+            attributes, max_power = struct.unpack_from('<xBHBBBBB', data)
 
         # Extract the subordinate descriptors, and parse them.
         interfaces = cls._parse_subordinate_descriptors(data[length:total_length])
@@ -73,7 +84,7 @@ class USBConfiguration(USBDescribable, AutoInstantiable, USBRequestHandler):
         return cls(
             number=index,
             configuration_string=string_index,
-            max_power=max_power,
+            max_power=max_power * 2,
             self_powered=(attributes >> 6) & 1,
             supports_remote_wakeup=(attributes >> 5) & 1,
             interfaces=interfaces,
@@ -90,25 +101,24 @@ class USBConfiguration(USBDescribable, AutoInstantiable, USBRequestHandler):
         """
 
         # TODO: handle recieving interfaces out of order?
-        interfaces = []
+        interfaces      = []
+        interface_class = None
 
-        # Continue parsing until we run out of descriptors.
-        while data:
-
-            # Determine the length and type of the next descriptor.
-            length     = data[0]
-            descriptor = USBDescribable.from_binary_descriptor(data[:length])
+        # Walk each descriptor in turn; each is a view into the original data, rather than a copy.
+        for raw_descriptor in USBDescribable.iterate_binary_descriptors(data):
+            descriptor = USBDescribable.from_binary_descriptor(raw_descriptor, interface_class=interface_class)
 
             # If we have an interface descriptor, add it to our list of interfaces.
             if isinstance(descriptor, USBInterface):
                 interfaces.append(descriptor)
+                interface_class = descriptor.class_number
+            elif not interfaces:
+                continue
             elif isinstance(descriptor, USBEndpoint):
                 interfaces[-1].add_endpoint(descriptor)
             elif isinstance(descriptor, USBClassDescriptor):
-                interfaces[-1].set_class(descriptor)
-
-            # Move on to the next descriptor.
-            data = data[length:]
+                interface = interfaces[-1]
+                interface.class_descriptor = (interface.class_descriptor or b"") + descriptor.raw
 
         return interfaces
 
@@ -147,6 +157,40 @@ class USBConfiguration(USBDescribable, AutoInstantiable, USBRequestHandler):
         self.interfaces[interface.number] = interface
         interface.parent = self
 
+        self.endpoints_changed()
+
+
+    def endpoints_changed(self):
+        """ Discards our endpoint index, so it's rebuilt on next use; e.g. after an interface's endpoints change. """
+        self._endpoint_index = None
+
+
+    def _lookup_endpoint(self, number: int, direction: USBDirection):
+        """ Returns the (endpoint, interface) pair for the given number + direction; or (None, None). """
+
+        index = self._endpoint_index
+        if index is None:
+            index = self._endpoint_index = self._build_endpoint_index()
+
+        return index.get(USBEndpoint.address_for_number(number, direction), (None, None))
+
+
+    def _build_endpoint_index(self) -> dict:
+        index = {}
+
+        for interface in self.interfaces.values():
+            for candidate in interface.get_endpoints():
+
+                # Ask the interface which endpoint currently answers to each address it uses;
+                # interfaces with alternate settings may answer with their active setting's.
+                endpoint = interface.get_endpoint(candidate.number, candidate.direction)
+
+                # As when searching, the first interface to claim an address owns it.
+                if endpoint is not None:
+                    index.setdefault(endpoint.get_address(), (endpoint, interface))
+
+        return index
+
 
     def get_endpoint(self, number: int, direction: USBDirection) -> USBEndpoint:
         """ Attempts to find an endpoint with the given number + direction.
@@ -156,14 +200,8 @@ class USBConfiguration(USBDescribable, AutoInstantiable, USBRequestHandler):
             direction : Whether to look for an IN or OUT endpoint.
         """
 
-        # Search each of our interfaces for the relevant endpoint.
-        for interface in self.interfaces.values():
-            endpoint = interface.get_endpoint(number, direction)
-            if endpoint is not None:
-                return endpoint
-
-        # If none have one, return None.
-        return None
+        endpoint, _ = self._lookup_endpoint(number, direction)
+        return endpoint
 
 
     #
@@ -184,10 +222,10 @@ class USBConfiguration(USBDescribable, AutoInstantiable, USBRequestHandler):
             data     : The raw bytes received on the relevant endpoint.
         """
 
-        for interface in self.interfaces.values():
-            if interface.has_endpoint(endpoint.number, direction=USBDirection.OUT):
-                interface.handle_data_received(endpoint, data)
-                return
+        _, interface = self._lookup_endpoint(endpoint.number, USBDirection.OUT)
+        if interface is not None:
+            interface.handle_data_received(endpoint, data)
+            return
 
         # If no interface owned the targeted endpoint, consider the data unexpected.
         self.get_device().handle_unexpected_data_received(endpoint.number, data)
@@ -204,10 +242,10 @@ class USBConfiguration(USBDescribable, AutoInstantiable, USBRequestHandler):
             endpoint : The endpoint on which the host requested data.
         """
 
-        for interface in self.interfaces.values():
-            if interface.has_endpoint(endpoint.number, direction=USBDirection.IN):
-                interface.handle_data_requested(endpoint)
-                return
+        _, interface = self._lookup_endpoint(endpoint.number, USBDirection.IN)
+        if interface is not None:
+            interface.handle_data_requested(endpoint)
+            return
 
         # If no one interface owned the targeted endpoint, consider the data unexpected.
         self.get_device().handle_unexpected_data_requested(endpoint.number)
@@ -223,10 +261,9 @@ class USBConfiguration(USBDescribable, AutoInstantiable, USBRequestHandler):
         This function is called only once per buffer.
         """
 
-        for interface in self.interfaces.values():
-            if interface.has_endpoint(endpoint.number, direction=USBDirection.IN):
-                interface.handle_buffer_empty(endpoint)
-                return
+        _, interface = self._lookup_endpoint(endpoint.number, USBDirection.IN)
+        if interface is not None:
+            interface.handle_buffer_empty(endpoint)
 
 
 
@@ -5,37 +5,80 @@
 # and GoodFETMonitorApp.
 
 import os
+import time
+import math
+import heapq
+import asyncio
+import itertools
 
 from .errors import *
+from .types  import DeviceSpeed, USBTransferType
 
 
-def FacedancerUSBApp(verbose=0, quirks=None):
+def FacedancerUSBApp(verbose=0, quirks=None, *, serial_number=None, bus_path=None):
     """
     Convenience function that automatically creates a FacedancerApp
     based on the BOARD environment variable and some crude internal
     automagic.
 
     Args:
-        verbose : Sets the verbosity level of the relevant app. Increasing
-                  this from zero yields progressively more output.
+        verbose       : Sets the verbosity level of the relevant app. Increasing
+                        this from zero yields progressively more output.
+        serial_number : If provided, only the board with this USB serial number is used.
+        bus_path      : If provided, only the board at this USB bus path (e.g. "1-4.2",
+                        as used in sysfs) is used.
     """
-    return FacedancerApp.autodetect(verbose, quirks)
+
+    if bus_path is not None:
+        serial_number = serial_number_for_bus_path(bus_path)
+
+    return FacedancerApp.autodetect(verbose, quirks, serial_number=serial_number)
+
+
+def serial_number_for_bus_path(bus_path):
+    """
+    Returns the serial number of the USB device at the given bus path; e.g. "1-4.2"
+    for the device on port 2 of the hub on port 4 of bus 1, as named in sysfs.
+    """
+    import usb.core
+
+    try:
+        bus, _, ports = bus_path.partition("-")
+        bus           = int(bus)
+        port_numbers  = tuple(int(port) for port in ports.split(".")) if ports else ()
+    except ValueError:
+        raise ValueError(f"malformed USB bus path '{bus_path}'")
+
+    device = usb.core.find(custom_match=lambda device: device.bus == bus and
+        tuple(device.port_numbers or ()) == port_numbers)
+
+    if device is None:
+        raise DeviceNotFoundError(f"no USB device at bus path {bus_path}")
+    if not device.serial_number:
+        raise DeviceNotFoundError(f"the USB device at bus path {bus_path} has no serial number")
+
+    return device.serial_number
 
 
 class FacedancerApp:
     app_name = "override this"
     app_num = 0x00
 
+    # True iff this backend can be pointed at a specific board, by passing a serial_number
+    # to its constructor and to appropriate_for_environment().
+    SUPPORTS_BOARD_SELECTION = False
+
     @classmethod
-    def autodetect(cls, verbose=0, quirks=None):
+    def autodetect(cls, verbose=0, quirks=None, serial_number=None):
         """
         Convenience function that automatically creates the appropriate
         subclass based on the BOARD environment variable and some crude internal
         automagic.
 
         Args:
-            verbose: Sets the verbosity level of the relevant app. Increasing
-                     this from zero yields progressively more output.
+            verbose       : Sets the verbosity level of the relevant app. Increasing
+                            this from zero yields progressively more output.
+            serial_number : If provided, only the board with this USB serial number is used.
         """
 
         if 'BACKEND' in os.environ:
@@ -43,35 +86,42 @@ class FacedancerApp:
         else:
             backend_name = None
 
+        # Only pass a board selection on to backends that understand it.
+        selection = {'serial_number': serial_number} if serial_number is not None else {}
+
         # Iterate over each subclass of FacedancerApp until we find one
         # that seems appropriate.
-        subclass = cls._find_appropriate_subclass(backend_name)
+        subclass = cls._find_appropriate_subclass(backend_name, **selection)
 
         if subclass:
             if verbose > 0:
                 print("Using {} backend.".format(subclass.app_name))
 
-            return subclass(verbose=verbose, quirks=quirks)
+            return subclass(verbose=verbose, quirks=quirks, **selection)
         else:
             raise DeviceNotFoundError()
 
 
     @classmethod
-    def _find_appropriate_subclass(cls, backend_name):
+    def _find_appropriate_subclass(cls, backend_name, **selection):
 
         # Recursive case: if we have any subnodes, see if they are
         # feed them to this function.
         for subclass in cls.__subclasses__():
 
             # Check to see if the subnode has any appropriate children.
-            appropriate_class = subclass._find_appropriate_subclass(backend_name)
+            appropriate_class = subclass._find_appropriate_subclass(backend_name, **selection)
 
             # If it does, that's our answer!
             if appropriate_class:
                 return appropriate_class
 
+        # Backends that can't select a particular board can't satisfy a request for one.
+        if selection and not cls.SUPPORTS_BOARD_SELECTION:
+            return None
+
         # Base case: check the current node.
-        if cls.appropriate_for_environment(backend_name):
+        if cls.appropriate_for_environment(backend_name, **selection):
             return cls
         else:
             return None
@@ -536,3 +586,287 @@ class FacedancerBasicScheduler(object):
         Stop the scheduler on next loop.
         """
         self.do_exit = True
+
+
+
+class SchedulerTask:
+    """
+    A task run by a FacedancerScheduler; and its bookkeeping.
+
+    Attributes:
+        callback  : The function to call each time the task runs.
+        priority  : The task's priority; lower numbers are more urgent.
+        period    : The time between the task's releases, in seconds; zero for a task that's
+                    always ready, or None for a task that runs only once.
+        deadline  : The time after each release by which the task should have started, in seconds;
+                    or None to use its period. Tasks with neither have no deadline to miss.
+        runs      : The number of times the task has run.
+        misses    : The number of times the task has started after its deadline.
+        overruns  : The number of times the task ran for longer than its scheduler's latency budget.
+    """
+
+    def __init__(self, callback, priority, period, deadline, release, name=None):
+        self.callback  = callback
+        self.priority  = priority
+        self.period    = period
+        self.deadline  = deadline
+        self.name      = name or getattr(callback, '__qualname__', repr(callback))
+
+        # The time the task was last released, and the time it must start by.
+        self.release           = release
+        self.absolute_deadline = self.deadline_after(release)
+
+        self.runs      = 0
+        self.misses    = 0
+        self.overruns  = 0
+        self.cancelled = False
+
+
+    def deadline_after(self, release):
+        """ Returns the time by which the task must start, if released at the given time. """
+
+        relative = self.deadline if self.deadline is not None else self.period
+        if not relative:
+            return math.inf
+
+        return release + relative
+
+
+    def __repr__(self):
+        return f"<SchedulerTask {self.name} priority={self.priority} period={self.period}>"
+
+
+class FacedancerScheduler:
+    """
+    Priority- and deadline-aware scheduler for Facedancer tasks; a drop-in replacement
+    for FacedancerBasicScheduler, which can also be run from an asyncio event loop.
+
+    Each task is released either continuously, periodically, or once. Of the tasks that have
+    been released, the most urgent (by priority) runs first; and among tasks of equal priority,
+    the one with the earliest deadline. When nothing has been released, the scheduler sleeps
+    until the next release, rather than spinning.
+
+    USB servicing (see add_usb_task) runs at the highest priority, with its period set by our
+    latency budget. Tasks that run for longer than that budget hold up USB servicing, and are
+    counted as overruns.
+
+    Args:
+        latency_budget : The longest we should go between servicing a backend, in seconds.
+        clock          : Function returning the current time, in seconds.
+        sleep          : Function that sleeps for the given time, in seconds; used by run().
+    """
+
+    # Task priorities; lower numbers are more urgent.
+    PRIORITY_USB        = 0
+    PRIORITY_INTERRUPT  = 10
+    PRIORITY_NORMAL     = 50
+    PRIORITY_BACKGROUND = 100
+
+    # Default latency budget for USB servicing, in seconds: one full-speed frame.
+    DEFAULT_LATENCY_BUDGET = 0.001
+
+    do_exit = False
+
+    def __init__(self, *, latency_budget=DEFAULT_LATENCY_BUDGET, clock=time.monotonic, sleep=time.sleep):
+        self.latency_budget = latency_budget
+        self.clock          = clock
+        self.sleep          = sleep
+
+        self.tasks   = []
+        self.do_exit = False
+
+        # Tasks waiting to be released, as (release, sequence, task); and released tasks, as
+        # (priority, deadline, sequence, task). The sequence number keeps equal entries in order.
+        self._waiting  = []
+        self._ready    = []
+        self._sequence = itertools.count()
+
+
+    #
+    # Adding tasks.
+    #
+
+    def add_task(self, callback, *, priority=PRIORITY_NORMAL, period=0, deadline=None, delay=0, name=None):
+        """
+        Adds a task to the scheduler.
+
+        Args:
+            callback : The function to be called each time the task runs.
+            priority : The task's priority; lower numbers are more urgent.
+            period   : The time between runs, in seconds; zero (the default) to run the task as
+                       often as possible, as FacedancerBasicScheduler does, or None to run it once.
+            deadline : The time after each release by which the task should start; defaults to its period.
+                       Tasks with neither a deadline nor a period are never counted as missing one.
+            delay    : The time before the task is first released, in seconds.
+            name     : A name for the task; defaults to the callback's name.
+
+        Returns the new SchedulerTask.
+        """
+
+        task = SchedulerTask(callback, priority, period, deadline, self.clock() + delay, name)
+        self.tasks.append(task)
+        self._schedule(task)
+        return task
+
+
+    def call_later(self, delay, callback, *, priority=PRIORITY_NORMAL, deadline=None):
+        """ Runs a callback once, after the given delay in seconds. Returns the new SchedulerTask. """
+        return self.add_task(callback, priority=priority, period=None, deadline=deadline, delay=delay)
+
+
+    def add_usb_task(self, device_or_backend, *, latency_budget=None):
+        """
+        Adds a task that services a device's backend (or a backend directly) at the highest priority.
+
+        Args:
+            device_or_backend : The device, or backend, to service.
+            latency_budget    : The longest we should go between servicing it; defaults to our budget.
+        """
+        backend = getattr(device_or_backend, 'backend', None) or device_or_backend
+        period  = self.latency_budget if latency_budget is None else latency_budget
+
+        return self.add_task(backend.service_irqs, priority=self.PRIORITY_USB, period=period,
+            name=f"service {type(backend).__name__}")
+
+
+    def add_endpoint_task(self, endpoint, callback, *, priority=PRIORITY_INTERRUPT):
+        """
+        Adds a task that runs once per service interval of the given endpoint; per its bInterval.
+
+        Args:
+            endpoint : The endpoint whose interval should set the task's period.
+            callback : The function to be called each interval.
+            priority : The task's priority; defaults to interrupt priority.
+        """
+        return self.add_task(callback, priority=priority, period=self.endpoint_period(endpoint),
+            name=f"endpoint {endpoint.get_address():#04x}")
+
+
+    @staticmethod
+    def endpoint_period(endpoint):
+        """ Returns an endpoint's service interval, in seconds; per the USB 2.0 spec [9.6.6]. """
+
+        device = endpoint.get_device() if endpoint.parent else None
+        speed  = getattr(device, 'device_speed', None)
+        interval = max(endpoint.interval, 1)
+
+        # High speed and faster intervals are exponents, in units of 125us microframes; as are
+        # full speed isochronous intervals, in units of 1ms frames.
+        if speed is not None and speed >= DeviceSpeed.HIGH:
+            return (2 ** (min(interval, 16) - 1)) * 125e-6
+
+        if endpoint.transfer_type == USBTransferType.ISOCHRONOUS:
+            return (2 ** (min(interval, 16) - 1)) * 1e-3
+
+        return interval * 1e-3
+
+
+    def remove_task(self, task):
+        """ Removes a task from the scheduler; it won't be run again. """
+        task.cancelled = True
+        if task in self.tasks:
+            self.tasks.remove(task)
+
+
+    #
+    # Scheduling.
+    #
+
+    def _schedule(self, task):
+        """ Queues a task for its next release. """
+        heapq.heappush(self._waiting, (task.release, next(self._sequence), task))
+
+
+    def _release_due_tasks(self, now):
+        """ Moves any task whose release time has come into the set of ready tasks. """
+        while self._waiting and self._waiting[0][0] <= now:
+            _, sequence, task = heapq.heappop(self._waiting)
+
+            if not task.cancelled:
+                heapq.heappush(self._ready, (task.priority, task.absolute_deadline, sequence, task))
+
+
+    def run_once(self):
+        """
+        Runs the most urgent ready task, if there is one.
+
+        Returns the time, in seconds, until the next task is due to be released; which is
+        zero if a task may be ready now, or None if there are no tasks left at all.
+        """
+
+        now = self.clock()
+        self._release_due_tasks(now)
+
+        while self._ready:
+            _, _, _, task = heapq.heappop(self._ready)
+            if not task.cancelled:
+                break
+        else:
+            if not self._waiting:
+                return None
+            return max(self._waiting[0][0] - now, 0)
+
+        if now > task.absolute_deadline:
+            task.misses += 1
+
+        task.callback()
+
+        finished  = self.clock()
+        task.runs += 1
+
+        if task.priority != self.PRIORITY_USB and finished - now > self.latency_budget:
+            task.overruns += 1
+
+        # Work out when the task is next due; skipping any periods we've missed entirely.
+        if task.period is None:
+            self.remove_task(task)
+        elif task.period == 0:
+            task.release = finished
+        else:
+            task.release += task.period
+            if task.release < finished - task.period:
+                task.release = finished
+
+        if not task.cancelled:
+            task.absolute_deadline = task.deadline_after(task.release)
+            self._schedule(task)
+
+        return 0
+
+
+    def run(self):
+        """
+        Run the main scheduler stack; sleeping whenever no task is due.
+        """
+
+        self.do_exit = False
+        while not self.do_exit:
+            wait = self.run_once()
+
+            if wait is None:
+                break
+            if wait > 0:
+                self.sleep(wait)
+
+
+    async def run_async(self):
+        """
+        Runs the scheduler on the current asyncio event loop, until stopped; yielding to other
+        coroutines after each task, and awaiting (rather than blocking) whenever no task is due.
+        """
+
+        self.do_exit = False
+        while not self.do_exit:
+            wait = self.run_once()
+
+            if wait is None:
+                break
+
+            await asyncio.sleep(wait)
+
+
+    def stop(self):
+        """
+        Stop the scheduler on next loop.
+        """
+        self.do_exit = True
@@ -13,10 +13,30 @@ from enum import IntEnum
 class USBDescribable(object):
     """
     Abstract base class for objects that can be created from USB descriptors.
+
+    Any class that declares its own DESCRIPTOR_TYPE_NUMBER is registered as the parser for
+    that descriptor type when it's defined. Class-specific descriptor types can additionally
+    declare DESCRIPTOR_INTERFACE_CLASS, to only parse descriptors found on interfaces of that class.
     """
 
     # Override me!
-    DESCRIPTOR_TYPE_NUMBER = None
+    DESCRIPTOR_TYPE_NUMBER     = None
+    DESCRIPTOR_INTERFACE_CLASS = None
+
+    # Maps (descriptor type, interface class or None) => the class that parses those descriptors.
+    # Built as classes are defined; the first class to claim a given key keeps it.
+    _descriptor_parsers = {}
+
+
+    def __init_subclass__(cls, **kwargs):
+        super().__init_subclass__(**kwargs)
+
+        # Only register classes that declare a type themselves; not everything that inherits one.
+        type_number = cls.__dict__.get('DESCRIPTOR_TYPE_NUMBER')
+        if type_number is not None:
+            key = (type_number, cls.__dict__.get('DESCRIPTOR_INTERFACE_CLASS'))
+            USBDescribable._descriptor_parsers.setdefault(key, cls)
+
 
     @classmethod
     def handles_binary_descriptor(cls, data):
@@ -27,20 +47,60 @@ class USBDescribable(object):
         return data[1] == cls.DESCRIPTOR_TYPE_NUMBER
 
 
+    @staticmethod
+    def parser_for_descriptor_type(type_number: int, interface_class: int = None):
+        """ Returns the class registered to parse the given descriptor type; or None if there isn't one.
+
+        Args:
+            type_number     : The bDescriptorType of the descriptor to be parsed.
+            interface_class : The class of the interface the descriptor was found on, if any.
+        """
+        parsers = USBDescribable._descriptor_parsers
+
+        parser = parsers.get((type_number, interface_class)) if interface_class is not None else None
+        if parser is None:
+            parser = parsers.get((type_number, None))
+
+        # Fall back to a generic class descriptor for any class-specific descriptor type; per USB2 [9.5].
+        if parser is None and (type_number & 0x60) == 0x20:
+            parser = USBClassDescriptor
+
+        return parser
+
 
     @classmethod
-    def from_binary_descriptor(cls, data):
+    def from_binary_descriptor(cls, data, *, interface_class: int = None):
         """
         Attempts to create a USBDescriptor subclass from the given raw
         descriptor data.
         """
 
-        for subclass in cls.__subclasses__():
-            # If this subclass handles our binary descriptor, use it to parse the given descriptor.
-            if subclass.handles_binary_descriptor(data):
-                return subclass.from_binary_descriptor(data)
+        parser = cls.parser_for_descriptor_type(data[1], interface_class)
+
+        # Only hand off to parsers that actually implement parsing; rather than inheriting this method.
+        if parser is None or parser.from_binary_descriptor.__func__ is USBDescribable.from_binary_descriptor.__func__:
+            return None
+
+        return parser.from_binary_descriptor(data)
+
+
+    @staticmethod
+    def iterate_binary_descriptors(data):
+        """ Yields a memoryview over each descriptor in a run of concatenated descriptors, without copying them. """
+
+        view   = memoryview(data)
+        offset = 0
+        end    = len(view)
+
+        while offset + 2 <= end:
+            length = view[offset]
+
+            # A zero length would never advance; treat it as the end of the valid data.
+            if length < 2:
+                return
 
-        return None
+            yield view[offset:offset + length]
+            offset += length
 
 
 
@@ -54,6 +114,11 @@ class USBDescriptor(USBDescribable, AutoInstantiable):
     type_number : int            = None
     parent      : USBDescribable = None
 
+    @classmethod
+    def from_binary_descriptor(cls, data):
+        """ Creates a descriptor object that holds a copy of the given raw descriptor. """
+        return cls(number=None, raw=bytes(data), type_number=data[1])
+
     def __call__(self, index=0):
         """ Converts the descriptor object into raw bytes. """
         return self.raw
@@ -76,12 +141,25 @@ class USBStringDescriptor(USBDescriptor):
     # Property: the python version of the relevant string.
     python_string : str = None
 
+    @classmethod
+    def from_binary_descriptor(cls, data):
+        raw = bytes(data)
+        return cls(raw=raw, number=None, type_number=3, python_string=raw[2:raw[0]].decode('utf-16-le', errors='replace'))
+
+    # The longest string that fits in a descriptor, whose length is a single byte; in UTF-16 code units.
+    MAX_STRING_UNITS = 126
+
     @classmethod
     def from_string(cls, string, *, index=None):
 
-        # Grab the raw string
-        raw_string = string.encode('utf-16')[2:]
-        raw = bytes([len(raw_string) + 2, cls.DESCRIPTOR_TYPE_NUMBER, *raw_string])
+        # Grab the raw string, truncating it to fit in a descriptor -- without splitting a surrogate pair.
+        raw_string = string.encode('utf-16-le')
+        if len(raw_string) > cls.MAX_STRING_UNITS * 2:
+            raw_string = raw_string[:cls.MAX_STRING_UNITS * 2]
+            if 0xD8 <= raw_string[-1] <= 0xDB:
+                raw_string = raw_string[:-2]
+
+        raw = bytes([len(raw_string) + 2, cls.DESCRIPTOR_TYPE_NUMBER]) + raw_string
 
         return cls(raw=raw, number=index, type_number=3, python_string=string)
 
@@ -99,6 +177,10 @@ class StringDescriptorManager:
         # Maps python strings => indexes.
         self.indexes     = {}
 
+        # Maps language IDs => {index: encoded descriptor}, for strings provided in a specific language.
+        # Any index without an entry for the requested language falls back to the descriptors above.
+        self.translations = {}
+
 
 
     def _allocate_index(self):
@@ -110,17 +192,54 @@ class StringDescriptorManager:
         return index
 
 
-    def add_string(self, string):
-        """ Adds a python string to the string manager, and returns an index. """
+    def add_string(self, string, index=None, *, language=None):
+        """ Adds a python string to the string manager, and returns an index.
 
-        index = self._allocate_index()
+        Args:
+            string   : The python string to add.
+            index    : The index to place the string at; e.g. to reproduce another device's
+                       string table. If not provided, a new index is allocated.
+            language : The language ID this string is a translation for. If not provided, the
+                       string is served for every language that lacks its own translation.
+        """
 
-        self.descriptors[index] = USBStringDescriptor.from_string(string, index=index)
-        self.indexes[string]    = index
+        if index is None:
+            index = self._allocate_index()
+            self.indexes[string] = index
+        else:
+            self.next_index = max(self.next_index, index + 1)
+            self.indexes.setdefault(string, index)
+
+        descriptor = USBStringDescriptor.from_string(string, index=index)
+
+        if language is not None:
+            self.translations.setdefault(language, {})[index] = descriptor.raw
+
+        # Language-neutral strings always replace the fallback; translations only fill it in if it's empty.
+        if language is None or index not in self.descriptors:
+            self.descriptors[index] = descriptor
 
         return index
 
 
+    def get_descriptor(self, index, language=None):
+        """ Returns the encoded string descriptor at the given index, in the given language; or None.
+
+        Args:
+            index    : The index of the string descriptor to fetch.
+            language : The language ID requested by the host; per USB2 [9.6.7].
+        """
+
+        table = self.translations.get(language)
+        if table:
+            raw = table.get(index)
+            if raw is not None:
+                return raw
+
+        descriptor = self.descriptors.get(index)
+        return descriptor.raw if descriptor else None
+
+
     def get_index(self, string):
         """ Returns the index of the given string; creating it if the string isn't already known. """
 
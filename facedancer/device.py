@@ -8,7 +8,7 @@ import asyncio
 import struct
 import warnings
 
-from typing         import Coroutine, Dict, Iterable, Union
+from typing         import Coroutine, Dict, Iterable, List, Union
 from dataclasses    import dataclass, field
 
 from prompt_toolkit import HTML, print_formatted_text
@@ -159,6 +159,10 @@ class USBBaseDevice(USBDescribable, USBRequestHandler):
         self._suggested_requests = set()
         self._suggested_request_metadata = {}
 
+        # Optional hooks object, which lets tooling (e.g. facedancer.fuzz) observe the host's
+        # requests and rewrite our responses at the byte level. See fuzz.USBDeviceHooks.
+        self.hooks = None
+
 
     #
     # Control interface.
@@ -187,53 +191,124 @@ class USBBaseDevice(USBDescribable, USBRequestHandler):
         self.backend.disconnect()
 
 
-    async def run(self):
-        """ Runs the actual device emulation. """
+    def endpoints_changed(self):
+        """ Lets our configuration and backend know that our active endpoints have changed; e.g. on a change of alternate setting. """
+        if self.configuration is not None:
+            self.configuration.endpoints_changed()
+
+        update_endpoint_table = getattr(self.backend, 'update_endpoint_table', None)
+        if update_endpoint_table is not None:
+            update_endpoint_table()
+
+
+    def get_background_coroutines(self) -> List[Coroutine]:
+        """ Returns any coroutines that must run alongside this device's emulation; e.g. a device-side clock.
+
+        These are run by run(); and by anything else that services the device in its place, such as
+        a DeviceOrchestrator. Override this, rather than run(), to add background work to a device.
+        """
+        return []
+
+
+    def check_configurations(self):
+        """ Sanity checks this device before it's run; logging any common mistakes. """
 
-        # Sanity check to avoid common issues.
         from .proxy import USBProxyDevice
         if len(self.configurations) == 0 and not isinstance(self, USBProxyDevice):
             log.error("No configurations defined on the emulated device! "
                     "Did you forget @use_inner_classes_automatically?")
 
+
+    async def run(self, *, io_thread: bool = False):
+        """ Runs the actual device emulation.
+
+        Args:
+            io_thread : If true, the backend is serviced from a dedicated thread, so USB traffic
+                        isn't held up by other coroutines; see facedancer.backends.iothread.
+        """
+
+        # Sanity check to avoid common issues.
+        self.check_configurations()
+
         if self.backend is None:
             self.connect()
 
+        await asyncio.gather(self._service_backend(io_thread), *self.get_background_coroutines())
+
+
+    async def _service_backend(self, io_thread: bool):
+        """ Services our backend's events, until cancelled. """
+
+        if io_thread:
+            from .backends.iothread import IOThread
+            await IOThread(self).run()
+            return
+
         # Constantly service any events that need to be performed.
         while True:
             self.backend.service_irqs()
             await asyncio.sleep(0)
 
 
-    def run_with(self, *coroutines: Iterable[Coroutine]):
+    def run_with(self, *coroutines: Iterable[Coroutine], io_thread: bool = False):
         """
         Runs the actual device emulation synchronously; running any provided
         coroutines simultaneously.
+
+        Args:
+            io_thread : If true, service the backend from a dedicated thread; see run().
         """
 
         async def inner():
-            await asyncio.gather(self.run(), *coroutines)
+            await asyncio.gather(self.run(io_thread=io_thread), *coroutines)
 
-        asyncio.run(inner())
+        # Simulated backends can provide their own event loop; e.g. one that runs on virtual time.
+        create_event_loop = getattr(self.backend, 'create_event_loop', None)
+        if create_event_loop is None:
+            asyncio.run(inner())
+            return
+
+        loop = create_event_loop()
+        try:
+            loop.run_until_complete(inner())
+        finally:
+            loop.close()
 
 
-    def emulate(self, *coroutines: Iterable[Coroutine]):
+    def emulate(self, *coroutines: Iterable[Coroutine], io_thread: bool = False):
         """ Convenience method that runs a full method in a blocking manner.
         Performs connect, run, and then disconnect.
 
         Args:
             *coroutines : any asyncio coroutines to be executed concurrently
                            with our emulation
+            io_thread   : If true, service the backend from a dedicated thread; see run().
         """
 
         self.connect()
 
         try:
-            self.run_with(*coroutines)
+            self.run_with(*coroutines, io_thread=io_thread)
         finally:
             self.disconnect()
 
 
+    def snapshot(self, *extra_participants, base=None):
+        """ Captures this device's emulation state; see facedancer.snapshot.
+
+        Args:
+            extra_participants : Any additional objects whose state should be captured with ours.
+            base               : An earlier snapshot to share unchanged state with.
+        """
+        from .snapshot import DeviceSnapshot
+        return DeviceSnapshot.capture(self, *extra_participants, base=base)
+
+
+    def restore(self, snapshot):
+        """ Returns this device (and anything captured with it) to the state held in a snapshot. """
+        snapshot.restore()
+
+
     #
     # I/O interface.
     #
@@ -269,17 +344,43 @@ class USBBaseDevice(USBDescribable, USBRequestHandler):
         # All of our backends currently automatically handle packetization and ZLPs for
         # the control endpoint, so we'll skip packetizing it (which would generate spurious ZLPs).
         if endpoint_number == 0:
-            self.backend.send_on_endpoint(0, data, blocking=blocking)
+            self._send_control_data(data, blocking=blocking)
         elif self.configuration:
             endpoint = self.configuration.get_endpoint(endpoint_number, USBDirection.IN)
             endpoint.send(data, blocking=blocking)
 
 
+    def _send_control_data(self, data: bytes, *, blocking: bool = False):
+        """ Sends a control IN data stage; splitting it up if it's larger than the backend accepts at once.
+
+        Each piece but the last is a whole number of packets, so the host sees a single transfer.
+        """
+
+        max_transfer = getattr(self.backend, 'MAX_TRANSFER_SIZE', 0)
+        packet_size  = self.max_packet_size_ep0
+
+        if not max_transfer or len(data) <= max_transfer or max_transfer < packet_size:
+            self.backend.send_on_endpoint(0, data, blocking=blocking)
+            return
+
+        chunk_size = max_transfer - (max_transfer % packet_size)
+        data       = memoryview(data)
+
+        # Send the leading pieces in order; then the remainder as requested.
+        for offset in range(0, len(data) - chunk_size, chunk_size):
+            self.backend.send_on_endpoint(0, bytes(data[offset:offset + chunk_size]), blocking=True)
+
+        last = ((len(data) - 1) // chunk_size) * chunk_size
+        self.backend.send_on_endpoint(0, bytes(data[last:]), blocking=blocking)
+
+
     def _send_in_packets(self, endpoint_number: int, data: bytes, *,
             packet_size: int, blocking: bool = False):
         """ Queues sending data on the IN endpoint with the provided number.
 
-        Sends the relevant data to the backend in chunks of packet_size.
+        Sends the relevant data to the backend in chunks of packet_size; or, for backends
+        that packetize their own transfers, in the largest whole number of packets
+        the backend will accept at once.
 
         Args:
             endpoint_number : The endpoint number to send data upon.
@@ -289,21 +390,26 @@ class USBBaseDevice(USBDescribable, USBRequestHandler):
                                until the backend indicates the send is complete.
         """
 
-        data = bytearray(data)
-
         # Special case: if we have a ZLP to begin with, send it, and return.
         if not data:
             self.backend.send_on_endpoint(endpoint_number, data, blocking=blocking)
             return
 
-        # Send the relevant data one packet at a time,
+        # If the backend can take multi-packet transfers, hand it as many whole packets as it can take.
+        chunk_size   = packet_size
+        max_transfer = getattr(self.backend, 'MAX_TRANSFER_SIZE', 0)
+        if max_transfer > packet_size:
+            chunk_size = max_transfer - (max_transfer % packet_size)
+
+        # Otherwise, send the relevant data one packet at a time,
         # chunking if we're larger than the max packet size.
         # This matches the behavior of the MAX3420E.
+        data = memoryview(data)
         while data:
-            packet = data[0:packet_size]
-            del data[0:packet_size]
+            chunk = bytes(data[0:chunk_size])
+            data  = data[chunk_size:]
 
-            self.backend.send_on_endpoint(endpoint_number, packet, blocking=blocking)
+            self.backend.send_on_endpoint(endpoint_number, chunk, blocking=blocking)
 
 
     def get_endpoint(self, endpoint_number: int, direction: USBDirection) -> USBEndpoint:
@@ -346,6 +452,10 @@ class USBBaseDevice(USBDescribable, USBRequestHandler):
         """
         endpoint = self.get_endpoint(ep_num, USBDirection.IN)
 
+        # Any data queued with USBEndpoint.write() is sent first, without involving our handlers.
+        if endpoint and endpoint.send_queued_data():
+            return
+
         if endpoint:
             self.handle_data_requested(endpoint)
         else:
@@ -359,6 +469,9 @@ class USBBaseDevice(USBDescribable, USBRequestHandler):
         """
         endpoint = self.get_endpoint(ep_num, USBDirection.IN)
 
+        if endpoint and endpoint.send_queued_data():
+            return
+
         if endpoint:
             self.handle_buffer_empty(endpoint)
 
@@ -384,6 +497,9 @@ class USBBaseDevice(USBDescribable, USBRequestHandler):
         """ Event handler for a bus reset. """
         log.info("Host issued a bus reset; resetting our connection.")
 
+        if self.hooks:
+            self.hooks.bus_reset()
+
         # Clear our state back to address zero and no configuration.
         self.configuration = None
         self.address = 0
@@ -402,6 +518,9 @@ class USBBaseDevice(USBDescribable, USBRequestHandler):
         """
         log.debug(f"{self.name} received request: {request}")
 
+        if self.hooks:
+            self.hooks.request_received(request)
+
         # Call our base USBRequestHandler method.
         handled = super().handle_request(request)
 
@@ -716,13 +835,13 @@ class USBBaseDevice(USBDescribable, USBRequestHandler):
         return bytes(packet)
 
 
-    def get_string_descriptor(self, index:int) -> bytes:
-        """ Returns the string descriptor associated with a given index. """
+    def get_string_descriptor(self, index:int, language:int=None) -> bytes:
+        """ Returns the string descriptor associated with a given index, in the given language if we have it. """
 
         if index == 0:
             return self.handle_get_supported_languages_descriptor()
         else:
-            return self.strings[index]
+            return self.strings.get_descriptor(index, language)
 
     @staticmethod
     def handle_generic_get_descriptor_request(
@@ -739,11 +858,21 @@ class USBBaseDevice(USBDescribable, USBRequestHandler):
         # Try to find the descriptor associate with the request.
         response = descriptor_container.descriptors.get(descriptor_type, None)
 
+        # Our own string descriptors are additionally selected by the language ID in wIndex.
+        if descriptor_type == DescriptorTypes.STRING and \
+                response == getattr(descriptor_container, 'get_string_descriptor', None):
+            response = response(descriptor_index, language=request.index)
+
         # If we have a callable, we need to evaluate it to figure
         # out what the actual descriptor should be.
         while callable(response):
             response = response(descriptor_index)
 
+        # Give any installed hooks a chance to rewrite the full descriptor, before it's truncated.
+        hooks = request.device.hooks if request.device else None
+        if hooks:
+            response = hooks.mutate_descriptor(request, response)
+
         # If we wound up with a valid response, reply with it.
         if response:
             response_length = min(request.length, len(response))
@@ -0,0 +1,662 @@
+# pylint: disable=unused-wildcard-import, wildcard-import
+#
+# This file is part of Facedancer.
+#
+""" Emulation of a USB Audio Class 1.0 speaker/microphone. """
+
+import os
+import wave
+import struct
+import asyncio
+
+from enum        import IntEnum
+from typing      import BinaryIO, Union
+from dataclasses import dataclass
+
+from .           import default_main
+from ..          import *
+from ..classes   import USBDeviceClass
+
+from ..logging   import log
+
+
+# Endpoint numbers used by our streaming interfaces.
+SPEAKER_ENDPOINT  = 1
+FEEDBACK_ENDPOINT = 2
+MICROPHONE_ENDPOINT = 3
+
+# Terminal IDs used to wire up our audio function topology.
+SPEAKER_INPUT_TERMINAL     = 1
+SPEAKER_OUTPUT_TERMINAL    = 2
+MICROPHONE_INPUT_TERMINAL  = 3
+MICROPHONE_OUTPUT_TERMINAL = 4
+
+# Default stream format: 48 kHz, 16-bit stereo PCM.
+DEFAULT_SAMPLE_RATE  = 48000
+DEFAULT_CHANNELS     = 2
+DEFAULT_SAMPLE_WIDTH = 2
+
+# Number of full-speed (1ms) frames our jitter buffers hold.
+JITTER_BUFFER_FRAMES = 32
+
+
+class AudioSubclass(IntEnum):
+    """ Audio interface subclasses; from UAC1 [A.2]. """
+    AUDIO_CONTROL   = 0x01
+    AUDIO_STREAMING = 0x02
+    MIDI_STREAMING  = 0x03
+
+
+class AudioDescriptorType(IntEnum):
+    """ Class-specific descriptor types; from UAC1 [A.4]. """
+    CS_INTERFACE = 0x24
+    CS_ENDPOINT  = 0x25
+
+
+class AudioControlSubtype(IntEnum):
+    """ Audio Control interface descriptor subtypes; from UAC1 [A.5]. """
+    HEADER          = 0x01
+    INPUT_TERMINAL  = 0x02
+    OUTPUT_TERMINAL = 0x03
+
+
+class AudioStreamingSubtype(IntEnum):
+    """ Audio Streaming interface descriptor subtypes; from UAC1 [A.6]. """
+    GENERAL     = 0x01
+    FORMAT_TYPE = 0x02
+
+
+class AudioTerminalType(IntEnum):
+    """ Terminal types; from the USB Audio Terminal Types spec [2.1-2.2]. """
+    USB_STREAMING = 0x0101
+    MICROPHONE    = 0x0201
+    SPEAKER       = 0x0301
+
+
+class AudioClassRequest(IntEnum):
+    """ Audio class-specific request codes; from UAC1 [A.9]. """
+    SET_CUR = 0x01
+    GET_CUR = 0x81
+    GET_MIN = 0x82
+    GET_MAX = 0x83
+    GET_RES = 0x84
+
+
+# Endpoint control selector for the sampling frequency; from UAC1 [A.10.2].
+SAMPLING_FREQ_CONTROL = 0x01
+
+
+#
+# Sample transport.
+#
+
+class AudioJitterBuffer:
+    """ Fixed-size ring of raw PCM bytes sitting between the USB stream and an audio source/sink.
+
+    Data is only ever moved with memoryview slice assignment, so the cost of each transfer
+    is independent of its sample count. Overruns drop incoming data; underruns are counted
+    and left for the caller to pad.
+    """
+
+    def __init__(self, capacity: int):
+        self.capacity  = capacity
+        self._storage  = bytearray(capacity)
+        self._view     = memoryview(self._storage)
+        self._read_at  = 0
+        self._fill     = 0
+
+        self.overruns  = 0
+        self.underruns = 0
+
+
+    def __len__(self):
+        return self._fill
+
+
+    @property
+    def fill_level(self) -> float:
+        """ Returns how full the buffer is, from 0.0 (empty) to 1.0 (full). """
+        return self._fill / self.capacity
+
+
+    def clear(self):
+        """ Discards all buffered data. """
+        self._read_at = 0
+        self._fill    = 0
+
+
+    def write(self, data) -> int:
+        """ Appends data to the buffer; returning the number of bytes accepted. """
+        data  = memoryview(data).cast('B')
+        count = min(len(data), self.capacity - self._fill)
+
+        if count < len(data):
+            self.overruns += 1
+
+        # Copy in at most two runs: up to the end of our storage, and then from its start.
+        write_at = (self._read_at + self._fill) % self.capacity
+        first    = min(count, self.capacity - write_at)
+        self._view[write_at:write_at + first] = data[:first]
+        self._view[:count - first]            = data[first:count]
+
+        self._fill += count
+        return count
+
+
+    def read_into(self, target: memoryview) -> int:
+        """ Moves up to len(target) bytes out of the buffer; returning the number moved. """
+        count = min(len(target), self._fill)
+
+        if count < len(target):
+            self.underruns += 1
+
+        first = min(count, self.capacity - self._read_at)
+        target[:first]      = self._view[self._read_at:self._read_at + first]
+        target[first:count] = self._view[:count - first]
+
+        self._read_at = (self._read_at + count) % self.capacity
+        self._fill   -= count
+        return count
+
+
+class AudioSource:
+    """ Base class for objects that provide PCM data to be sent to the host. """
+
+    def read_into(self, target: memoryview) -> int:
+        """ Fills target with PCM data; returning the number of bytes provided. """
+        return 0
+
+    def close(self):
+        pass
+
+
+class AudioSink:
+    """ Base class for objects that consume PCM data received from the host. """
+
+    def write(self, data: memoryview):
+        """ Consumes a block of PCM data. """
+
+    def close(self):
+        pass
+
+
+class WaveFileSource(AudioSource):
+    """ Audio source that plays back a WAV file; optionally looping it forever. """
+
+    def __init__(self, path: str, *, loop: bool = True):
+        self.loop = loop
+        self.wave = wave.open(path, 'rb')
+        self.frame_size = self.wave.getnchannels() * self.wave.getsampwidth()
+
+    def read_into(self, target: memoryview) -> int:
+        position = 0
+
+        while position < len(target):
+            frames = self.wave.readframes((len(target) - position) // self.frame_size)
+
+            # If we've run out of file, either rewind or report a short read.
+            if not frames:
+                if not self.loop:
+                    break
+
+                self.wave.rewind()
+                continue
+
+            target[position:position + len(frames)] = frames
+            position += len(frames)
+
+        return position
+
+    def close(self):
+        self.wave.close()
+
+
+class WaveFileSink(AudioSink):
+    """ Audio sink that records everything the host plays into a WAV file. """
+
+    def __init__(self, path: str, *, sample_rate: int = DEFAULT_SAMPLE_RATE,
+            channels: int = DEFAULT_CHANNELS, sample_width: int = DEFAULT_SAMPLE_WIDTH):
+        self.wave = wave.open(path, 'wb')
+        self.wave.setnchannels(channels)
+        self.wave.setsampwidth(sample_width)
+        self.wave.setframerate(sample_rate)
+
+    def write(self, data: memoryview):
+        self.wave.writeframesraw(data)
+
+    def close(self):
+        self.wave.close()
+
+
+class PipeSource(AudioSource):
+    """ Audio source that reads raw PCM from a pipe or other file descriptor, without blocking. """
+
+    def __init__(self, pipe: Union[int, BinaryIO]):
+        self.fd = pipe if isinstance(pipe, int) else pipe.fileno()
+        os.set_blocking(self.fd, False)
+
+    def read_into(self, target: memoryview) -> int:
+        try:
+            return os.readv(self.fd, [target])
+        except BlockingIOError:
+            return 0
+
+
+class PipeSink(AudioSink):
+    """ Audio sink that writes raw PCM to a pipe or other file descriptor. """
+
+    def __init__(self, pipe: Union[int, BinaryIO]):
+        self.fd = pipe if isinstance(pipe, int) else pipe.fileno()
+
+    def write(self, data: memoryview):
+        while data:
+            written = os.write(self.fd, data)
+            data = data[written:]
+
+
+class LoopbackBuffer(AudioSource, AudioSink):
+    """ Connects the emulated speaker to the emulated microphone; the host hears what it plays. """
+
+    def __init__(self, capacity: int = 192 * JITTER_BUFFER_FRAMES):
+        self.buffer = AudioJitterBuffer(capacity)
+
+    def write(self, data: memoryview):
+        self.buffer.write(data)
+
+    def read_into(self, target: memoryview) -> int:
+        return self.buffer.read_into(target)
+
+
+#
+# Descriptor helpers.
+#
+
+def _format_type_i_descriptor(channels, sample_width, sample_rate) -> bytes:
+    """ Generates a Type I format descriptor with a single discrete sample rate; per UAC1 Formats [2.2.5]. """
+    return struct.pack("<BBBBBBBB", 11, AudioDescriptorType.CS_INTERFACE,
+        AudioStreamingSubtype.FORMAT_TYPE, 1, channels, sample_width, sample_width * 8, 1) \
+        + sample_rate.to_bytes(3, byteorder='little')
+
+
+def _channel_config(channels) -> int:
+    """ Returns the spatial-location bitmap for a given channel count; left/right for stereo. """
+    return 0b11 if channels == 2 else 0
+
+
+@dataclass
+class USBAudioEndpoint(USBEndpoint):
+    """ Endpoint variant with the extra UAC1 endpoint descriptor fields and a class-specific descriptor. """
+
+    refresh              : int = 0
+    synch_address        : int = 0
+
+    # bmAttributes for the class-specific endpoint descriptor; bit 0 advertises sampling frequency control.
+    class_attributes     : int = 0x01
+
+
+    def get_descriptor(self) -> bytes:
+        d = super().get_descriptor()
+
+        # Audio endpoints use the USB 1.0-style nine-byte endpoint descriptor...
+        d[0] = 9
+        d += bytes([self.refresh, self.synch_address])
+
+        # ... followed by a class-specific descriptor, for data endpoints.
+        if self.usage_type == USBUsageType.DATA:
+            d += bytes([7, AudioDescriptorType.CS_ENDPOINT, AudioStreamingSubtype.GENERAL,
+                self.class_attributes, 0, 0, 0])
+
+        return d
+
+
+    @class_request_handler(number=AudioClassRequest.SET_CUR, direction=USBDirection.OUT)
+    @to_this_endpoint
+    def handle_set_sample_rate_request(self, request):
+        if request.value_high != SAMPLING_FREQ_CONTROL:
+            request.stall()
+            return
+
+        # We only support a single rate; but hosts set it anyway, so accept it if it matches.
+        requested_rate = int.from_bytes(request.data[0:3], byteorder='little')
+        if requested_rate != self.get_device().sample_rate:
+            log.warning(f"Host requested unsupported sample rate {requested_rate}Hz; ignoring.")
+
+        request.acknowledge()
+
+
+    @class_request_handler(number=AudioClassRequest.GET_CUR, direction=USBDirection.IN)
+    @to_this_endpoint
+    def handle_get_sample_rate_request(self, request):
+        if request.value_high != SAMPLING_FREQ_CONTROL:
+            request.stall()
+            return
+
+        request.reply(self.get_device().sample_rate.to_bytes(3, byteorder='little'))
+
+
+@dataclass
+class USBAudioStreamingInterface(USBInterface):
+    """ Audio Streaming interface with a zero-bandwidth alternate setting zero, per UAC1 [4.5.1].
+
+    Our endpoints belong to alternate setting one; the host selects it with SET_INTERFACE
+    when it starts streaming, and drops back to alternate setting zero when it stops.
+    """
+
+    class_number    : int = USBDeviceClass.AUDIO
+    subclass_number : int = AudioSubclass.AUDIO_STREAMING
+
+    terminal_link   : int = 0
+
+
+    def __post_init__(self):
+        super().__post_init__()
+        self.streaming = False
+
+
+    def _interface_descriptor(self, alternate: int, endpoint_count: int) -> bytes:
+        return bytes([9, USBDescriptorTypeNumber.INTERFACE, self.number, alternate, endpoint_count,
+            self.class_number, self.subclass_number, self.protocol_number,
+            self.get_device().strings.get_index(self.interface_string)])
+
+
+    def get_descriptor(self) -> bytes:
+        device = self.get_device()
+
+        # Alternate setting zero: no endpoints, and thus no bandwidth.
+        d = bytearray(self._interface_descriptor(0, 0))
+
+        # Alternate setting one: our actual stream.
+        d += self._interface_descriptor(1, len(self.endpoints))
+        d += bytes([7, AudioDescriptorType.CS_INTERFACE, AudioStreamingSubtype.GENERAL,
+            self.terminal_link, 1, 0x01, 0x00])  # one frame of delay, PCM
+        d += _format_type_i_descriptor(device.channels, device.sample_width, device.sample_rate)
+
+        # Emit our data endpoint before any feedback endpoint.
+        for endpoint in sorted(self.endpoints.values(), key=lambda e: e.usage_type):
+            d += endpoint.get_descriptor()
+
+        return d
+
+
+    @standard_request_handler(number=USBStandardRequests.SET_INTERFACE)
+    @to_this_interface
+    def handle_set_interface_request(self, request):
+        if request.value > 1:
+            request.stall()
+            return
+
+        self.streaming = (request.value == 1)
+        log.info(f"Host {'started' if self.streaming else 'stopped'} streaming on {self.name}.")
+
+        device = self.get_device()
+        device.endpoints_changed()
+        device.handle_streaming_changed(self)
+        request.acknowledge()
+
+
+    @standard_request_handler(number=USBStandardRequests.GET_INTERFACE)
+    @to_this_interface
+    def handle_get_interface_request(self, request):
+        request.reply(b'\x01' if self.streaming else b'\x00')
+
+
+
+@use_inner_classes_automatically
+class USBAudioDevice(USBDevice):
+    """ Class implementing an emulated USB Audio Class 1.0 speaker and microphone.
+
+    Audio the host plays is passed to ``sink``; audio sent to the host is read from ``source``.
+    Both sides are decoupled from the host's packet timing by fixed-size jitter buffers, and
+    the speaker is an asynchronous sink: it reports its actual consumption rate back to the host
+    over a feedback endpoint, so long-running streams neither underrun nor drift.
+
+    UAC2 requires high-speed microframe scheduling and clock entities, and isn't provided here.
+    """
+
+    name                : str = "USB audio device"
+    product_string      : str = "Facedancer Audio"
+
+    sample_rate         : int = DEFAULT_SAMPLE_RATE
+    channels            : int = DEFAULT_CHANNELS
+    sample_width        : int = DEFAULT_SAMPLE_WIDTH
+
+    source              : AudioSource = None
+    sink                : AudioSink   = None
+
+
+    class _Configuration(USBConfiguration):
+        configuration_string : str = "Audio config"
+
+        class _AudioControlInterface(USBInterface):
+            name            : str = "audio control interface"
+            number          : int = 0
+            class_number    : int = USBDeviceClass.AUDIO
+            subclass_number : int = AudioSubclass.AUDIO_CONTROL
+
+            def __post_init__(self):
+                super().__post_init__()
+                self.class_descriptor = self.get_class_descriptor
+
+
+            def get_class_descriptor(self) -> bytes:
+                """ Builds the AC header and the terminals that make up our topology; per UAC1 [4.3.2]. """
+                device = self.get_device()
+                config = _channel_config(device.channels)
+
+                def input_terminal(terminal_id, terminal_type):
+                    return struct.pack("<BBBBHBBHBB", 12, AudioDescriptorType.CS_INTERFACE,
+                        AudioControlSubtype.INPUT_TERMINAL, terminal_id, terminal_type, 0,
+                        device.channels, config, 0, 0)
+
+                def output_terminal(terminal_id, terminal_type, source_id):
+                    return struct.pack("<BBBBHBBB", 9, AudioDescriptorType.CS_INTERFACE,
+                        AudioControlSubtype.OUTPUT_TERMINAL, terminal_id, terminal_type, 0, source_id, 0)
+
+                terminals = \
+                    input_terminal(SPEAKER_INPUT_TERMINAL, AudioTerminalType.USB_STREAMING) + \
+                    output_terminal(SPEAKER_OUTPUT_TERMINAL, AudioTerminalType.SPEAKER, SPEAKER_INPUT_TERMINAL) + \
+                    input_terminal(MICROPHONE_INPUT_TERMINAL, AudioTerminalType.MICROPHONE) + \
+                    output_terminal(MICROPHONE_OUTPUT_TERMINAL, AudioTerminalType.USB_STREAMING,
+                        MICROPHONE_INPUT_TERMINAL)
+
+                streaming_interfaces = (1, 2)
+                header_length = 8 + len(streaming_interfaces)
+                header = struct.pack("<BBBHHB", header_length, AudioDescriptorType.CS_INTERFACE,
+                    AudioControlSubtype.HEADER, 0x0100, header_length + len(terminals), len(streaming_interfaces))
+
+                return header + bytes(streaming_interfaces) + terminals
+
+
+        class _SpeakerInterface(USBAudioStreamingInterface):
+            name          : str = "speaker streaming interface"
+            number        : int = 1
+            terminal_link : int = SPEAKER_INPUT_TERMINAL
+
+            class _DataEndpoint(USBAudioEndpoint):
+                number               : int                    = SPEAKER_ENDPOINT
+                direction            : USBDirection           = USBDirection.OUT
+                transfer_type        : USBTransferType        = USBTransferType.ISOCHRONOUS
+                synchronization_type : USBSynchronizationType = USBSynchronizationType.ASYNC
+                synch_address        : int                    = FEEDBACK_ENDPOINT | 0x80
+                interval             : int                    = 1
+
+                def __post_init__(self):
+                    super().__post_init__()
+                    self.max_packet_size = self.parent.parent.parent.max_frame_bytes
+
+                def handle_data_received(self, data):
+                    self.get_device().handle_speaker_data(data)
+
+
+            class _FeedbackEndpoint(USBAudioEndpoint):
+                number               : int             = FEEDBACK_ENDPOINT
+                direction            : USBDirection    = USBDirection.IN
+                transfer_type        : USBTransferType = USBTransferType.ISOCHRONOUS
+                usage_type           : USBUsageType    = USBUsageType.FEEDBACK
+                max_packet_size      : int             = 3
+                interval             : int             = 1
+                refresh              : int             = 5   # 2^5 = every 32ms
+
+                def handle_data_requested(self):
+                    self.send(self.get_device().get_feedback_value())
+
+
+        class _MicrophoneInterface(USBAudioStreamingInterface):
+            name          : str = "microphone streaming interface"
+            number        : int = 2
+            terminal_link : int = MICROPHONE_OUTPUT_TERMINAL
+
+            class _DataEndpoint(USBAudioEndpoint):
+                number               : int                    = MICROPHONE_ENDPOINT
+                direction            : USBDirection           = USBDirection.IN
+                transfer_type        : USBTransferType        = USBTransferType.ISOCHRONOUS
+                synchronization_type : USBSynchronizationType = USBSynchronizationType.ASYNC
+                interval             : int                    = 1
+
+                def __post_init__(self):
+                    super().__post_init__()
+                    self.max_packet_size = self.parent.parent.parent.max_frame_bytes
+
+                def handle_data_requested(self):
+                    self.send(self.get_device().get_microphone_packet())
+
+
+    def __post_init__(self):
+        # Our endpoints size themselves from our stream format; so work it out before they're created.
+        # Leave room for one sample more than the nominal rate, so the host can follow our feedback
+        # when it asks for a little more than that.
+        self.frame_size      = self.channels * self.sample_width
+        self.max_frame_bytes = (-(-self.sample_rate // 1000) + 1) * self.frame_size
+
+        super().__post_init__()
+
+        # Jitter buffers, which decouple host packet timing from our own (device) clock.
+        capacity = self.max_frame_bytes * JITTER_BUFFER_FRAMES
+        self.speaker_buffer    = AudioJitterBuffer(capacity)
+        self.microphone_buffer = AudioJitterBuffer(capacity)
+
+        # Scratch space for moving a single frame's worth of data at a time.
+        self._speaker_scratch    = memoryview(bytearray(self.max_frame_bytes))
+        self._microphone_scratch = memoryview(bytearray(self.max_frame_bytes))
+        self._microphone_packet  = memoryview(bytearray(self.max_frame_bytes))
+
+        # Fractional-sample accumulators, for rates that aren't a whole number of samples per frame.
+        self._speaker_remainder    = 0
+        self._microphone_remainder = 0
+        self._packet_remainder     = 0
+
+        self.frames_elapsed = 0
+
+
+    #
+    # Stream handling.
+    #
+
+    def _samples_this_frame(self, remainder_name: str) -> int:
+        """ Returns the number of samples in the next 1ms frame, spreading fractional samples evenly. """
+        remainder = getattr(self, remainder_name) + self.sample_rate
+        setattr(self, remainder_name, remainder % 1000)
+        return remainder // 1000
+
+
+    def handle_streaming_changed(self, interface: USBAudioStreamingInterface):
+        """ Called when the host starts or stops streaming on one of our interfaces. """
+
+        # Start each stream from a half-full buffer, which leaves us the most headroom in each direction.
+        if interface.terminal_link == SPEAKER_INPUT_TERMINAL:
+            buffer = self.speaker_buffer
+        else:
+            buffer = self.microphone_buffer
+
+        buffer.clear()
+        buffer.write(bytes(buffer.capacity // 2))
+
+
+    def handle_speaker_data(self, data: bytes):
+        """ Handles a packet of audio from the host. """
+        self.speaker_buffer.write(data)
+
+
+    def get_microphone_packet(self) -> memoryview:
+        """ Returns the next isochronous packet of audio for the host. """
+
+        length = self._samples_this_frame('_packet_remainder') * self.frame_size
+        packet = self._microphone_packet[:length]
+
+        # On underrun, send silence rather than a short packet; the host's stream clock is ours.
+        received = self.microphone_buffer.read_into(packet)
+        packet[received:] = bytes(length - received)
+
+        return packet
+
+
+    def get_feedback_value(self) -> bytes:
+        """ Returns our current rate, in the full-speed 10.14 feedback format of USB2 [5.12.4.2].
+
+        We nudge our nominal rate by how far the speaker buffer sits from half full; so the
+        host sends a little faster when we're running dry and a little slower when we're filling up.
+        """
+        correction = (0.5 - self.speaker_buffer.fill_level) / 50
+        samples_per_frame = (self.sample_rate / 1000) * (1 + correction)
+
+        return int(samples_per_frame * (1 << 14)).to_bytes(3, byteorder='little')
+
+
+    def service_audio_frame(self):
+        """ Performs one 1ms frame of device-clocked work: playing a frame, and capturing another. """
+
+        samples = self._samples_this_frame('_speaker_remainder')
+        length  = samples * self.frame_size
+
+        # Play out one frame of host audio; padding with silence if the host is behind.
+        scratch  = self._speaker_scratch[:length]
+        received = self.speaker_buffer.read_into(scratch)
+        scratch[received:] = bytes(length - received)
+
+        if self.sink:
+            self.sink.write(scratch)
+
+        # Capture one frame of audio for the host.
+        samples = self._samples_this_frame('_microphone_remainder')
+        length  = samples * self.frame_size
+        scratch = self._microphone_scratch[:length]
+
+        if self.source:
+            captured = self.source.read_into(scratch)
+            self.microphone_buffer.write(scratch[:captured])
+
+        self.frames_elapsed += 1
+
+
+    async def run_audio_clock(self):
+        """ Runs our device clock, servicing exactly one audio frame per elapsed millisecond. """
+
+        # Use the event loop's clock, rather than the wall clock, so we follow virtual time when simulated.
+        loop  = asyncio.get_running_loop()
+        start = loop.time() - self.frames_elapsed / 1000
+
+        while True:
+            # Catch up on every frame due since we started; this keeps our rate exact over
+            # long runs, no matter how late any individual wakeup is.
+            frames_due = int((loop.time() - start) * 1000)
+            while self.frames_elapsed < frames_due:
+                self.service_audio_frame()
+
+            await asyncio.sleep(0.001)
+
+
+    def get_background_coroutines(self):
+        return super().get_background_coroutines() + [self.run_audio_clock()]
+
+
+    def disconnect(self):
+        super().disconnect()
+
+        for stream in (self.source, self.sink):
+            if stream:
+                stream.close()
+
+
+if __name__ == "__main__":
+    loopback = LoopbackBuffer()
+    default_main(USBAudioDevice(source=loopback, sink=loopback))
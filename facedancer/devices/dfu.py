@@ -0,0 +1,648 @@
+# pylint: disable=unused-wildcard-import, wildcard-import
+#
+# This file is part of Facedancer.
+#
+""" Emulation of a USB Device Firmware Upgrade (DFU 1.1 / DfuSe) device, backed by an image file. """
+
+import os
+import mmap
+import time
+import struct
+import asyncio
+
+from enum        import IntEnum
+from dataclasses import dataclass
+
+from .           import default_main
+from ..          import *
+from ..classes   import USBDeviceClass
+
+from ..logging   import log
+
+
+# Interface subclass and protocols; per DFU [4.2.1] and [4.2.3].
+DFU_SUBCLASS          = 0x01
+DFU_PROTOCOL_RUNTIME  = 0x01
+DFU_PROTOCOL_DFU_MODE = 0x02
+
+# DFU functional descriptor type; per DFU [4.1.3].
+DFU_FUNCTIONAL        = 0x21
+
+# Specification releases we report; DfuSe hosts recognise the latter.
+DFU_VERSION           = 0x0110
+DFUSE_VERSION         = 0x011A
+
+# Default size of our firmware image, and of each block moved by DNLOAD and UPLOAD.
+DEFAULT_IMAGE_SIZE    = 256 * 1024
+DEFAULT_TRANSFER_SIZE = 2048
+
+# Value that erased storage reads as; as on a typical flash part.
+ERASED_BYTE           = 0xFF
+
+
+class DFURequest(IntEnum):
+    """ Class-specific requests; per DFU [3]. """
+    DETACH    = 0
+    DNLOAD    = 1
+    UPLOAD    = 2
+    GETSTATUS = 3
+    CLRSTATUS = 4
+    GETSTATE  = 5
+    ABORT     = 6
+
+
+class DFUState(IntEnum):
+    """ Device states; per DFU [6.1.2]. """
+    APP_IDLE                = 0
+    APP_DETACH              = 1
+    DFU_IDLE                = 2
+    DFU_DNLOAD_SYNC         = 3
+    DFU_DNBUSY              = 4
+    DFU_DNLOAD_IDLE         = 5
+    DFU_MANIFEST_SYNC       = 6
+    DFU_MANIFEST            = 7
+    DFU_MANIFEST_WAIT_RESET = 8
+    DFU_UPLOAD_IDLE         = 9
+    DFU_ERROR               = 10
+
+
+class DFUStatus(IntEnum):
+    """ Status codes reported by GETSTATUS; per DFU [6.1.2]. """
+    OK               = 0x00
+    ERR_TARGET       = 0x01
+    ERR_FILE         = 0x02
+    ERR_WRITE        = 0x03
+    ERR_ERASE        = 0x04
+    ERR_CHECK_ERASED = 0x05
+    ERR_PROG         = 0x06
+    ERR_VERIFY       = 0x07
+    ERR_ADDRESS      = 0x08
+    ERR_NOTDONE      = 0x09
+    ERR_FIRMWARE     = 0x0A
+    ERR_VENDOR       = 0x0B
+    ERR_USBR         = 0x0C
+    ERR_POR          = 0x0D
+    ERR_UNKNOWN      = 0x0E
+    ERR_STALLEDPKT   = 0x0F
+
+
+class DFUAttributes(IntEnum):
+    """ bmAttributes bits of the DFU functional descriptor; per DFU [4.1.3]. """
+    CAN_DOWNLOAD           = 0x01
+    CAN_UPLOAD             = 0x02
+    MANIFESTATION_TOLERANT = 0x04
+    WILL_DETACH            = 0x08
+
+
+class DfuSeCommand(IntEnum):
+    """ Commands carried in DfuSe DNLOAD block zero; per ST AN3156 [6]. """
+    GET_COMMANDS     = 0x00
+    SET_ADDRESS      = 0x21
+    ERASE            = 0x41
+    READ_UNPROTECT   = 0x92
+
+
+class DFUImage:
+    """ Firmware image held in a memory-mapped file.
+
+    Downloaded blocks are copied straight from each control transfer's buffer into the
+    mapping, and uploaded blocks are sliced straight out of it; so moving an image is
+    limited by control transfer throughput, rather than by assembling it in memory.
+
+    Args:
+        filename : The file to back the image with; or None to keep it in anonymous memory.
+                   The file is created if necessary, and extended to the image size.
+        size     : The largest image we'll accept, in bytes.
+    """
+
+    def __init__(self, filename: str = None, size: int = DEFAULT_IMAGE_SIZE):
+        self.size = size
+        self.file = None
+
+        if filename is None:
+            self.length = 0
+            self.data   = mmap.mmap(-1, size)
+            return
+
+        self.file   = os.open(filename, os.O_RDWR | os.O_CREAT, 0o644)
+        self.length = min(os.fstat(self.file).st_size, size)
+
+        if self.length < size:
+            os.ftruncate(self.file, size)
+
+        self.data = mmap.mmap(self.file, size)
+
+
+    def write(self, offset: int, data: bytes) -> bool:
+        """ Stores data in the image at the given offset. Returns false if it doesn't fit. """
+        end = offset + len(data)
+        if offset < 0 or end > self.size:
+            return False
+
+        self.data[offset:end] = data
+        self.length = max(self.length, end)
+        return True
+
+
+    def read(self, offset: int, length: int) -> bytes:
+        """ Returns up to ``length`` bytes of image content from the given offset. """
+        end = min(offset + length, self.length)
+        return self.data[offset:end] if offset < end else b""
+
+
+    def erase(self, offset: int, length: int) -> bool:
+        """ Returns a region of the image to its erased state. Returns false if it's out of range. """
+        if offset < 0 or offset + length > self.size:
+            return False
+
+        self.data[offset:offset + length] = bytes([ERASED_BYTE]) * length
+        return True
+
+
+    def truncate(self):
+        """ Discards the image's content length; e.g. before it's replaced by a new download. """
+        self.length = 0
+
+
+    def flush(self):
+        """ Ensures everything written to the image has reached its file. """
+        self.data.flush()
+
+
+    def close(self):
+        """ Releases the image; trimming any backing file down to the image's content. """
+        self.data.close()
+
+        if self.file is not None:
+            os.ftruncate(self.file, self.length)
+            os.close(self.file)
+            self.file = None
+
+
+
+def _now() -> float:
+    """ Returns the current time, in seconds; on the event loop's clock when there is one, so virtual time applies. """
+    try:
+        return asyncio.get_running_loop().time()
+    except RuntimeError:
+        return time.monotonic()
+
+
+
+@dataclass
+class DFUInterface(USBInterface):
+    """ DFU interface; implements the DFU state machine of DFU [6.1.2], and DfuSe addressing.
+
+    Each DNLOAD block is held until the GETSTATUS that follows it, and is performed then; so
+    any error is reported exactly where the specification expects it. The device's poll
+    timeouts are reported to the host, and enforced: a request that arrives before the
+    host has waited one out is stalled, as DFU [6.1.2] requires.
+    """
+
+    class_number    : int = USBDeviceClass.APPLICATION_SPECIFIC
+    subclass_number : int = DFU_SUBCLASS
+    protocol_number : int = DFU_PROTOCOL_DFU_MODE
+
+
+    def __post_init__(self):
+        super().__post_init__()
+        self.class_descriptor = self.get_functional_descriptor
+
+        self.state            = DFUState.DFU_IDLE
+        self.status           = DFUStatus.OK
+
+        # DfuSe address pointer; set by the host with SET_ADDRESS.
+        self.address_pointer  = 0
+
+        # The DNLOAD block awaiting its GETSTATUS, as (block number, data); and our stream positions.
+        self._pending         = None
+        self._download_offset = 0
+        self._upload_offset   = 0
+
+        # The time at which the host may next talk to us, after a poll timeout or DETACH.
+        self._busy_until      = None
+        self._detach_until    = None
+        self._manifested      = False
+
+
+    def get_functional_descriptor(self) -> bytes:
+        """ Builds our DFU functional descriptor; per DFU [4.1.3]. """
+        device     = self.get_device()
+        attributes = \
+            (DFUAttributes.CAN_DOWNLOAD if device.can_download else 0) | \
+            (DFUAttributes.CAN_UPLOAD if device.can_upload else 0) | \
+            (DFUAttributes.MANIFESTATION_TOLERANT if device.manifestation_tolerant else 0)
+        version    = DFUSE_VERSION if device.dfuse else DFU_VERSION
+
+        return struct.pack("<BBBHHH", 9, DFU_FUNCTIONAL, attributes,
+            device.detach_timeout, device.transfer_size, version)
+
+
+    #
+    # State handling.
+    #
+
+    def enter_runtime_mode(self):
+        """ Switches to presenting the run-time DFU interface, as an application would. """
+        self.protocol_number = DFU_PROTOCOL_RUNTIME
+        self.state           = DFUState.APP_IDLE
+        self.status          = DFUStatus.OK
+
+
+    def enter_dfu_mode(self):
+        """ Switches to presenting the DFU mode interface, ready for a transfer. """
+        self.protocol_number = DFU_PROTOCOL_DFU_MODE
+        self.state           = DFUState.DFU_IDLE
+        self.status          = DFUStatus.OK
+        self._pending        = None
+        self._busy_until     = None
+        self._manifested     = False
+
+
+    def in_runtime_mode(self) -> bool:
+        return self.state in (DFUState.APP_IDLE, DFUState.APP_DETACH)
+
+
+    def handle_bus_reset(self):
+        """ Applies the mode changes a bus reset causes; per DFU [5.2] and [7]. """
+
+        if self.state == DFUState.APP_DETACH:
+            log.info("DFU: reset after DETACH; entering DFU mode")
+            self.enter_dfu_mode()
+        elif self.in_runtime_mode():
+            return
+        elif self._manifested and self.get_device().runtime:
+            log.info("DFU: reset after manifestation; returning to run-time mode")
+            self.enter_runtime_mode()
+        else:
+            self.enter_dfu_mode()
+
+
+    def _update_state(self):
+        """ Applies any state change due because a poll or detach timeout has run out. """
+        now = _now()
+
+        if self._detach_until is not None and now >= self._detach_until:
+            self._detach_until = None
+            if self.state == DFUState.APP_DETACH:
+                self.state = DFUState.APP_IDLE
+
+        if self._busy_until is None or now < self._busy_until:
+            return
+
+        self._busy_until = None
+
+        if self.state == DFUState.DFU_DNBUSY:
+            self.state = DFUState.DFU_DNLOAD_SYNC
+        elif self.state == DFUState.DFU_MANIFEST:
+            tolerant   = self.get_device().manifestation_tolerant
+            self.state = DFUState.DFU_MANIFEST_SYNC if tolerant else DFUState.DFU_MANIFEST_WAIT_RESET
+
+
+    def _fail(self, request, status: DFUStatus = DFUStatus.ERR_STALLEDPKT):
+        """ Stalls a request our current state doesn't allow; which, in DFU mode, is an error. """
+        if not self.in_runtime_mode() and self.state != DFUState.DFU_MANIFEST_WAIT_RESET:
+            self.state    = DFUState.DFU_ERROR
+            self.status   = status
+            self._pending = None
+
+        request.stall()
+
+
+    def _allows(self, *states) -> bool:
+        """ Returns true iff we're in one of the given states, once any elapsed timeouts are applied. """
+        self._update_state()
+        return self.state in states
+
+
+    #
+    # Block handling.
+    #
+
+    def _perform_pending(self):
+        """ Performs the DNLOAD block awaiting this GETSTATUS. Returns its status, and the poll timeout to report. """
+        device        = self.get_device()
+        block, data   = self._pending
+        self._pending = None
+
+        if device.dfuse:
+            if block == 0:
+                return self._perform_dfuse_command(data)
+            if block == 1:
+                return DFUStatus.ERR_STALLEDPKT, 0
+
+            offset = self.address_pointer + (block - 2) * device.transfer_size - device.base_address
+        else:
+            offset = self._download_offset
+
+        if not device.image.write(offset, data):
+            log.warning(f"DFU: block {block} doesn't fit in our {device.image.size}-byte image")
+            return DFUStatus.ERR_ADDRESS, 0
+
+        self._download_offset = offset + len(data)
+        return DFUStatus.OK, device.download_poll_timeout
+
+
+    def _perform_dfuse_command(self, command: bytes):
+        """ Performs a DfuSe command; per AN3156 [6.1]. Returns its status, and the poll timeout to report. """
+        device  = self.get_device()
+        image   = device.image
+        opcode  = command[0]
+        address = struct.unpack_from("<I", command, 1)[0] if len(command) == 5 else None
+
+        if opcode == DfuSeCommand.SET_ADDRESS and address is not None:
+            if not device.contains(address):
+                return DFUStatus.ERR_TARGET, 0
+
+            self.address_pointer = address
+            return DFUStatus.OK, device.download_poll_timeout
+
+        if opcode == DfuSeCommand.ERASE and address is not None:
+            if not device.contains(address):
+                return DFUStatus.ERR_TARGET, 0
+
+            page = (address - device.base_address) // device.page_size * device.page_size
+            image.erase(page, min(device.page_size, image.size - page))
+            return DFUStatus.OK, device.erase_poll_timeout
+
+        # Mass erase, and read unprotect -- which implies a mass erase -- take the opcode alone.
+        if opcode in (DfuSeCommand.ERASE, DfuSeCommand.READ_UNPROTECT) and len(command) == 1:
+            image.erase(0, image.size)
+            return DFUStatus.OK, device.erase_poll_timeout * (image.size // device.page_size)
+
+        log.warning(f"DFU: unsupported DfuSe command {bytes(command).hex()}")
+        return DFUStatus.ERR_STALLEDPKT, 0
+
+
+    #
+    # Request handlers.
+    #
+
+    @class_request_handler(number=DFURequest.DETACH, direction=USBDirection.OUT)
+    @to_this_interface
+    def handle_detach_request(self, request):
+        if not self._allows(DFUState.APP_IDLE):
+            self._fail(request)
+            return
+
+        # The host will reset us within wValue milliseconds; if it doesn't, we return to appIDLE.
+        self.state         = DFUState.APP_DETACH
+        self._detach_until = _now() + min(request.value, self.get_device().detach_timeout) / 1000
+        request.acknowledge()
+
+
+    @class_request_handler(number=DFURequest.DNLOAD, direction=USBDirection.OUT)
+    @to_this_interface
+    def handle_download_request(self, request):
+        device = self.get_device()
+
+        if not device.can_download or request.length > device.transfer_size or \
+                not self._allows(DFUState.DFU_IDLE, DFUState.DFU_DNLOAD_IDLE):
+            self._fail(request)
+            return
+
+        # A zero-length block ends the download, and starts manifestation.
+        if request.length == 0:
+            if self.state == DFUState.DFU_IDLE:
+                self._fail(request)
+                return
+
+            self.state       = DFUState.DFU_MANIFEST_SYNC
+            self._manifested = False
+            request.acknowledge()
+            return
+
+        # The first block of a plain DFU download replaces the whole image.
+        if self.state == DFUState.DFU_IDLE and not device.dfuse:
+            self._download_offset = 0
+            device.image.truncate()
+
+        # Hold on to the block's buffer; it's copied into the image once, when it's performed.
+        self._pending = (request.value, request.data)
+        self.state    = DFUState.DFU_DNLOAD_SYNC
+        request.acknowledge()
+
+
+    @class_request_handler(number=DFURequest.UPLOAD, direction=USBDirection.IN)
+    @to_this_interface
+    def handle_upload_request(self, request):
+        device = self.get_device()
+
+        if not device.can_upload or request.length > device.transfer_size or \
+                not self._allows(DFUState.DFU_IDLE, DFUState.DFU_UPLOAD_IDLE):
+            self._fail(request)
+            return
+
+        if self.state == DFUState.DFU_IDLE:
+            self._upload_offset = 0
+
+        if not device.dfuse:
+            data = device.image.read(self._upload_offset, request.length)
+            self._upload_offset += len(data)
+        elif request.value == 0:
+            data = bytes(command.value for command in DfuSeCommand)[:request.length]
+        elif request.value == 1:
+            self._fail(request)
+            return
+        else:
+            address = self.address_pointer + (request.value - 2) * device.transfer_size
+            data    = device.image.read(address - device.base_address, request.length) \
+                if device.contains(address) else b""
+
+        # A short block ends the upload.
+        self.state = DFUState.DFU_UPLOAD_IDLE if len(data) == request.length else DFUState.DFU_IDLE
+        request.reply(data)
+
+
+    @class_request_handler(number=DFURequest.GETSTATUS, direction=USBDirection.IN)
+    @to_this_interface
+    def handle_get_status_request(self, request):
+        device       = self.get_device()
+        poll_timeout = 0
+
+        self._update_state()
+
+        if self.state in (DFUState.DFU_DNBUSY, DFUState.DFU_MANIFEST):
+            self._fail(request)
+            return
+
+        if self.state == DFUState.DFU_MANIFEST_WAIT_RESET:
+            request.stall()
+            return
+
+        if self.state == DFUState.DFU_DNLOAD_SYNC:
+            status = DFUStatus.OK
+            if self._pending is not None:
+                status, poll_timeout = self._perform_pending()
+
+            if status != DFUStatus.OK:
+                self.state, self.status, poll_timeout = DFUState.DFU_ERROR, status, 0
+            elif poll_timeout:
+                self.state = DFUState.DFU_DNBUSY
+            else:
+                self.state = DFUState.DFU_DNLOAD_IDLE
+
+        elif self.state == DFUState.DFU_MANIFEST_SYNC:
+            if self._manifested:
+                self.state = DFUState.DFU_IDLE
+            else:
+                self._manifested = True
+                device.handle_manifest()
+
+                poll_timeout = device.manifest_poll_timeout
+                self.state   = DFUState.DFU_MANIFEST
+
+        if self.state in (DFUState.DFU_DNBUSY, DFUState.DFU_MANIFEST):
+            self._busy_until = _now() + poll_timeout / 1000
+
+        request.reply(struct.pack("<BHBBB", self.status, poll_timeout & 0xFFFF, poll_timeout >> 16,
+            self.state, 0))
+
+
+    @class_request_handler(number=DFURequest.CLRSTATUS, direction=USBDirection.OUT)
+    @to_this_interface
+    def handle_clear_status_request(self, request):
+        if not self._allows(DFUState.DFU_ERROR):
+            self._fail(request)
+            return
+
+        self.state  = DFUState.DFU_IDLE
+        self.status = DFUStatus.OK
+        request.acknowledge()
+
+
+    @class_request_handler(number=DFURequest.GETSTATE, direction=USBDirection.IN)
+    @to_this_interface
+    def handle_get_state_request(self, request):
+        if self._allows(DFUState.DFU_DNBUSY, DFUState.DFU_MANIFEST, DFUState.DFU_MANIFEST_WAIT_RESET):
+            self._fail(request)
+            return
+
+        request.reply(bytes([self.state]))
+
+
+    @class_request_handler(number=DFURequest.ABORT, direction=USBDirection.OUT)
+    @to_this_interface
+    def handle_abort_request(self, request):
+        if not self._allows(DFUState.DFU_IDLE, DFUState.DFU_DNLOAD_SYNC, DFUState.DFU_DNLOAD_IDLE,
+                DFUState.DFU_MANIFEST_SYNC, DFUState.DFU_UPLOAD_IDLE):
+            self._fail(request)
+            return
+
+        self.state    = DFUState.DFU_IDLE
+        self._pending = None
+        request.acknowledge()
+
+
+
+@use_inner_classes_automatically
+class USBDFUDevice(USBDevice):
+    """ Class implementing an emulated DFU 1.1 device; optionally with ST's DfuSe extensions.
+
+    Firmware the host downloads is stored in a memory-mapped image file, and uploads are
+    served from the same file; so e.g. ``dfu-util -D firmware.bin`` leaves a copy of the
+    firmware in ``image_filename``.
+
+    Fields:
+        image_filename :
+            The file backing our firmware image; or None to keep the image in memory.
+        image_size :
+            The largest image we'll accept, in bytes.
+        transfer_size :
+            The wTransferSize we advertise: the largest block a single DNLOAD or UPLOAD moves.
+        can_download, can_upload, manifestation_tolerant :
+            The capabilities we advertise in our functional descriptor.
+        runtime :
+            If true, we start out as an application with a run-time DFU interface, and only
+            enter DFU mode once the host has sent DETACH and reset us.
+        detach_timeout :
+            The longest we'll wait for a reset after DETACH, in milliseconds.
+        download_poll_timeout, erase_poll_timeout, manifest_poll_timeout :
+            The bwPollTimeout we report, in milliseconds, while a block is being written,
+            a DfuSe page is being erased, or the image is being manifested.
+        dfuse :
+            If true, we speak DfuSe: block zero carries commands, and data blocks are placed
+            relative to an address pointer, within a memory region at ``base_address``.
+        base_address, page_size, memory_name :
+            The DfuSe memory region our image represents, and its erase granularity.
+    """
+
+    name                   : str  = "USB DFU device"
+    product_string         : str  = "Facedancer DFU"
+
+    image_filename         : str  = None
+    image_size             : int  = DEFAULT_IMAGE_SIZE
+    image                  : DFUImage = None
+
+    transfer_size          : int  = DEFAULT_TRANSFER_SIZE
+    can_download           : bool = True
+    can_upload             : bool = True
+    manifestation_tolerant : bool = True
+
+    runtime                : bool = False
+    detach_timeout         : int  = 1000
+
+    download_poll_timeout  : int  = 5
+    erase_poll_timeout     : int  = 20
+    manifest_poll_timeout  : int  = 10
+
+    dfuse                  : bool = False
+    base_address           : int  = 0x08000000
+    page_size              : int  = 2048
+    memory_name            : str  = "Internal Flash"
+
+
+    class _Configuration(USBConfiguration):
+        configuration_string : str = "DFU config"
+
+        class _Interface(DFUInterface):
+            name : str = "DFU interface"
+
+
+    def __post_init__(self):
+        super().__post_init__()
+
+        if self.image is None:
+            self.image = DFUImage(self.image_filename, self.image_size)
+
+        # DfuSe hosts address the whole region, rather than the image's content.
+        if self.dfuse:
+            self.image.length = self.image.size
+
+        self.dfu_interface = next(interface for configuration in self.configurations.values()
+            for interface in configuration.get_interfaces() if isinstance(interface, DFUInterface))
+
+        if self.dfuse:
+            self.dfu_interface.interface_string = self.get_memory_layout()
+        if self.runtime:
+            self.dfu_interface.enter_runtime_mode()
+
+
+    def contains(self, address: int) -> bool:
+        """ Returns true iff a DfuSe address falls within our memory region. """
+        return self.base_address <= address < self.base_address + self.image.size
+
+
+    def get_memory_layout(self) -> str:
+        """ Returns the DfuSe memory layout string describing our region; per UM0424 [10.3.2]. """
+        pages = self.image.size // self.page_size
+
+        if self.page_size % 1024:
+            return f"@{self.memory_name}/0x{self.base_address:08x}/{pages:03d}*{self.page_size:04d} g"
+        return f"@{self.memory_name}/0x{self.base_address:08x}/{pages:03d}*{self.page_size // 1024:03d}Kg"
+
+
+    def handle_manifest(self):
+        """ Called when the host completes a download. Override to e.g. validate or boot the new image. """
+        log.info(f"DFU: received a {self.image.length}-byte image")
+        self.image.flush()
+
+
+    def handle_bus_reset(self):
+        super().handle_bus_reset()
+        self.dfu_interface.handle_bus_reset()
+
+
+
+if __name__ == "__main__":
+    default_main(USBDFUDevice)
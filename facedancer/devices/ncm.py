@@ -0,0 +1,560 @@
+# pylint: disable=unused-wildcard-import, wildcard-import
+#
+# This file is part of Facedancer.
+#
+""" Emulation of a CDC-NCM USB Ethernet adapter, bridged to a Linux TAP interface. """
+
+import os
+import sys
+import fcntl
+import struct
+
+from enum        import IntEnum
+from collections import deque
+from dataclasses import dataclass
+
+from .           import default_main
+from ..          import *
+from ..classes   import USBDeviceClass
+
+from ..logging   import log
+
+
+# Endpoint numbers used by our interfaces.
+NOTIFICATION_ENDPOINT = 1
+DATA_ENDPOINT         = 2
+
+# Interface numbers; referenced by our union descriptor.
+CONTROL_INTERFACE     = 0
+DATA_INTERFACE        = 1
+
+# Largest Ethernet frame we'll carry: a 1500-byte MTU plus the 14-byte header; the FCS isn't sent.
+MAX_SEGMENT_SIZE      = 1514
+
+# Largest NCM transfer blocks we'll send or accept; the host may shrink the former.
+NTB_IN_MAX_SIZE       = 16384
+NTB_OUT_MAX_SIZE      = 16384
+
+# Minimum NTB input size the host may select; per NCM [6.2.7].
+NTB_IN_MIN_SIZE       = 2048
+
+# Alignment we place on the start of each datagram and each NDP.
+NTB_ALIGNMENT         = 4
+
+# Maximum number of datagrams we'll pack into a single NTB.
+NTB_MAX_DATAGRAMS     = 32
+
+# NTB16 structures; per NCM [3.2.1] and [3.3.1].
+NTH16_SIGNATURE       = b"NCMH"
+NDP16_SIGNATURE       = b"NCM0"
+NTH16_FORMAT          = "<4sHHHH"
+NDP16_FORMAT          = "<4sHH"
+NTH16_LENGTH          = struct.calcsize(NTH16_FORMAT)
+NDP16_LENGTH          = struct.calcsize(NDP16_FORMAT)
+
+# Linux TUN/TAP ioctl interface; from linux/if_tun.h.
+TUNSETIFF             = 0x400454ca
+IFF_TAP               = 0x0002
+IFF_NO_PI             = 0x1000
+
+
+class CDCSubclass(IntEnum):
+    """ Communications interface subclasses we use; from CDC [4.3]. """
+    NETWORK_CONTROL_MODEL = 0x0D
+
+
+class CDCFunctionalDescriptor(IntEnum):
+    """ Functional descriptor subtypes we use; from CDC [5.2.3] and NCM [5.2.1]. """
+    HEADER              = 0x00
+    UNION               = 0x06
+    ETHERNET_NETWORKING = 0x0F
+    NCM                 = 0x1A
+
+
+class NCMRequest(IntEnum):
+    """ Class-specific requests used by NCM hosts; from CDC ECM [6.2] and NCM [6.2]. """
+    SET_ETHERNET_MULTICAST_FILTERS = 0x40
+    SET_ETHERNET_PACKET_FILTER     = 0x43
+    GET_NTB_PARAMETERS             = 0x80
+    GET_NTB_FORMAT                 = 0x83
+    SET_NTB_FORMAT                 = 0x84
+    GET_NTB_INPUT_SIZE             = 0x85
+    SET_NTB_INPUT_SIZE             = 0x86
+    GET_MAX_DATAGRAM_SIZE          = 0x87
+    SET_MAX_DATAGRAM_SIZE          = 0x88
+
+
+class CDCNotification(IntEnum):
+    """ Notifications sent to the host; from CDC [6.3]. """
+    NETWORK_CONNECTION      = 0x00
+    CONNECTION_SPEED_CHANGE = 0x2A
+
+
+# Class-specific descriptor type for interface functional descriptors.
+CS_INTERFACE = 0x24
+
+
+def _align(offset: int, alignment: int = NTB_ALIGNMENT) -> int:
+    """ Rounds an offset up to the next multiple of alignment. """
+    return (offset + alignment - 1) & ~(alignment - 1)
+
+
+class TapInterface:
+    """ Thin wrapper around a Linux TAP device, opened non-blocking. """
+
+    def __init__(self, name: str = "fdncm%d"):
+        if not sys.platform.startswith("linux"):
+            raise OSError("TAP interfaces are only supported on Linux")
+
+        self.fd = os.open("/dev/net/tun", os.O_RDWR | os.O_NONBLOCK)
+
+        try:
+            ifreq = fcntl.ioctl(self.fd, TUNSETIFF, struct.pack("16sH", name.encode(), IFF_TAP | IFF_NO_PI))
+        except OSError:
+            os.close(self.fd)
+            raise
+
+        self.name = ifreq[:16].rstrip(b"\0").decode()
+
+
+    def fileno(self):
+        return self.fd
+
+
+    def read_into(self, target: memoryview) -> int:
+        """ Reads a single frame into target; returning its length, or zero if none is pending. """
+        try:
+            return os.readv(self.fd, [target])
+        except BlockingIOError:
+            return 0
+
+
+    def write(self, frame: memoryview):
+        """ Writes a single frame to the interface. """
+        try:
+            os.write(self.fd, frame)
+        except BlockingIOError:
+            log.debug(f"{self.name}: transmit queue full; dropping frame")
+
+
+    def close(self):
+        os.close(self.fd)
+
+
+
+@dataclass
+class NCMDataInterface(USBInterface):
+    """ CDC Data interface carrying NTBs; with the empty alternate setting zero required by NCM [5.3]. """
+
+    class_number    : int = USBDeviceClass.CDC_DATA
+    protocol_number : int = 0x01  # NTB
+
+
+    def __post_init__(self):
+        super().__post_init__()
+        self.active = False
+
+
+    def _interface_descriptor(self, alternate: int, endpoint_count: int) -> bytes:
+        return bytes([9, USBDescriptorTypeNumber.INTERFACE, self.number, alternate, endpoint_count,
+            self.class_number, self.subclass_number, self.protocol_number,
+            self.get_device().strings.get_index(self.interface_string)])
+
+
+    def get_descriptor(self) -> bytes:
+        d = bytearray(self._interface_descriptor(0, 0))
+        d += self._interface_descriptor(1, len(self.endpoints))
+
+        for endpoint in self.endpoints.values():
+            d += endpoint.get_descriptor()
+
+        return d
+
+
+    @standard_request_handler(number=USBStandardRequests.SET_INTERFACE)
+    @to_this_interface
+    def handle_set_interface_request(self, request):
+        if request.value > 1:
+            request.stall()
+            return
+
+        self.active = (request.value == 1)
+
+        device = self.get_device()
+        device.endpoints_changed()
+        device.handle_link_changed(self.active)
+        request.acknowledge()
+
+
+    @standard_request_handler(number=USBStandardRequests.GET_INTERFACE)
+    @to_this_interface
+    def handle_get_interface_request(self, request):
+        request.reply(b'\x01' if self.active else b'\x00')
+
+
+
+@use_inner_classes_automatically
+class USBNCMDevice(USBDevice):
+    """ Class implementing an emulated CDC-NCM Ethernet adapter.
+
+    Frames the host transmits are written to a TAP interface; frames arriving on the TAP
+    interface are sent to the host. Both directions batch many frames into each NCM
+    Transfer Block, which moves as a single large bulk transfer; so throughput isn't
+    limited by per-frame USB overhead.
+
+    Fields:
+        mac_address :
+            The MAC address the host should use for its side of the link.
+        tap_name :
+            The name (or name template) of the TAP interface to create.
+    """
+
+    name                : str = "USB NCM device"
+    product_string      : str = "Facedancer NCM"
+
+    device_class        : int = USBDeviceClass.COMMUNICATIONS
+    device_speed        : DeviceSpeed = DeviceSpeed.HIGH
+
+    mac_address         : str = "02:fa:ce:da:9c:e1"
+    tap_name            : str = "fdncm%d"
+    tap                 : TapInterface = None
+
+
+    class _Configuration(USBConfiguration):
+        configuration_string : str = "NCM config"
+
+        class _ControlInterface(USBInterface):
+            name            : str = "NCM control interface"
+            number          : int = CONTROL_INTERFACE
+            class_number    : int = USBDeviceClass.COMMUNICATIONS
+            subclass_number : int = CDCSubclass.NETWORK_CONTROL_MODEL
+
+            def __post_init__(self):
+                super().__post_init__()
+                self.class_descriptor = self.get_functional_descriptors
+
+
+            def get_functional_descriptors(self) -> bytes:
+                """ Builds the CDC functional descriptors that tie our two interfaces into one function. """
+                device    = self.get_device()
+                mac_index = device.strings.get_index(device.mac_address.replace(":", "").upper())
+
+                return \
+                    struct.pack("<BBBH", 5, CS_INTERFACE, CDCFunctionalDescriptor.HEADER, 0x0110) + \
+                    struct.pack("<BBBBB", 5, CS_INTERFACE, CDCFunctionalDescriptor.UNION,
+                        CONTROL_INTERFACE, DATA_INTERFACE) + \
+                    struct.pack("<BBBBIHHB", 13, CS_INTERFACE, CDCFunctionalDescriptor.ETHERNET_NETWORKING,
+                        mac_index, 0, MAX_SEGMENT_SIZE, 0, 0) + \
+                    struct.pack("<BBBHB", 6, CS_INTERFACE, CDCFunctionalDescriptor.NCM, 0x0100, 0x01)
+
+
+            @class_request_handler(number=NCMRequest.GET_NTB_PARAMETERS, direction=USBDirection.IN)
+            @to_this_interface
+            def handle_get_ntb_parameters_request(self, request):
+                request.reply(struct.pack("<HHIHHHHIHHHH", 28, 0x0001,
+                    NTB_IN_MAX_SIZE, NTB_ALIGNMENT, 0, NTB_ALIGNMENT, 0,
+                    NTB_OUT_MAX_SIZE, NTB_ALIGNMENT, 0, NTB_ALIGNMENT, 0))
+
+
+            @class_request_handler(number=NCMRequest.GET_NTB_INPUT_SIZE, direction=USBDirection.IN)
+            @to_this_interface
+            def handle_get_ntb_input_size_request(self, request):
+                request.reply(struct.pack("<I", self.get_device().ntb_in_size))
+
+
+            @class_request_handler(number=NCMRequest.SET_NTB_INPUT_SIZE, direction=USBDirection.OUT)
+            @to_this_interface
+            def handle_set_ntb_input_size_request(self, request):
+                size, = struct.unpack_from("<I", bytes(request.data[0:4]))
+
+                if not NTB_IN_MIN_SIZE <= size <= NTB_IN_MAX_SIZE:
+                    request.stall()
+                    return
+
+                self.get_device().ntb_in_size = size
+                request.acknowledge()
+
+
+            @class_request_handler(number=NCMRequest.GET_NTB_FORMAT, direction=USBDirection.IN)
+            @to_this_interface
+            def handle_get_ntb_format_request(self, request):
+                request.reply(b"\x00\x00")
+
+
+            @class_request_handler(number=NCMRequest.SET_NTB_FORMAT, direction=USBDirection.OUT)
+            @to_this_interface
+            def handle_set_ntb_format_request(self, request):
+                # We only speak NTB16.
+                if request.value != 0:
+                    request.stall()
+                else:
+                    request.acknowledge()
+
+
+            @class_request_handler(number=NCMRequest.GET_MAX_DATAGRAM_SIZE, direction=USBDirection.IN)
+            @to_this_interface
+            def handle_get_max_datagram_size_request(self, request):
+                request.reply(struct.pack("<H", MAX_SEGMENT_SIZE))
+
+
+            @class_request_handler(number=NCMRequest.SET_ETHERNET_PACKET_FILTER, direction=USBDirection.OUT)
+            @to_this_interface
+            def handle_set_packet_filter_request(self, request):
+                # The TAP interface sees every frame anyway; filtering is left to the kernel.
+                request.acknowledge()
+
+
+            @class_request_handler(number=NCMRequest.SET_ETHERNET_MULTICAST_FILTERS, direction=USBDirection.OUT)
+            @to_this_interface
+            def handle_set_multicast_filters_request(self, request):
+                request.acknowledge()
+
+
+            class _NotificationEndpoint(USBEndpoint):
+                number          : int             = NOTIFICATION_ENDPOINT
+                direction       : USBDirection    = USBDirection.IN
+                transfer_type   : USBTransferType = USBTransferType.INTERRUPT
+                max_packet_size : int             = 16
+                interval        : int             = 8
+
+                def handle_data_requested(self):
+                    notifications = self.get_device().pending_notifications
+                    if notifications:
+                        self.send(notifications.popleft())
+
+
+        class _DataInterface(NCMDataInterface):
+            name   : str = "NCM data interface"
+            number : int = DATA_INTERFACE
+
+            class _InEndpoint(USBEndpoint):
+                number        : int             = DATA_ENDPOINT
+                direction     : USBDirection    = USBDirection.IN
+                transfer_type : USBTransferType = USBTransferType.BULK
+
+                def __post_init__(self):
+                    super().__post_init__()
+                    self.max_packet_size = self.parent.parent.parent.bulk_packet_size
+
+                def handle_data_requested(self):
+                    self.get_device().handle_ntb_requested(self)
+
+
+            class _OutEndpoint(USBEndpoint):
+                number        : int             = DATA_ENDPOINT
+                direction     : USBDirection    = USBDirection.OUT
+                transfer_type : USBTransferType = USBTransferType.BULK
+
+                def __post_init__(self):
+                    super().__post_init__()
+                    self.max_packet_size = self.parent.parent.parent.bulk_packet_size
+
+                def handle_data_received(self, data):
+                    self.get_device().handle_ntb_data(data)
+
+
+    def __post_init__(self):
+        # Our bulk endpoints size themselves from our speed; so work it out before they're created.
+        self.bulk_packet_size = 512 if self.device_speed == DeviceSpeed.HIGH else 64
+
+        super().__post_init__()
+
+        self.ntb_in_size   = NTB_IN_MAX_SIZE
+        self.ntb_sequence  = 0
+
+        # Transfer blocks are built and reassembled in place, in these preallocated buffers.
+        self._ntb_in       = bytearray(NTB_IN_MAX_SIZE)
+        self._ntb_in_view  = memoryview(self._ntb_in)
+        self._ntb_out      = bytearray(NTB_OUT_MAX_SIZE)
+        self._ntb_out_view = memoryview(self._ntb_out)
+        self._ntb_out_fill = 0
+
+        # Room we always leave at the end of an NTB for its NDP, and any padding before it.
+        self._ndp_reserve  = NTB_ALIGNMENT + NDP16_LENGTH + 4 * (NTB_MAX_DATAGRAMS + 1)
+
+        self.pending_notifications = deque()
+
+
+    def connect(self):
+        if self.tap is None:
+            self.tap = TapInterface(self.tap_name)
+            log.info(f"Bridging to TAP interface {self.tap.name}; bring it up with `ip link set {self.tap.name} up`.")
+
+        super().connect()
+
+
+    def disconnect(self):
+        super().disconnect()
+
+        if self.tap:
+            self.tap.close()
+            self.tap = None
+
+
+    #
+    # Link state.
+    #
+
+    def handle_link_changed(self, active: bool):
+        """ Called when the host enables or disables our data interface. """
+
+        self._ntb_out_fill = 0
+        self.ntb_sequence  = 0
+        self.pending_notifications.clear()
+
+        if not active:
+            return
+
+        # Tell the host our link speed, and then that we're connected; per NCM [7.1].
+        bitrate = 480_000_000 if self.device_speed == DeviceSpeed.HIGH else 12_000_000
+        self.pending_notifications.append(struct.pack("<BBHHHII", 0xA1,
+            CDCNotification.CONNECTION_SPEED_CHANGE, 0, CONTROL_INTERFACE, 8, bitrate, bitrate))
+        self.pending_notifications.append(struct.pack("<BBHHH", 0xA1,
+            CDCNotification.NETWORK_CONNECTION, 1, CONTROL_INTERFACE, 0))
+
+
+    #
+    # Host to device: NTB reassembly and parsing.
+    #
+
+    def handle_ntb_data(self, data: bytes):
+        """ Accumulates a packet of an NTB from the host; dispatching the NTB once it's complete. """
+
+        # A ZLP ends an NTB that's a whole number of packets long. Those with a block length have
+        # already been dispatched by then; but those without are only now complete.
+        if not data:
+            if self._ntb_out_fill >= NTH16_LENGTH:
+                self._dispatch_ntb()
+            return
+
+        start = self._ntb_out_fill
+        end   = start + len(data)
+
+        if end > NTB_OUT_MAX_SIZE:
+            log.warning("NTB from host exceeds our maximum size; dropping it.")
+            self._ntb_out_fill = 0
+            return
+
+        self._ntb_out_view[start:end] = data
+        self._ntb_out_fill = end
+
+        # Wait until we have a full NTH16, so we know how long this block is.
+        if end < NTH16_LENGTH:
+            return
+
+        # A block length of zero means the NTB is instead ended by a short packet, or a ZLP.
+        block_length = struct.unpack_from("<H", self._ntb_out, 8)[0]
+        if (end < block_length or not block_length) and len(data) == self.bulk_packet_size:
+            return
+
+        self._dispatch_ntb()
+
+
+    def _dispatch_ntb(self):
+        """ Hands the NTB we've accumulated to handle_ntb(); and starts collecting the next. """
+
+        end = self._ntb_out_fill
+        self._ntb_out_fill = 0
+        self.handle_ntb(self._ntb_out_view[:end])
+
+
+    def handle_ntb(self, ntb: memoryview):
+        """ Parses a complete NTB16, writing each of its datagrams to our TAP interface. """
+
+        signature, header_length, _, block_length, ndp_index = struct.unpack_from(NTH16_FORMAT, ntb)
+        if signature != NTH16_SIGNATURE or block_length > len(ntb):
+            log.warning("Received a malformed NTB from the host; dropping it.")
+            return
+
+        # NTBs ended by a short packet have no block length of their own; they're what we received.
+        if not block_length:
+            block_length = len(ntb)
+
+        # Walk each NDP in the chain...
+        visited = set()
+
+        while ndp_index:
+            if ndp_index in visited:
+                log.warning("NTB has an NDP chain that loops back on itself; dropping the rest of it.")
+                return
+
+            visited.add(ndp_index)
+
+            if ndp_index + NDP16_LENGTH > block_length:
+                log.warning("NTB has an NDP outside of its block; dropping the rest of it.")
+                return
+
+            signature, ndp_length, next_ndp_index = struct.unpack_from(NDP16_FORMAT, ntb, ndp_index)
+            if signature[0:3] != NDP16_SIGNATURE[0:3]:
+                log.warning("NTB has a malformed NDP; dropping the rest of it.")
+                return
+
+            # ... and hand each datagram it points to to the TAP interface, without copying it.
+            entries = ntb[ndp_index + NDP16_LENGTH:ndp_index + ndp_length]
+            for datagram_index, datagram_length in struct.iter_unpack("<HH", entries[:len(entries) & ~3]):
+                if not datagram_index or not datagram_length:
+                    break
+
+                if datagram_index + datagram_length > block_length:
+                    log.warning("NTB has a datagram outside of its block; skipping it.")
+                    continue
+
+                if self.tap:
+                    self.tap.write(ntb[datagram_index:datagram_index + datagram_length])
+
+            ndp_index = next_ndp_index
+
+
+    #
+    # Device to host: NTB aggregation.
+    #
+
+    def handle_ntb_requested(self, endpoint: USBEndpoint):
+        """ Packs as many pending frames as fit into a single NTB16, and sends it to the host. """
+
+        if not self.tap:
+            return
+
+        view        = self._ntb_in_view
+        limit       = self.ntb_in_size - self._ndp_reserve
+        offset      = _align(NTH16_LENGTH)
+        datagrams   = []
+
+        # Read each frame directly into its final place in the NTB.
+        while len(datagrams) < NTB_MAX_DATAGRAMS and offset + MAX_SEGMENT_SIZE <= limit:
+            length = self.tap.read_into(view[offset:offset + MAX_SEGMENT_SIZE])
+            if not length:
+                break
+
+            datagrams.append((offset, length))
+            offset = _align(offset + length)
+
+        if not datagrams:
+            return
+
+        # Place our NDP after the datagrams. If the NTB would end on a packet boundary,
+        # we'd owe the host a ZLP; so pad out, keeping our NDP aligned, to avoid needing one.
+        ndp_index    = offset
+        ndp_length   = NDP16_LENGTH + 4 * (len(datagrams) + 1)
+        if (ndp_index + ndp_length) % endpoint.max_packet_size == 0:
+            ndp_index += NTB_ALIGNMENT
+
+        block_length = ndp_index + ndp_length
+
+        struct.pack_into(NDP16_FORMAT, self._ntb_in, ndp_index, NDP16_SIGNATURE, ndp_length, 0)
+        entry_offset = ndp_index + NDP16_LENGTH
+        for datagram in datagrams:
+            struct.pack_into("<HH", self._ntb_in, entry_offset, *datagram)
+            entry_offset += 4
+        struct.pack_into("<HH", self._ntb_in, entry_offset, 0, 0)
+
+        struct.pack_into(NTH16_FORMAT, self._ntb_in, 0, NTH16_SIGNATURE, NTH16_LENGTH,
+            self.ntb_sequence, block_length, ndp_index)
+        self.ntb_sequence = (self.ntb_sequence + 1) & 0xFFFF
+
+        endpoint.send(view[:block_length])
+
+
+
+if __name__ == "__main__":
+    default_main(USBNCMDevice)
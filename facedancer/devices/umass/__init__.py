@@ -1,2 +1,4 @@
 from .umass       import *
 from .disk_image  import *
+from .cache       import *
+from .chunk_store import *
@@ -0,0 +1,291 @@
+#
+# This file is part of Facedancer.
+#
+""" Sector caching for slow disk images. """
+
+import threading
+
+from collections        import OrderedDict
+from concurrent.futures import ThreadPoolExecutor
+
+from .disk_image        import DiskImage
+
+from ...logging         import log
+
+
+class CachedDiskImage(DiskImage):
+    """ Wraps another disk image, caching recently-read sectors in memory.
+
+    Sectors are cached in runs of ``run_sectors`` consecutive sectors, and the ``cache_runs``
+    least-recently-used runs are kept. When the host reads runs in ascending order, the next
+    ``readahead_runs`` are fetched from the backing image on a background thread, so they're
+    usually ready by the time the host asks for them. Writes go straight through to the
+    backing image, and discard any cached copies of the sectors they touch.
+
+    The backing image is only ever used by one thread at a time; so it needn't be thread-safe.
+
+    Intended for images that are slow to read; e.g. ones on network filesystems, or generated
+    sector-by-sector like ``FAT32DiskImage``::
+
+        device = USBMassStorageDevice(CachedDiskImage(RawDiskImage(filename, 512)))
+
+    Args:
+        backing        : The disk image to cache.
+        run_sectors    : The number of consecutive sectors fetched and cached together.
+        cache_runs     : The maximum number of runs to keep cached.
+        readahead_runs : The number of runs to prefetch once sequential access is detected;
+                         or zero to disable prefetching.
+    """
+
+    # The number of consecutive ascending runs that must be read before we start prefetching.
+    SEQUENTIAL_THRESHOLD = 2
+
+    def __init__(self, backing: DiskImage, *, run_sectors: int = 64, cache_runs: int = 256,
+            readahead_runs: int = 4):
+        self.backing        = backing
+        self.run_sectors    = run_sectors
+        self.cache_runs     = cache_runs
+        self.readahead_runs = readahead_runs
+
+        # Maps run number -> run data, least-recently-used first.
+        self._runs          = OrderedDict()
+        self._lock          = threading.Lock()
+
+        # Held for each access to the backing image; and, for writes, until the cache has been
+        # updated to match. A fetched run is stored while it's still held, so it can't be stale.
+        self._backing_lock  = threading.Lock()
+
+        # Prefetches that haven't yet finished, by run number.
+        self._prefetching   = {}
+        self._executor      = ThreadPoolExecutor(max_workers=1, thread_name_prefix="umass-readahead") \
+                if readahead_runs else None
+
+        # Sequential access detection.
+        self._last_run      = None
+        self._streak        = 0
+
+        # Statistics.
+        self.hits           = 0
+        self.misses         = 0
+        self.prefetches     = 0
+
+
+    def __getattr__(self, name):
+        if name == 'backing':
+            raise AttributeError(name)
+
+        # Anything we don't cache is the backing image's business.
+        return getattr(self.backing, name)
+
+
+    def close(self):
+        if self._executor is not None:
+            self._executor.shutdown(wait=True)
+            self._executor = None
+
+        self.backing.close()
+
+
+    def get_sector_size(self):
+        return self.backing.get_sector_size()
+
+
+    def get_sector_count(self):
+        return self.backing.get_sector_count()
+
+
+    @property
+    def block_size(self):
+        return self.backing.get_sector_size()
+
+
+    def supports_discard(self):
+        return self.backing.supports_discard()
+
+
+    def get_discard_granularity(self):
+        return self.backing.get_discard_granularity()
+
+
+    #
+    # Reads.
+    #
+
+    def get_sector_data(self, address):
+        run    = self._get_run(address // self.run_sectors)
+        offset = (address % self.run_sectors) * self.get_sector_size()
+        return run[offset:offset + self.get_sector_size()]
+
+
+    def get_data(self, address, length):
+        sector_size = self.get_sector_size()
+        data        = bytearray()
+
+        while len(data) < length:
+            run_number = address // self.run_sectors
+            run        = self._get_run(run_number)
+            offset     = (address % self.run_sectors) * sector_size
+
+            # Take as much of the run as we need, in one slice.
+            chunk      = run[offset:offset + (length - len(data) + sector_size - 1) // sector_size * sector_size]
+            if not chunk:
+                break
+
+            data    += chunk
+            address += len(chunk) // sector_size
+
+        return bytes(data)
+
+
+    def _get_run(self, run_number):
+        """ Returns the data for the given run; fetching it if it isn't cached. """
+
+        self._note_access(run_number)
+
+        with self._lock:
+            run     = self._runs.get(run_number)
+            pending = self._prefetching.get(run_number)
+
+            if run is not None:
+                self._runs.move_to_end(run_number)
+                self.hits += 1
+                return run
+
+        # If the run's already on its way, wait for it rather than fetching it twice.
+        if pending is not None:
+            pending.result()
+
+            with self._lock:
+                run = self._runs.get(run_number)
+                if run is not None:
+                    self._runs.move_to_end(run_number)
+                    self.hits += 1
+                    return run
+
+        with self._lock:
+            self.misses += 1
+
+        return self._fetch_run(run_number)
+
+
+    def _fetch_run(self, run_number):
+        """ Reads an entire run from the backing image, clipped to the end of the disk; and caches it. """
+
+        first = run_number * self.run_sectors
+        last  = min(first + self.run_sectors, self.get_sector_count() + 1)
+
+        with self._backing_lock:
+            run = bytes(self.backing.get_data(first, (last - first) * self.get_sector_size()))
+            self._store_run(run_number, run)
+
+        return run
+
+
+    def _store_run(self, run_number, run):
+        with self._lock:
+            self._runs[run_number] = run
+            self._runs.move_to_end(run_number)
+
+            while len(self._runs) > self.cache_runs:
+                self._runs.popitem(last=False)
+
+
+    #
+    # Read-ahead.
+    #
+
+    def _note_access(self, run_number):
+        """ Tracks the host's access pattern; and starts a prefetch when it looks sequential. """
+
+        if run_number == self._last_run:
+            return
+
+        if self._last_run is not None and run_number == self._last_run + 1:
+            self._streak += 1
+        else:
+            self._streak = 0
+
+        self._last_run = run_number
+
+        if self._executor is not None and self._streak >= self.SEQUENTIAL_THRESHOLD:
+            self._prefetch(run_number + 1, run_number + 1 + self.readahead_runs)
+
+
+    def _prefetch(self, first_run, end_run):
+        last_run = self.get_sector_count() // self.run_sectors
+
+        with self._lock:
+            for run_number in range(first_run, min(end_run, last_run + 1)):
+                if run_number in self._runs or run_number in self._prefetching:
+                    continue
+
+                self.prefetches += 1
+                self._prefetching[run_number] = self._executor.submit(self._prefetch_run, run_number)
+
+
+    def _prefetch_run(self, run_number):
+        """ Runs on our read-ahead thread: fetches a single run into the cache. """
+
+        try:
+            self._fetch_run(run_number)
+        except Exception as e:
+            log.debug(f"read-ahead of run {run_number} failed: {e}")
+        finally:
+            with self._lock:
+                self._prefetching.pop(run_number, None)
+
+
+    #
+    # Writes.
+    #
+
+    def put_data(self, address, data):
+        sector_count = (len(data) + self.get_sector_size() - 1) // self.get_sector_size()
+
+        with self._backing_lock:
+            result = self.backing.put_data(address, data)
+            self._invalidate(address, sector_count)
+
+        return result
+
+
+    def put_sector_data(self, address, data):
+        with self._backing_lock:
+            self.backing.put_sector_data(address, data)
+            self._invalidate(address, 1)
+
+
+    def discard(self, address, count):
+        with self._backing_lock:
+            self.backing.discard(address, count)
+            self._invalidate(address, count)
+
+
+    def _invalidate(self, address, sector_count):
+        """ Discards any cached copies of the given sectors.
+
+        Called with the backing lock held, once the write has reached the backing image: any
+        fetch of these sectors has either been cached already, or will see the new data.
+        """
+
+        first_run = address // self.run_sectors
+        last_run  = (address + max(sector_count, 1) - 1) // self.run_sectors
+
+        with self._lock:
+
+            # A large discard can span far more runs than we could ever cache; so, rather than
+            # visit every run in the range, visit whichever's smaller: the range, or the cache.
+            if last_run - first_run + 1 > len(self._runs):
+                stale = [run_number for run_number in self._runs if first_run <= run_number <= last_run]
+            else:
+                stale = range(first_run, last_run + 1)
+
+            for run_number in stale:
+                self._runs.pop(run_number, None)
+
+
+    def invalidate_all(self):
+        """ Discards everything we've cached; e.g. after the backing image is changed behind our back. """
+
+        with self._backing_lock, self._lock:
+            self._runs.clear()
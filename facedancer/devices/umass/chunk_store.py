@@ -0,0 +1,405 @@
+#
+# This file is part of Facedancer.
+#
+""" Content-addressed, deduplicated storage for many similar disk images.
+
+Each image is split into fixed-size chunks, which are stored once per distinct content in a
+shared :class:`ChunkStore`; an image is then just a :class:`ChunkMap` listing its chunks' hashes.
+Images that are mostly identical -- e.g. a farm of devices each presenting the same OS install,
+with small per-device changes -- share almost all of their chunks on disk; and, as each chunk
+file is mapped read-only, share them in the page cache too::
+
+    store = ChunkStore("/var/lib/facedancer/chunks")
+    store.import_image("install.img").save("install.map")
+
+    for n in range(count):
+        image = ChunkedDiskImage(store, ChunkMap.load("install.map"), map_filename=f"device{n}.map")
+        devices.append(USBMassStorageDevice(image))
+
+Writes are copy-on-write: modified chunks are kept privately until :meth:`ChunkedDiskImage.flush`,
+which stores them as new chunks and points the image's own map at them.
+"""
+
+import os
+import mmap
+import struct
+import hashlib
+import tempfile
+
+from collections import OrderedDict
+from typing      import Iterable, List, Optional
+
+from .disk_image import DiskImage
+
+from ...logging  import log
+
+
+# Size of each chunk hash, in bytes.
+DIGEST_SIZE = 32
+
+
+def chunk_digest(data) -> bytes:
+    """ Returns the content hash used to identify a chunk. """
+    return hashlib.blake2b(data, digest_size=DIGEST_SIZE).digest()
+
+
+
+class ChunkMap:
+    """ The list of chunks that make up a single image.
+
+    All-zero chunks aren't stored at all; they're recorded in the map as None.
+
+    Args:
+        chunk_size : The size of each chunk, in bytes.
+        size       : The size of the image, in bytes.
+        chunks     : The digest of each chunk, in order; or None for all-zero chunks.
+    """
+
+    MAGIC  = b"FDCHUNKS"
+    HEADER = struct.Struct("<8sIQI")
+
+    def __init__(self, chunk_size: int, size: int, chunks: List[Optional[bytes]] = None):
+        self.chunk_size = chunk_size
+        self.size       = size
+        self.chunks     = chunks if chunks is not None else [None] * -(-size // chunk_size)
+
+
+    @classmethod
+    def load(cls, filename: str) -> 'ChunkMap':
+        """ Reads a chunk map from a file written by :meth:`save`. """
+
+        with open(filename, "rb") as f:
+            header = f.read(cls.HEADER.size)
+            if len(header) < cls.HEADER.size:
+                raise ValueError(f"{filename} is not a chunk map")
+
+            magic, chunk_size, size, count = cls.HEADER.unpack(header)
+            if magic != cls.MAGIC:
+                raise ValueError(f"{filename} is not a chunk map")
+
+            # A map must list exactly one digest per chunk of its image; anything else is damaged.
+            if not chunk_size or count != -(-size // chunk_size):
+                raise ValueError(f"{filename} lists {count} chunks; but describes a {size}-byte image")
+
+            raw = f.read(count * DIGEST_SIZE)
+            if len(raw) != count * DIGEST_SIZE:
+                raise ValueError(f"{filename} is truncated")
+
+        zero   = bytes(DIGEST_SIZE)
+        chunks = [raw[i:i + DIGEST_SIZE] for i in range(0, len(raw), DIGEST_SIZE)]
+        return cls(chunk_size, size, [None if digest == zero else digest for digest in chunks])
+
+
+    def save(self, filename: str):
+        """ Writes this chunk map to a file; atomically replacing any existing one. """
+
+        zero = bytes(DIGEST_SIZE)
+        data = self.HEADER.pack(self.MAGIC, self.chunk_size, self.size, len(self.chunks))
+        data += b"".join(zero if digest is None else digest for digest in self.chunks)
+
+        _write_atomically(filename, data)
+
+
+    def copy(self) -> 'ChunkMap':
+        return ChunkMap(self.chunk_size, self.size, list(self.chunks))
+
+
+
+class ChunkStore:
+    """ A directory of immutable chunks, each named by the hash of its contents.
+
+    Any number of images, and processes, can share a store. Chunks are only ever added, and
+    are written atomically, so concurrent writers of the same chunk are harmless.
+
+    Args:
+        directory  : The directory that holds the chunks; created if necessary.
+        chunk_size : The chunk size used by images imported into this store.
+        max_open   : The maximum number of chunk files to keep mapped at once.
+    """
+
+    def __init__(self, directory: str, *, chunk_size: int = 64 * 1024, max_open: int = 1024):
+        self.directory  = directory
+        self.chunk_size = chunk_size
+        self.max_open   = max_open
+
+        # Open chunk mappings, least-recently-used first.
+        self._mapped    = OrderedDict()
+
+        os.makedirs(directory, exist_ok=True)
+
+
+    def path_for(self, digest: bytes) -> str:
+        """ Returns the filename for the chunk with the given digest. """
+        name = digest.hex()
+        return os.path.join(self.directory, name[:2], name)
+
+
+    def __contains__(self, digest: bytes) -> bool:
+        return os.path.exists(self.path_for(digest))
+
+
+    def put(self, data) -> Optional[bytes]:
+        """ Stores a chunk, if we don't already have it; and returns its digest, or None if it's all zeroes. """
+
+        if not any(data):
+            return None
+
+        digest = chunk_digest(data)
+        path   = self.path_for(digest)
+
+        if not os.path.exists(path):
+            os.makedirs(os.path.dirname(path), exist_ok=True)
+            _write_atomically(path, data)
+
+        return digest
+
+
+    def get(self, digest: Optional[bytes]):
+        """ Returns a read-only view of the chunk with the given digest; or None for an all-zero chunk. """
+
+        if digest is None:
+            return None
+
+        mapping = self._mapped.get(digest)
+        if mapping is not None:
+            self._mapped.move_to_end(digest)
+            return mapping
+
+        with open(self.path_for(digest), "rb") as f:
+            mapping = mmap.mmap(f.fileno(), 0, prot=mmap.PROT_READ)
+
+        self._mapped[digest] = mapping
+        while len(self._mapped) > self.max_open:
+            _, evicted = self._mapped.popitem(last=False)
+            evicted.close()
+
+        return mapping
+
+
+    def import_image(self, filename: str) -> ChunkMap:
+        """ Splits an existing raw image into chunks, storing any we don't yet have; and returns its map. """
+
+        size      = os.stat(filename).st_size
+        chunk_map = ChunkMap(self.chunk_size, size)
+
+        with open(filename, "rb") as f:
+            for index in range(len(chunk_map.chunks)):
+                data = f.read(self.chunk_size)
+                chunk_map.chunks[index] = self.put(data.ljust(self.chunk_size, b"\0"))
+
+        return chunk_map
+
+
+    def export_image(self, chunk_map: ChunkMap, filename: str):
+        """ Writes out the full contents of an image, as a raw image file. """
+
+        with open(filename, "wb") as f:
+            for digest in chunk_map.chunks:
+                chunk = self.get(digest)
+                f.write(chunk if chunk is not None else bytes(chunk_map.chunk_size))
+
+            f.truncate(chunk_map.size)
+
+
+    def remove_unreferenced(self, chunk_maps: Iterable[ChunkMap]) -> int:
+        """ Deletes every chunk not used by any of the given maps; returns the number deleted.
+
+        Only safe while nothing else is adding chunks to the store.
+        """
+
+        live    = {digest.hex() for chunk_map in chunk_maps for digest in chunk_map.chunks if digest}
+        removed = 0
+
+        for prefix in os.listdir(self.directory):
+            subdirectory = os.path.join(self.directory, prefix)
+            if not os.path.isdir(subdirectory):
+                continue
+
+            for name in os.listdir(subdirectory):
+                if name not in live:
+                    os.unlink(os.path.join(subdirectory, name))
+                    removed += 1
+
+        return removed
+
+
+    def close(self):
+        """ Releases all of our chunk mappings. """
+        for mapping in self._mapped.values():
+            mapping.close()
+        self._mapped.clear()
+
+
+
+class ChunkedDiskImage(DiskImage):
+    """ Disk image backed by a chunk map in a shared ChunkStore.
+
+    Args:
+        store         : The store holding the image's chunks.
+        chunk_map     : The image's chunk map. The image takes ownership of it, and updates it
+                        as writes are flushed.
+        block_size    : The image's sector size, in bytes; must divide the chunk size.
+        map_filename  : If provided, the chunk map is saved here each time writes are flushed.
+        max_dirty     : The number of privately-modified chunks to hold before flushing.
+    """
+
+    def __init__(self, store: ChunkStore, chunk_map: ChunkMap, *, block_size: int = 512,
+            map_filename: str = None, max_dirty: int = 64):
+
+        if chunk_map.chunk_size % block_size:
+            raise ValueError(f"chunk size {chunk_map.chunk_size} is not a multiple of block size {block_size}")
+
+        self.store        = store
+        self.chunk_map    = chunk_map
+        self.block_size   = block_size
+        self.map_filename = map_filename
+        self.max_dirty    = max_dirty
+
+        self.size         = chunk_map.size
+        self.chunk_size   = chunk_map.chunk_size
+
+        # Our private copies of chunks we've modified, but not yet flushed, by chunk index.
+        self._dirty       = {}
+
+        # True iff our chunk map has changed (e.g. by a discard) since it was last saved.
+        self._map_changed = False
+
+
+    def close(self):
+        self.flush()
+
+
+    def get_sector_count(self):
+        return int(self.size / self.block_size) - 1
+
+
+    def _read_chunk(self, index):
+        """ Returns the current contents of a chunk; or None if it's all zeroes. """
+        dirty = self._dirty.get(index)
+        if dirty is not None:
+            return dirty
+
+        return self.store.get(self.chunk_map.chunks[index])
+
+
+    def get_sector_data(self, address):
+        return self.get_data(address, self.block_size)
+
+
+    def get_data(self, address, length):
+        offset = address * self.block_size
+        end    = min(offset + length, self.size)
+        data   = bytearray()
+
+        while offset < end:
+            index       = offset // self.chunk_size
+            chunk_start = offset % self.chunk_size
+            chunk_end   = min(self.chunk_size, chunk_start + (end - offset))
+
+            chunk = self._read_chunk(index)
+            if chunk is None:
+                data += bytes(chunk_end - chunk_start)
+            else:
+                data += chunk[chunk_start:chunk_end]
+
+            offset += chunk_end - chunk_start
+
+        return bytes(data)
+
+
+    def put_sector_data(self, address, data):
+        self.put_data(address, data[:self.block_size])
+
+
+    def put_data(self, address, data):
+        data   = memoryview(data)
+        offset = address * self.block_size
+
+        # Never write past the end of the image.
+        data   = data[:max(self.size - offset, 0)]
+
+        while data:
+            index       = offset // self.chunk_size
+            chunk_start = offset % self.chunk_size
+            length      = min(self.chunk_size - chunk_start, len(data))
+
+            # Copy the chunk on first write; after that, modify our private copy in place.
+            dirty = self._dirty.get(index)
+            if dirty is None:
+                original = self.store.get(self.chunk_map.chunks[index])
+                dirty = bytearray(original) if original is not None else bytearray(self.chunk_size)
+                self._dirty[index] = dirty
+
+            dirty[chunk_start:chunk_start + length] = data[:length]
+
+            data    = data[length:]
+            offset += length
+
+        if len(self._dirty) >= self.max_dirty:
+            self.flush()
+
+
+    def supports_discard(self):
+        return True
+
+
+    def get_discard_granularity(self):
+        return self.chunk_size // self.block_size
+
+
+    def discard(self, address, count):
+        """ Discards a run of blocks; releasing any chunks it entirely covers. """
+
+        offset = address * self.block_size
+        end    = min((address + count) * self.block_size, self.size)
+
+        while offset < end:
+            index       = offset // self.chunk_size
+            chunk_start = offset % self.chunk_size
+            length      = min(self.chunk_size - chunk_start, end - offset)
+
+            # Whole chunks are simply dropped from our map; all-zero chunks aren't stored.
+            if length == self.chunk_size:
+                self._dirty.pop(index, None)
+                self.chunk_map.chunks[index] = None
+                self._map_changed = True
+            else:
+                self.put_data(offset // self.block_size, bytes(length))
+
+            offset += length
+
+        if self._map_changed:
+            self.flush()
+
+
+    def flush(self):
+        """ Stores any chunks we've modified, and points our chunk map at them. """
+
+        if not self._dirty and not self._map_changed:
+            return
+
+        for index, chunk in self._dirty.items():
+            self.chunk_map.chunks[index] = self.store.put(chunk)
+
+        log.debug(f"flushed {len(self._dirty)} modified chunk(s) to {self.store.directory}")
+        self._dirty.clear()
+        self._map_changed = False
+
+        if self.map_filename is not None:
+            self.chunk_map.save(self.map_filename)
+
+
+
+def _write_atomically(filename, data):
+    """ Writes a file such that readers only ever see its complete contents. """
+
+    directory = os.path.dirname(filename) or "."
+    fd, temporary = tempfile.mkstemp(dir=directory, prefix=".tmp-")
+
+    try:
+        with os.fdopen(fd, "wb") as f:
+            f.write(data)
+        os.replace(temporary, filename)
+    except BaseException:
+        os.unlink(temporary)
+        raise
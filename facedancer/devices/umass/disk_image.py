@@ -1,6 +1,10 @@
 from mmap import mmap
 
 import os
+import ctypes
+import ctypes.util
+
+from ...logging import log
 
 
 class DiskImage:
@@ -8,15 +12,20 @@ class DiskImage:
         Class representing an arbitrary disk image, which can be procedurally generated,
         or which can be rendered from e.g. a file.
 
-        Currently limited to representing disk with 512-byte sectors.
+        Images have a fixed logical block ("sector") size, which is reported to the host and
+        used for all LBA math; 512 bytes unless a subclass sets ``block_size``. Native 4Kn
+        drives can be emulated with 4096-byte blocks.
     """
 
+    block_size = 512
+
     def close(self):
         """ Closes and cleans up any resources held by the disk image. """
         pass
 
     def get_sector_size(self):
-        return 512
+        """ Returns the disk's logical block size, in bytes. """
+        return self.block_size
 
     def get_sector_count(self):
         """ Returns the disk's sector count. """
@@ -25,7 +34,7 @@ class DiskImage:
     def get_data(self, address, length):
         data_to_read = length
         sector_size  = self.get_sector_size()
-        data         = bytes()
+        data         = bytearray()
 
         while data_to_read > 0:
             data.extend(self.get_sector_data(address))
@@ -33,7 +42,7 @@ class DiskImage:
 
             address += 1
 
-        return data
+        return bytes(data)
 
 
     def get_sector_data(self, address):
@@ -55,12 +64,39 @@ class DiskImage:
 
     def put_sector_data(self, address, data):
         """ Sets the raw binary data for a given disk sector. """
-        sys.stderr.write("WARNING: UMS write ignored; this type of image does not support writing.\n")
+        log.warning("UMS write ignored; this type of image does not support writing.")
+
+
+    def supports_discard(self):
+        """ Returns true iff this image can discard blocks (e.g. for UNMAP); after which they read as zeroes. """
+        return False
+
+
+    def get_discard_granularity(self):
+        """ Returns the number of blocks this image can most efficiently discard at once. """
+        return 1
+
+
+    def discard(self, address, count):
+        """ Discards a run of blocks, which then read as zeroes.
+
+        Images that can free the underlying storage should override this; by default, we just
+        write zeroes over the blocks.
+        """
+        sector_size  = self.get_sector_size()
+        chunk_blocks = max(1, (64 * 1024) // sector_size)
+
+        for offset in range(0, count, chunk_blocks):
+            blocks = min(chunk_blocks, count - offset)
+            self.put_data(address + offset, bytes(blocks * sector_size))
 
 
 class FAT32DiskImage(DiskImage):
     """
     Class for manufacturing synthetic FAT32 disk images.
+
+    The filesystem layout below is expressed in 512-byte sectors, so these images always use
+    512-byte blocks.
     """
 
     CLUSTER_SIZE         = 512
@@ -444,9 +480,20 @@ class FAT32DiskImage(DiskImage):
 class RawDiskImage(DiskImage):
     """
         Raw disk image backed by a file.
+
+        Discarded blocks are deallocated from the file by punching holes in it, where the
+        platform and filesystem support it; so images stay sparse as the host frees space.
+        Elsewhere, the image doesn't support discarding at all; rather than fill itself in with zeroes.
     """
 
-    def __init__(self, filename, block_size, verbose=0):
+    # fallocate() modes; from linux/falloc.h.
+    FALLOC_FL_KEEP_SIZE  = 0x01
+    FALLOC_FL_PUNCH_HOLE = 0x02
+
+    def __init__(self, filename, block_size=512, verbose=0):
+        if block_size < 512 or block_size & (block_size - 1):
+            raise ValueError(f"block size must be a power of two, and at least 512 bytes; not {block_size}")
+
         self.filename = filename
         self.block_size = block_size
         self.verbose = verbose
@@ -457,9 +504,18 @@ class RawDiskImage(DiskImage):
         self.file = open(self.filename, 'r+b')
         self.image = mmap(self.file.fileno(), 0)
 
+        # Find out whether we can punch holes, by punching one just past the end of the file;
+        # which deallocates nothing, but fails just the same where it's unsupported.
+        self.can_punch_holes = self._punch_hole(self.size, self.block_size)
+
     def close(self):
+        # Disconnecting the device closes its image; so we may already be closed.
+        if self.image.closed:
+            return
+
         self.image.flush()
         self.image.close()
+        self.file.close()
 
     def get_sector_count(self):
         return int(self.size / self.block_size) - 1
@@ -482,12 +538,54 @@ class RawDiskImage(DiskImage):
 
         return data
 
+    def get_data(self, address, length):
+        # Read whole blocks, in a single slice of our mapping.
+        block_start = address * self.block_size
+        block_end   = block_start + -(-length // self.block_size) * self.block_size
+
+        return self.image[block_start:block_end]
+
     def put_data(self, address, data):
         if self.verbose > 1:
             blocks = int(len(data) / self.block_size)
             print("--> writing {} blocks at lba {}".format(blocks, address))
 
-        super().put_data(address, data)
+        block_start = address * self.block_size
+        self.image[block_start:block_start + len(data)] = data
+        self.image.flush()
+
+
+    def supports_discard(self):
+        return self.can_punch_holes
+
+
+    def get_discard_granularity(self):
+        # Holes can only be punched in whole filesystem blocks.
+        return max(1, os.fstat(self.file.fileno()).st_blksize // self.block_size)
+
+
+    def discard(self, address, count):
+        offset = address * self.block_size
+        length = count * self.block_size
+
+        if self.verbose > 1:
+            print("--> discarding {} blocks at lba {}".format(count, address))
+
+        # Punch a hole where we can; the blocks then read as zeroes, and no longer take up space.
+        # Our mapping is shared, so it sees the hole immediately.
+        if not self._punch_hole(offset, length):
+            super().discard(address, count)
+
+
+    def _punch_hole(self, offset, length):
+        """ Deallocates part of our file; returns false if the platform or filesystem can't. """
+
+        fallocate = _libc_fallocate()
+        if fallocate is None:
+            return False
+
+        mode = self.FALLOC_FL_PUNCH_HOLE | self.FALLOC_FL_KEEP_SIZE
+        return fallocate(self.file.fileno(), mode, offset, length) == 0
 
 
     def put_sector_data(self, address, data):
@@ -509,3 +607,23 @@ class RawDiskImage(DiskImage):
 
         self.image[block_start:block_end] = data[:self.block_size]
         self.image.flush()
+
+
+
+# The C library's fallocate(); looked up on first use.
+_fallocate = False
+
+def _libc_fallocate():
+    """ Returns the C library's fallocate(), which (unlike os.posix_fallocate) takes a mode; or None. """
+
+    global _fallocate
+
+    if _fallocate is False:
+        try:
+            libc = ctypes.CDLL(ctypes.util.find_library("c"), use_errno=True)
+            _fallocate = libc.fallocate
+            _fallocate.argtypes = [ctypes.c_int, ctypes.c_int, ctypes.c_int64, ctypes.c_int64]
+        except (OSError, AttributeError, TypeError):
+            _fallocate = None
+
+    return _fallocate
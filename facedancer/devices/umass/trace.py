@@ -0,0 +1,332 @@
+#
+# This file is part of Facedancer.
+#
+""" Block-access tracing for emulated disks; and offline heatmaps of the resulting traces.
+
+A :class:`BlockAccessTracer` records one fixed-size binary record per block command -- when it
+started, its opcode, its LBA and length, and how long it took -- into a ring held in a memory
+map. Recording is a single ``pack_into``, so a tracer can be left attached during throughput
+runs. Pass one to a mass storage device to trace it::
+
+    tracer = BlockAccessTracer("insertion.trace")
+    device = USBMassStorageDevice(disk_image, tracer=tracer)
+
+Traces are analysed offline; e.g. to see which regions of the disk a host scans on insertion::
+
+    python -m facedancer.devices.umass.trace insertion.trace --region-size 2048
+"""
+
+import mmap
+import time
+import struct
+import argparse
+
+from dataclasses import dataclass, field
+from typing      import Dict, Iterable, Iterator, List
+
+
+# SCSI opcodes that read from the medium; all other traced opcodes are considered writes.
+READ_OPCODES = frozenset((0x08, 0x28, 0xa8, 0x88))
+
+
+@dataclass
+class BlockAccess:
+    """ A single traced block command.
+
+    Fields:
+        timestamp : When the command was received, in seconds since the trace began.
+        opcode    : The command's SCSI opcode.
+        lba       : The first block the command accessed.
+        length    : The number of blocks the command accessed.
+        latency   : The time taken to complete the command, in seconds.
+    """
+
+    timestamp : float
+    opcode    : int
+    lba       : int
+    length    : int
+    latency   : float
+
+    @property
+    def is_read(self) -> bool:
+        return self.opcode in READ_OPCODES
+
+
+
+class BlockAccessTracer:
+    """ Records block accesses into a fixed-size ring; either in memory, or in a mapped file.
+
+    Once the ring is full, each new record replaces the oldest.
+
+    Args:
+        filename : The file to record into; or None to record only into memory.
+        capacity : The maximum number of records held.
+    """
+
+    MAGIC  = b"FDBTRACE"
+
+    # Magic, record size, capacity, records written, and wall-clock start time.
+    HEADER = struct.Struct("<8sIIQd")
+
+    # Start time (relative to the trace's start), LBA, length, latency, and opcode.
+    RECORD = struct.Struct("<dQIfB7x")
+
+    def __init__(self, filename: str = None, *, capacity: int = 1 << 16):
+        self.filename = filename
+        self.capacity = capacity
+
+        size = self.HEADER.size + self.RECORD.size * capacity
+
+        if filename is not None:
+            with open(filename, "w+b") as f:
+                f.truncate(size)
+                self._map = mmap.mmap(f.fileno(), size)
+        else:
+            self._map = mmap.mmap(-1, size)
+
+        self.written = 0
+        self._origin = time.perf_counter()
+
+        self.HEADER.pack_into(self._map, 0, self.MAGIC, self.RECORD.size, capacity, 0, time.time())
+
+        # Bind everything record() needs up front; it's called on every block command.
+        self._pack   = self.RECORD.pack_into
+        self._count  = struct.Struct("<Q").pack_into
+        self._offset = self.HEADER.size - 16
+
+
+    def record(self, opcode: int, lba: int, length: int, latency: float, started: float):
+        """ Records a single block command.
+
+        Args:
+            opcode  : The command's SCSI opcode.
+            lba     : The first block accessed.
+            length  : The number of blocks accessed.
+            latency : The time taken to complete the command, in seconds.
+            started : When the command was received, as a ``time.perf_counter()`` value.
+        """
+
+        slot = self.written % self.capacity
+        self._pack(self._map, self.HEADER.size + slot * self.RECORD.size,
+            started - self._origin, lba, length, latency, opcode)
+
+        self.written += 1
+        self._count(self._map, self._offset, self.written)
+
+
+    def __iter__(self) -> Iterator[BlockAccess]:
+        return _iterate_records(self._map)
+
+
+    def flush(self):
+        self._map.flush()
+
+
+    def close(self):
+        if not self._map.closed:
+            self._map.flush()
+            self._map.close()
+
+
+
+def read_trace(filename: str) -> List[BlockAccess]:
+    """ Reads every record held in a trace file, oldest first. """
+
+    with open(filename, "rb") as f:
+        data = f.read()
+
+    return list(_iterate_records(data))
+
+
+def _iterate_records(data) -> Iterator[BlockAccess]:
+    header = BlockAccessTracer.HEADER
+    record = BlockAccessTracer.RECORD
+
+    magic, record_size, capacity, written, _ = header.unpack_from(data, 0)
+    if magic != BlockAccessTracer.MAGIC or record_size != record.size:
+        raise ValueError("not a block access trace")
+
+    # If the ring has wrapped, the oldest record is the one that'll next be overwritten.
+    count = min(written, capacity)
+    first = written - count
+
+    for index in range(first, written):
+        timestamp, lba, length, latency, opcode = \
+            record.unpack_from(data, header.size + (index % capacity) * record.size)
+        yield BlockAccess(timestamp, opcode, lba, length, latency)
+
+
+#
+# Offline analysis.
+#
+
+@dataclass
+class RegionActivity:
+    """ Access counts for a single region of a disk. """
+
+    reads          : int = 0
+    writes         : int = 0
+    blocks_read    : int = 0
+    blocks_written : int = 0
+
+    @property
+    def accesses(self) -> int:
+        return self.reads + self.writes
+
+
+
+@dataclass
+class AccessPatternSummary:
+    """ Sequential-versus-random statistics for a trace.
+
+    A command is sequential if it starts at the block just after the previous command of the
+    same kind (read or write) ended.
+    """
+
+    commands          : int   = 0
+    sequential        : int   = 0
+    blocks            : int   = 0
+    sequential_blocks : int   = 0
+    total_latency     : float = 0.0
+    duration          : float = 0.0
+    length_histogram  : Dict[int, int] = field(default_factory=dict)
+
+    @property
+    def random(self) -> int:
+        return self.commands - self.sequential
+
+    @property
+    def sequential_fraction(self) -> float:
+        return self.sequential / self.commands if self.commands else 0.0
+
+
+
+def build_heatmap(accesses: Iterable[BlockAccess], region_blocks: int) -> Dict[int, RegionActivity]:
+    """ Aggregates accesses into per-region activity; keyed by region number.
+
+    A command that spans several regions is counted once in each of them.
+    """
+
+    regions = {}
+
+    for access in accesses:
+        first = access.lba // region_blocks
+        last  = (access.lba + max(access.length, 1) - 1) // region_blocks
+
+        for number in range(first, last + 1):
+            region = regions.get(number)
+            if region is None:
+                region = regions[number] = RegionActivity()
+
+            start  = max(access.lba, number * region_blocks)
+            end    = min(access.lba + access.length, (number + 1) * region_blocks)
+            blocks = max(end - start, 0)
+
+            if access.is_read:
+                region.reads       += 1
+                region.blocks_read += blocks
+            else:
+                region.writes         += 1
+                region.blocks_written += blocks
+
+    return regions
+
+
+def summarize_access_pattern(accesses: Iterable[BlockAccess]) -> Dict[str, AccessPatternSummary]:
+    """ Returns sequential-versus-random statistics for a trace; separately for reads and writes. """
+
+    summaries = {'read': AccessPatternSummary(), 'write': AccessPatternSummary()}
+    next_lba  = {'read': None, 'write': None}
+    first     = {}
+    last      = {}
+
+    for access in accesses:
+        kind    = 'read' if access.is_read else 'write'
+        summary = summaries[kind]
+
+        summary.commands      += 1
+        summary.blocks        += access.length
+        summary.total_latency += access.latency
+
+        if access.lba == next_lba[kind]:
+            summary.sequential        += 1
+            summary.sequential_blocks += access.length
+
+        next_lba[kind] = access.lba + access.length
+
+        # Bucket lengths by power of two.
+        bucket = 1 << max(access.length - 1, 0).bit_length()
+        summary.length_histogram[bucket] = summary.length_histogram.get(bucket, 0) + 1
+
+        first.setdefault(kind, access.timestamp)
+        last[kind] = access.timestamp + access.latency
+
+    for kind, summary in summaries.items():
+        if kind in first:
+            summary.duration = last[kind] - first[kind]
+
+    return summaries
+
+
+def format_heatmap(regions: Dict[int, RegionActivity], region_blocks: int, *, width: int = 50) -> str:
+    """ Renders a heatmap as text; one line per region that was touched. """
+
+    if not regions:
+        return "(no accesses)"
+
+    busiest = max(region.accesses for region in regions.values())
+    lines   = [f"{'first LBA':>12} {'reads':>8} {'writes':>8}  activity"]
+
+    for number in sorted(regions):
+        region = regions[number]
+        bar    = "#" * max(1, round(region.accesses / busiest * width))
+        lines.append(f"{number * region_blocks:>12} {region.reads:>8} {region.writes:>8}  {bar}")
+
+    return "\n".join(lines)
+
+
+def format_access_pattern(summaries: Dict[str, AccessPatternSummary]) -> str:
+    """ Renders sequential-versus-random statistics as text. """
+
+    lines = []
+
+    for kind, summary in summaries.items():
+        if not summary.commands:
+            continue
+
+        mean_latency = summary.total_latency / summary.commands * 1e6
+        lengths      = ", ".join(f"<={length}: {count}" for length, count in sorted(summary.length_histogram.items()))
+
+        lines.append(f"{kind}s: {summary.commands} commands, {summary.blocks} blocks; "
+            f"{summary.sequential_fraction:.1%} sequential, mean latency {mean_latency:.1f}us")
+        lines.append(f"    lengths (blocks): {lengths}")
+
+    return "\n".join(lines) if lines else "(no accesses)"
+
+
+def main(argv=None):
+    parser = argparse.ArgumentParser(description="Summarizes a mass storage block access trace.")
+    parser.add_argument('trace', help="The trace file to analyse.")
+    parser.add_argument('--region-size', type=int, default=2048, help="The size of each heatmap region, in blocks.")
+    parser.add_argument('--csv', metavar='FILENAME', help="Also writes the per-region heatmap to a CSV file.")
+    args = parser.parse_args(argv)
+
+    accesses = read_trace(args.trace)
+    regions  = build_heatmap(accesses, args.region_size)
+
+    print(f"{len(accesses)} block commands traced.\n")
+    print(format_access_pattern(summarize_access_pattern(accesses)))
+    print()
+    print(format_heatmap(regions, args.region_size))
+
+    if args.csv:
+        with open(args.csv, "w") as f:
+            f.write("first_lba,reads,writes,blocks_read,blocks_written\n")
+            for number in sorted(regions):
+                region = regions[number]
+                f.write(f"{number * args.region_size},{region.reads},{region.writes},"
+                    f"{region.blocks_read},{region.blocks_written}\n")
+
+
+if __name__ == "__main__":
+    main()
@@ -10,9 +10,12 @@ import re
 import struct
 import sys
 import time
+import warnings
 
-from enum   import IntFlag
-from typing import Union
+from collections import deque
+from dataclasses import dataclass, field
+from enum        import IntFlag
+from typing      import Dict, List, Union
 
 from ..         import default_main
 
@@ -64,8 +67,10 @@ class USBMassStorageDevice(USBDevice):
                 max_packet_size : int             = 64
 
 
-    def __init__(self, disk_image):
-        self.disk_image = disk_image
+    def __init__(self, disk_image, *, trace_depth=0, tracer=None):
+        self.disk_image  = disk_image
+        self.trace_depth = trace_depth
+        self.tracer      = tracer
 
         super().__init__()
 
@@ -78,7 +83,8 @@ class USBMassStorageDevice(USBDevice):
         super().connect()
 
         # instantiate our SCSI command handler
-        self.scsi_command_handler = ScsiCommandHandler(self, self.disk_image, verbose=3)
+        self.scsi_command_handler = ScsiCommandHandler(self, self.disk_image,
+            trace_depth=self.trace_depth, tracer=self.tracer)
 
 
     def disconnect(self):
@@ -110,11 +116,10 @@ class USBMassStorageDevice(USBDevice):
     def handle_bulk_only_mass_storage_reset_request(self, request):
         request.reply(b'')
 
-    # TODO is this an internal event handler maybe?
     async def wait_for_host(self):
-        """ Waits until the host connects by TODO. """
+        """ Waits until the host connects; i.e. until it has configured us. """
 
-        while not True:
+        while self.configuration is None:
             await asyncio.sleep(0.1)
 
 
@@ -122,47 +127,206 @@ class USBMassStorageDevice(USBDevice):
 def bytes_as_hex(b, delim=" "):
     return delim.join(["%02x" % x for x in b])
 
+
+# Number of buckets in each latency histogram. Bucket 0 counts commands that took less than 1us;
+# bucket N, those that took [2^(N-1), 2^N) us; and the final bucket, anything slower.
+LATENCY_HISTOGRAM_BUCKETS = 24
+
+
+@dataclass
+class ScsiCommandStatistics:
+    """ Running statistics for a single SCSI opcode.
+
+    Fields:
+        count :
+            The number of commands completed.
+        failures :
+            The number of those commands that reported failure.
+        bytes_in :
+            The data-phase bytes sent to the host (e.g. by READ).
+        bytes_out :
+            The data-phase bytes received from the host (e.g. by WRITE).
+        busy_time :
+            The time, in seconds, spent handling these commands.
+        queue_time :
+            The time, in seconds, these commands spent waiting on the host between our handling
+            of their parts; e.g. for the data phase of a WRITE.
+        latency_histogram :
+            Command latency, from CBW to CSW, in power-of-two microsecond buckets.
+    """
+
+    count             : int       = 0
+    failures          : int       = 0
+    bytes_in          : int       = 0
+    bytes_out         : int       = 0
+    busy_time         : float     = 0.0
+    queue_time        : float     = 0.0
+    latency_histogram : List[int] = field(default_factory=lambda: [0] * LATENCY_HISTOGRAM_BUCKETS)
+
+
+    def record(self, latency: float, busy_time: float, bytes_in: int, bytes_out: int, failed: bool):
+        """ Accounts for a single completed command. """
+
+        self.count      += 1
+        self.failures   += failed
+        self.bytes_in   += bytes_in
+        self.bytes_out  += bytes_out
+        self.busy_time  += busy_time
+        self.queue_time += latency - busy_time
+
+        bucket = min(int(latency * 1e6).bit_length(), LATENCY_HISTOGRAM_BUCKETS - 1)
+        self.latency_histogram[bucket] += 1
+
+
+    @property
+    def throughput(self) -> float:
+        """ The data rate achieved while handling these commands, in MB/s. """
+        if not self.busy_time:
+            return 0.0
+        return (self.bytes_in + self.bytes_out) / self.busy_time / 1e6
+
+
+    @property
+    def mean_latency(self) -> float:
+        """ The mean command latency, in seconds. """
+        if not self.count:
+            return 0.0
+        return (self.busy_time + self.queue_time) / self.count
+
+
+
+@dataclass
+class ScsiTraceRecord:
+    """ A single completed command, as captured in a ScsiCommandHandler's trace ring. """
+
+    timestamp            : float
+    tag                  : int
+    lun                  : int
+    opcode               : int
+    name                 : str
+    command_block        : bytes
+    data_transfer_length : int
+    status               : int
+    latency              : float
+    bytes_in             : int
+    bytes_out            : int
+
+
+
+@dataclass
+class ScsiCommand:
+    """ An entry in a ScsiCommandHandler's dispatch table. """
+
+    number     : int
+    name       : str
+    handler    : callable
+    statistics : ScsiCommandStatistics = field(default_factory=ScsiCommandStatistics)
+
+
+
 class ScsiCommandHandler:
+    """ Handles the SCSI commands carried over our bulk-only transport.
+
+    Commands are dispatched through a table indexed directly by opcode; and every command is
+    counted in its opcode's statistics. If ``trace_depth`` is non-zero, a record of each of the
+    most recent ``trace_depth`` commands is also kept in ``trace``; and if a ``BlockAccessTracer``
+    is provided, every block read and write is recorded to it.
+    """
+
     name : str = "SCSI Command Handler"
 
     STATUS_OKAY       = 0x00
-    STATUS_FAILURE    = 0x02 # TODO: Should this be 0x01?
+    STATUS_FAILURE    = 0x01 # Command failed; the host should ask us for sense data.
     STATUS_INCOMPLETE = -1   # Special case status that aborts before response.
 
-    def __init__(self, device, disk_image, verbose=0):
+    # Sense keys, and additional sense codes, describing why a command failed.
+    SENSE_NO_SENSE                  = 0x00
+    SENSE_ILLEGAL_REQUEST           = 0x05
+
+    ASC_INVALID_OPERATION_CODE      = 0x20
+    ASC_LBA_OUT_OF_RANGE            = 0x21
+    ASC_INVALID_FIELD_IN_CDB        = 0x24
+    ASC_INVALID_FIELD_IN_PARAMETERS = 0x26
+
+    # The most data we read from, or write to, the disk image at once.
+    TRANSFER_CHUNK_SIZE = 64 * 1024
+
+    # Limits we advertise in the Block Limits VPD page.
+    MAX_UNMAP_DESCRIPTORS = 256
+    MAX_WRITE_SAME_BLOCKS = 1 << 24
+
+    def __init__(self, device, disk_image, verbose=0, *, trace_depth=0, tracer=None):
         self.device = device
         self.disk_image = disk_image
-        self.verbose = verbose
+
+        # We no longer print each command; diagnostics go through the package logger instead.
+        if verbose:
+            warnings.warn('`verbose` is ignored; use `trace_depth` or `tracer` to capture commands', DeprecationWarning)
 
         self.is_write_in_progress = False
         self.write_cbw = None
         self.write_base_lba = 0
         self.write_length = 0
-        self.write_data = b''
+        self.write_remaining = 0
+        self.write_valid = True
+        self.write_data = bytearray()
+
+        # For commands whose data phase carries parameters (e.g. UNMAP): the parameters so far,
+        # how many bytes we expect, and what to do with them once they've all arrived.
+        self.parameter_cbw = None
+        self.parameter_data = bytearray()
+        self.parameter_length = 0
+        self.parameter_handler = None
+
+        # The most recent commands we've completed; or None if tracing is off.
+        self.trace = deque(maxlen=trace_depth) if trace_depth else None
+        self.tracer = tracer
+
+        # Bookkeeping for the command currently in progress.
+        self._command    = None
+        self._started    = 0.0
+        self._busy_time  = 0.0
+        self._bytes_in   = 0
+        self._bytes_out  = 0
+
+        # The blocks accessed by the command in progress, if it's a block command.
+        self._lba        = None
+        self._blocks     = 0
+
+        # The sense key, additional sense code and qualifier for the last command; for REQUEST SENSE.
+        self.sense = (self.SENSE_NO_SENSE, 0, 0)
 
         self._register_scsi_commands()
 
 
     def handle_data_received(self, data):
+        now = time.perf_counter()
+
         if self.is_write_in_progress:
             cbw = self.write_cbw
             status, response = self.continue_write(cbw, data)
+        elif self.parameter_handler is not None:
+            cbw = self.parameter_cbw
+            status, response = self.continue_parameters(cbw, data)
         else:
             cbw = CommandBlockWrapper(data)
+            self._begin_command(cbw, now)
+
+            # Sense data describes the last command; so it lasts only until the host asks for it.
+            if cbw.cb[0] != 0x03:
+                self.sense = (self.SENSE_NO_SENSE, 0, 0)
+
             status, response = self.handle_scsi_command(cbw)
 
         # If we weren't able to complete the operation, return without
         # transmitting a response.
         if status == self.STATUS_INCOMPLETE:
+            self._busy_time += time.perf_counter() - now
             return
 
         # If we have a response payload to transmit, transmit it.
         if response:
-            if self.verbose > 2:
-                print("--> responding with", len(response),
-                      "bytes [{}], status={}".format(bytes_as_hex(response), status))
-
-            self.device.send(ENDPOINT_IN, response, blocking=True)
+            self._send(response)
 
         # Otherwise, respond with our status.
         csw = bytes([
@@ -174,51 +338,118 @@ class ScsiCommandHandler:
 
         self.device.send(ENDPOINT_IN, csw, blocking=True)
 
+        self._busy_time += time.perf_counter() - now
+        self._complete_command(cbw, status)
+
 
     def handle_scsi_command(self, cbw):
         """
             Handles an SCSI command.
         """
+        return self.commands[cbw.cb[0]].handler(cbw)
 
-        opcode = cbw.cb[0]
-        direction = cbw.flags >> 7
 
-        # If we have a handler for this routine, handle it.
-        if opcode in self.commands:
+    def _send(self, data):
+        """ Sends data-phase bytes to the host; accounting for them against the current command. """
+        self._bytes_in += len(data)
+        self.device.send(ENDPOINT_IN, data, blocking=True)
 
-            # Extract the command's data.
-            command = self.commands[opcode]
-            name    = command['name']
-            handler = command['handler']
-            direction_name = 'IN' if direction else 'OUT'
-            direction_arrow = "<--" if direction else "-->"
-            expected_length = cbw.data_transfer_length
 
-            if self.verbose > 0:
-                print("{} handling {} ({}) {}:[{}]".format(direction_arrow, name.upper(), direction_name, expected_length, bytes_as_hex(cbw.cb[1:])))
+    def _fail(self, cbw, asc, ascq=0, key=SENSE_ILLEGAL_REQUEST):
+        """ Fails the current command; recording why, for REQUEST SENSE. Returns a (status, response) pair.
 
-            # Delegate to its handler function.
-            return handler(cbw)
+        If the host expects data from us, it still needs its data phase before our status; so we
+        pad it with zeroes, a chunk at a time, rather than building a buffer as large as it asked for.
+        """
 
-        # Otherwise, run the unknown command handler.
-        else:
-            return self.handle_unknown_command(cbw)
+        self.sense = (key, asc, ascq)
 
+        if cbw.flags & 0x80:
+            remaining = cbw.data_transfer_length - self._bytes_in
+            zeroes    = bytes(min(remaining, self.TRANSFER_CHUNK_SIZE))
+
+            while remaining > 0:
+                self._send(zeroes[:remaining])
+                remaining -= len(zeroes)
+
+        return self.STATUS_FAILURE, None
+
+
+    #
+    # Statistics and tracing.
+    #
+
+    def _begin_command(self, cbw, now):
+        self._command   = self.commands[cbw.cb[0]]
+        self._started   = now
+        self._busy_time = 0.0
+        self._bytes_in  = 0
+        self._bytes_out = 0
+        self._lba       = None
+
+
+    def _complete_command(self, cbw, status):
+        command = self._command
+        latency = time.perf_counter() - self._started
+
+        command.statistics.record(latency, self._busy_time, self._bytes_in, self._bytes_out,
+            status != self.STATUS_OKAY)
+
+        if self.tracer is not None and self._lba is not None:
+            self.tracer.record(command.number, self._lba, self._blocks, latency, self._started)
+
+        if self.trace is not None:
+            self.trace.append(ScsiTraceRecord(
+                timestamp            = self._started,
+                tag                  = int.from_bytes(cbw.tag, byteorder='little'),
+                lun                  = cbw.lun,
+                opcode               = command.number,
+                name                 = command.name,
+                command_block        = bytes(cbw.cb[:cbw.cb_length]),
+                data_transfer_length = cbw.data_transfer_length,
+                status               = status,
+                latency              = latency,
+                bytes_in             = self._bytes_in,
+                bytes_out            = self._bytes_out,
+            ))
+
+
+    def get_statistics(self) -> Dict[str, ScsiCommandStatistics]:
+        """ Returns the statistics for each command we've handled, by command name. """
+        return {command.name: command.statistics for command in self.commands if command.statistics.count}
+
+
+    def reset_statistics(self):
+        """ Clears all of our per-command statistics, and our trace. """
+        for command in self.commands:
+            command.statistics = ScsiCommandStatistics()
+
+        if self.trace is not None:
+            self.trace.clear()
+
+
+    def format_statistics(self) -> str:
+        """ Returns a table summarizing our per-command statistics. """
+
+        lines = [f"{'command':<24} {'count':>8} {'fail':>6} {'in':>12} {'out':>12} {'MB/s':>8} {'mean us':>9} {'queue us':>9}"]
+
+        for name, stats in self.get_statistics().items():
+            lines.append(f"{name:<24} {stats.count:>8} {stats.failures:>6} {stats.bytes_in:>12} {stats.bytes_out:>12} "
+                f"{stats.throughput:>8.2f} {stats.mean_latency * 1e6:>9.1f} {stats.queue_time / stats.count * 1e6:>9.1f}")
+
+        return "\n".join(lines)
+
+
+    #
+    # Command handlers.
+    #
 
     def handle_unknown_command(self, cbw):
         """
             Handles unsupported SCSI commands.
         """
-        print(self.name, "received unsupported SCSI opcode 0x%x" % cbw.cb[0])
-
-        # Generate an empty response to the relevant command.
-        if cbw.data_transfer_length > 0:
-            response = bytes([0] * cbw.data_transfer_length)
-        else:
-            response = None
-
-        # Return failure.
-        return self.STATUS_FAILURE, response
+        log.warning(f"{self.name} received unsupported SCSI opcode 0x{cbw.cb[0]:02x}")
+        return self._fail(cbw, self.ASC_INVALID_OPERATION_CODE)
 
 
     def handle_ignored_event(self, cbw):
@@ -234,17 +465,32 @@ class ScsiCommandHandler:
         """
             Handles SCSI sense requests.
         """
-        response = b'\x70\x00\xFF\x00\x00\x00\x00\x0A\x00\x00\x00\x00\xFF\xFF\x00\x00\x00\x00\x00\x00\x00\x00\x00'
-        return self.STATUS_OKAY, response
+        allocation_length = cbw.cb[4]
+        key, asc, ascq    = self.sense
+
+        response = bytes([
+            0x70,                       # current error, fixed format
+            0x00,
+            key,
+            0x00, 0x00, 0x00, 0x00,     # no information
+            0x0a,                       # additional sense length
+            0x00, 0x00, 0x00, 0x00,     # no command-specific information
+            asc,
+            ascq,
+            0x00,                       # no field replaceable unit
+            0x00, 0x00, 0x00,           # no sense-key specific information
+        ])
+
+        # Having been reported, the sense data is cleared.
+        self.sense = (self.SENSE_NO_SENSE, 0, 0)
+        return self.STATUS_OKAY, response[:allocation_length]
 
 
     def handle_inquiry(self, cbw):
-        opcode, flags, page_code, allocation_length, control = struct.unpack(">BBBHB", cbw.cb[0:6])
 
-        # Print out the details of our inquiry.
-        if self.verbose > 1:
-            print("-- INQUIRY ({}) flags: {} page_code: {} allocation_length: {} control: {}". \
-                  format(opcode, flags, page_code, allocation_length, control))
+        # If the host's asking for vital product data, provide the relevant page.
+        if cbw.cb[1] & 0x01:
+            return self.handle_inquiry_vpd(cbw)
 
         response = bytes([
             0x00,       # 0x00 = device present, and provides direct access to blocks
@@ -267,12 +513,69 @@ class ScsiCommandHandler:
         return self.STATUS_OKAY, response
 
 
+    def handle_inquiry_vpd(self, cbw):
+        page              = cbw.cb[2]
+        allocation_length = int.from_bytes(cbw.cb[3:5], 'big')
+
+        pages = {
+            0x00: self._vpd_supported_pages,
+            0xb0: self._vpd_block_limits,
+            0xb2: self._vpd_logical_block_provisioning,
+        }
+
+        if page not in pages:
+            log.debug(f"{self.name}: unsupported VPD page 0x{page:02x}")
+            return self._fail(cbw, self.ASC_INVALID_FIELD_IN_CDB)
+
+        payload  = pages[page]()
+        response = bytes([0x00, page]) + len(payload).to_bytes(2, 'big') + payload
+
+        return self.STATUS_OKAY, response[:allocation_length]
+
+
+    def _vpd_supported_pages(self):
+        return bytes([0x00, 0xb0, 0xb2])
+
+
+    def _vpd_block_limits(self):
+        discard      = self.disk_image.supports_discard()
+        max_transfer = min(self.TRANSFER_CHUNK_SIZE // self.disk_image.get_sector_size(), 0xffffffff)
+
+        payload  = b'\x01'                                                       # WSNZ: WRITE SAME must give a length
+        payload += b'\x00'                                                       # no COMPARE AND WRITE
+        payload += b'\x00\x01'                                                   # optimal transfer length granularity
+        payload += b'\x00\x00\x00\x00'                                           # no maximum transfer length
+        payload += max_transfer.to_bytes(4, 'big')                               # optimal transfer length
+        payload += b'\x00\x00\x00\x00'                                           # no PRE-FETCH
+        payload += (0xffffffff if discard else 0).to_bytes(4, 'big')             # maximum UNMAP LBA count
+        payload += (self.MAX_UNMAP_DESCRIPTORS if discard else 0).to_bytes(4, 'big')
+        payload += self.disk_image.get_discard_granularity().to_bytes(4, 'big')  # optimal UNMAP granularity
+        payload += b'\x00\x00\x00\x00'                                           # no UNMAP alignment requirement
+        payload += self.MAX_WRITE_SAME_BLOCKS.to_bytes(8, 'big')                 # maximum WRITE SAME length
+        payload += bytes(20)
+        return payload
+
+
+    def _vpd_logical_block_provisioning(self):
+        discard = self.disk_image.supports_discard()
+
+        # If we can discard, advertise UNMAP and WRITE SAME (16) with UNMAP; and that discarded blocks read as zero.
+        flags = 0b11000100 if discard else 0x00
+
+        return bytes([
+            0x00,                       # no provisioning threshold
+            flags,
+            0x02 if discard else 0x00,  # provisioning type: thin if we can discard, full otherwise
+            0x00,
+        ])
+
+
     def handle_mode_sense_6(self, cbw):
         page = cbw.cb[2] & 0x3f
 
         response = b'\x03\x00\x00\x1c'
         if page != 0x3f:
-            print(self.name, "unknown page, returning empty page")
+            log.debug(f"{self.name}: unknown mode page 0x{page:02x}, returning empty page")
             response = b'\x03\x00\x00\x00'
 
         return self.STATUS_OKAY, response
@@ -283,16 +586,16 @@ class ScsiCommandHandler:
 
         response = b'\x07\x00\x00\x00\x00\x00\x00\x1c'
         if page != 0x3f:
-            print(self.name, "unknown page, returning empty page")
+            log.debug(f"{self.name}: unknown mode page 0x{page:02x}, returning empty page")
             response = b'\x07\x00\x00\x00\x00\x00\x00\x00'
 
         return self.STATUS_OKAY, response
 
 
     def handle_service_action_in(self, cbw):
-        opcode = cbw.cb[0]
+        service_action = cbw.cb[1] & 0x1f
 
-        if opcode == 0x9e:
+        if service_action == 0x10:
             return self.handle_get_read_capacity_16(cbw)
         else:
             # Always return success, and no response.
@@ -300,17 +603,20 @@ class ScsiCommandHandler:
 
 
     def handle_get_format_capacity(self, cbw):
-        response = bytes([
-            0x00, 0x00, 0x00, 0x08,     # capacity list length
-            0x00, 0x00, 0x10, 0x00,     # number of sectors (0x1000 = 10MB)
-            0x10, 0x00,                 # reserved/descriptor code
-            0x02, 0x00,                 # 512-byte sectors
-        ])
+        block_count = min(self.disk_image.get_sector_count() + 1, 0xffffffff)
+        block_size  = self.disk_image.get_sector_size()
+
+        response  = b'\x00\x00\x00\x08'                 # capacity list length
+        response += block_count.to_bytes(4, 'big')      # number of blocks
+        response += b'\x02'                             # descriptor code: formatted media
+        response += block_size.to_bytes(3, 'big')       # block length, in bytes
         return self.STATUS_OKAY, response
 
 
     def handle_get_read_capacity(self, cbw):
         lastlba = self.disk_image.get_sector_count()
+
+        # Disks too large to describe here report 0xffffffff; telling the host to use READ CAPACITY (16).
         if lastlba > 0xffffffff:
             lastlba = 0xffffffff
 
@@ -319,98 +625,74 @@ class ScsiCommandHandler:
             (lastlba >> 16) & 0xff,
             (lastlba >>  8) & 0xff,
             (lastlba      ) & 0xff,
-            0x00, 0x00, 0x02, 0x00,     # 512-byte blocks
         ])
+        response += self.disk_image.get_sector_size().to_bytes(4, 'big')  # block length, in bytes
         return self.STATUS_OKAY, response
 
 
     def handle_get_read_capacity_16(self, cbw):
-        lastlba = self.disk_image.get_sector_count()
+        lastlba           = self.disk_image.get_sector_count()
+        allocation_length = int.from_bytes(cbw.cb[10:14], 'big')
 
-        response = bytes([
-            (lastlba >> 56) & 0xff,
-            (lastlba >> 48) & 0xff,
-            (lastlba >> 40) & 0xff,
-            (lastlba >> 32) & 0xff,
-            (lastlba >> 24) & 0xff,
-            (lastlba >> 16) & 0xff,
-            (lastlba >>  8) & 0xff,
-            (lastlba      ) & 0xff,
-            0x00, 0x00, 0x02, 0x00,     # 512-byte blocks
-        ])
-        return self.STATUS_OKAY, response
+        response  = lastlba.to_bytes(8, 'big')                              # last LBA
+        response += self.disk_image.get_sector_size().to_bytes(4, 'big')  # block length, in bytes
+        response += bytes(2)                                                # no protection; one logical block per physical
 
+        # LBPME and LBPRZ: we're thin provisioned, and discarded blocks read as zeroes.
+        response += b'\xc0\x00' if self.disk_image.supports_discard() else b'\x00\x00'
+        response += bytes(16)
 
-    def handle_read(self, cbw):
-        base_lba = cbw.cb[2] << 24 \
-                 | cbw.cb[3] << 16 \
-                 | cbw.cb[4] << 8 \
-                 | cbw.cb[5]
+        return self.STATUS_OKAY, response[:allocation_length]
 
-        num_blocks = cbw.cb[7] << 8 \
-                   | cbw.cb[8]
 
-        if self.verbose > 0:
-            print("<-- performing READ (10), lba", base_lba, "+", num_blocks, "block(s)")
+    #
+    # Block I/O.
+    #
 
-        # Note that here we send the data directly rather than putting
-        # something in 'response' and letting the end of the switch send
-        for block_num in range(num_blocks):
-            data = self.disk_image.get_sector_data(base_lba + block_num)
-            self.device.send(ENDPOINT_IN, data, blocking=True)
+    def _blocks_in_range(self, base_lba, num_blocks):
+        """ Returns true iff the given run of blocks lies entirely within our disk image. """
+        return base_lba + num_blocks <= self.disk_image.get_sector_count() + 1
 
-        if self.verbose > 3:
-            print("--> responded with {} bytes".format(cbw.data_transfer_length))
 
-        return self.STATUS_OKAY, None
+    def _read_blocks(self, cbw, base_lba, num_blocks):
+        """ Streams a run of blocks to the host; shared by all of the READ variants. """
 
+        self._lba, self._blocks = base_lba, num_blocks
 
-    def handle_read_16(self, cbw):
-        base_lba = cbw.cb[2] << 56 \
-                 | cbw.cb[3] << 48 \
-                 | cbw.cb[4] << 40 \
-                 | cbw.cb[5] << 32 \
-                 | cbw.cb[6] << 24 \
-                 | cbw.cb[7] << 16 \
-                 | cbw.cb[8] << 8 \
-                 | cbw.cb[9]
-
-        num_blocks = cbw.cb[10] << 24 \
-                   | cbw.cb[11] << 16 \
-                   | cbw.cb[12] << 8  \
-                   | cbw.cb[13]
-
-        if self.verbose > 0:
-            print("<-- performing READ (16), lba", base_lba, "+", num_blocks, "block(s)")
-
-        # Note that here we send the data directly rather than putting
-        # something in 'response' and letting the end of the switch send
-        for block_num in range(num_blocks):
-            data = self.disk_image.get_sector_data(base_lba + block_num)
-            self.ep_to_host.send_packet(data, blocking=True)
-
-        if self.verbose > 3:
-            print("--> responded with {} bytes".format(cbw.data_transfer_length))
+        if not self._blocks_in_range(base_lba, num_blocks):
+            log.warning(f"{self.name}: host read past the end of the disk (LBA {base_lba} + {num_blocks})")
+            return self._fail(cbw, self.ASC_LBA_OUT_OF_RANGE)
+
+        # Read the run from the image a chunk at a time, rather than block by block.
+        block_size   = self.disk_image.get_sector_size()
+        chunk_blocks = max(1, self.TRANSFER_CHUNK_SIZE // block_size)
+
+        for offset in range(0, num_blocks, chunk_blocks):
+            count = min(chunk_blocks, num_blocks - offset)
+            self._send(self.disk_image.get_data(base_lba + offset, count * block_size))
 
         return self.STATUS_OKAY, None
 
 
-    def handle_write(self, cbw):
-        base_lba = cbw.cb[2] << 24 \
-                 | cbw.cb[3] << 16 \
-                 | cbw.cb[4] <<  8 \
-                 | cbw.cb[5]
+    def _begin_write(self, cbw, base_lba, num_blocks):
+        """ Prepares to receive a run of blocks from the host; shared by all of the WRITE variants. """
+
+        self._lba, self._blocks = base_lba, num_blocks
 
-        num_blocks = cbw.cb[7] << 8 \
-                   | cbw.cb[8]
+        if num_blocks == 0:
+            return self.STATUS_OKAY, None
 
-        if self.verbose > 0:
-            print("--> performing WRITE (10), lba", base_lba, "+", num_blocks, "block(s)")
+        # If the write is out of range, we still need to accept its data before we can fail it.
+        self.write_valid = self._blocks_in_range(base_lba, num_blocks)
+        if not self.write_valid:
+            log.warning(f"{self.name}: host wrote past the end of the disk (LBA {base_lba} + {num_blocks})")
 
         # save for later
         self.write_cbw = cbw
         self.write_base_lba = base_lba
         self.write_length = num_blocks * self.disk_image.get_sector_size()
+        self.write_remaining = self.write_length
+        self.write_data = bytearray()
         self.is_write_in_progress = True
 
         # because we need to snarf up the data from wire before we reply
@@ -418,55 +700,172 @@ class ScsiCommandHandler:
         return self.STATUS_INCOMPLETE, None
 
 
-    def handle_write_16(self, cbw):
-        base_lba = cbw.cb[2] << 56 \
-                 | cbw.cb[3] << 48 \
-                 | cbw.cb[4] << 40 \
-                 | cbw.cb[5] << 32 \
-                 | cbw.cb[6] << 24 \
-                 | cbw.cb[7] << 16 \
-                 | cbw.cb[8] << 8 \
-                 | cbw.cb[9]
-
-        num_blocks = cbw.cb[10] << 24 \
-                   | cbw.cb[11] << 16 \
-                   | cbw.cb[12] << 8  \
-                   | cbw.cb[13]
-
-        if self.verbose > 0:
-            print("--> performing WRITE (16), lba", base_lba, "+", num_blocks, "block(s)")
+    def handle_read(self, cbw):
+        base_lba   = int.from_bytes(cbw.cb[2:6], 'big')
+        num_blocks = int.from_bytes(cbw.cb[7:9], 'big')
+        return self._read_blocks(cbw, base_lba, num_blocks)
 
-        # save for later
-        self.write_cbw = cbw
-        self.write_base_lba = base_lba
-        self.write_length = num_blocks * self.disk_image.get_sector_size()
-        self.is_write_in_progress = True
 
-        # because we need to snarf up the data from wire before we reply
-        # with the CSW
-        return self.STATUS_INCOMPLETE, None
+    def handle_read_16(self, cbw):
+        base_lba   = int.from_bytes(cbw.cb[2:10], 'big')
+        num_blocks = int.from_bytes(cbw.cb[10:14], 'big')
+        return self._read_blocks(cbw, base_lba, num_blocks)
+
+
+    def handle_write(self, cbw):
+        base_lba   = int.from_bytes(cbw.cb[2:6], 'big')
+        num_blocks = int.from_bytes(cbw.cb[7:9], 'big')
+        return self._begin_write(cbw, base_lba, num_blocks)
+
+
+    def handle_write_16(self, cbw):
+        base_lba   = int.from_bytes(cbw.cb[2:10], 'big')
+        num_blocks = int.from_bytes(cbw.cb[10:14], 'big')
+        return self._begin_write(cbw, base_lba, num_blocks)
 
 
     def continue_write(self, cbw, data):
-        if self.verbose > 3:
-            print("--> continue write with {} more bytes of data".format(len(data)))
+        self._bytes_out += len(data)
 
+        # Ignore anything past the data we asked for.
+        data = data[:self.write_remaining]
         self.write_data += data
+        self.write_remaining -= len(data)
 
-        if len(self.write_data) < self.write_length:
+        # Write to the image a chunk at a time; as soon as we have a chunk, or all of the data.
+        if self.write_remaining and len(self.write_data) < self.TRANSFER_CHUNK_SIZE:
             # more yet to read, don't send the CSW
             return self.STATUS_INCOMPLETE, None
 
-        self.disk_image.put_data(self.write_base_lba, self.write_data)
+        block_size = self.disk_image.get_sector_size()
+        whole      = len(self.write_data) // block_size * block_size
+
+        if whole and self.write_valid:
+            self.disk_image.put_data(self.write_base_lba, bytes(self.write_data[:whole]))
+
+        self.write_base_lba += whole // block_size
+        del self.write_data[:whole]
+
+        if self.write_remaining:
+            return self.STATUS_INCOMPLETE, None
 
         self.is_write_in_progress = False
-        self.write_data = b''
+        self.write_data = bytearray()
+
+        if not self.write_valid:
+            return self._fail(cbw, self.ASC_LBA_OUT_OF_RANGE)
 
         return self.STATUS_OKAY, None
 
 
+    def _receive_parameters(self, cbw, length, handler):
+        """ Collects a command's parameter list from its data phase; then passes it to the given handler. """
+
+        if length == 0:
+            return handler(cbw, b'')
+
+        self.parameter_cbw = cbw
+        self.parameter_data = bytearray()
+        self.parameter_length = length
+        self.parameter_handler = handler
+
+        return self.STATUS_INCOMPLETE, None
+
+
+    def continue_parameters(self, cbw, data):
+        self._bytes_out += len(data)
+        self.parameter_data += data
+
+        if len(self.parameter_data) < self.parameter_length:
+            return self.STATUS_INCOMPLETE, None
+
+        handler    = self.parameter_handler
+        parameters = bytes(self.parameter_data[:self.parameter_length])
+
+        self.parameter_handler = None
+        self.parameter_data = bytearray()
+
+        return handler(cbw, parameters)
+
+
+    def handle_unmap(self, cbw):
+        parameter_list_length = int.from_bytes(cbw.cb[7:9], 'big')
+        return self._receive_parameters(cbw, parameter_list_length, self._perform_unmap)
+
+
+    def _perform_unmap(self, cbw, parameters):
+        if not self.disk_image.supports_discard():
+            log.warning(f"{self.name}: host sent UNMAP, but this image can't discard blocks")
+            return self._fail(cbw, self.ASC_INVALID_OPERATION_CODE)
+
+        # The parameter list is an eight-byte header, followed by 16-byte block descriptors.
+        descriptor_length = int.from_bytes(parameters[2:4], 'big') if len(parameters) >= 8 else 0
+        descriptors       = parameters[8:8 + descriptor_length]
+
+        ranges = []
+        for offset in range(0, len(descriptors) - 15, 16):
+            lba, count = struct.unpack_from('>QI', descriptors, offset)
+
+            if not self._blocks_in_range(lba, count):
+                log.warning(f"{self.name}: host unmapped past the end of the disk (LBA {lba} + {count})")
+                return self._fail(cbw, self.ASC_LBA_OUT_OF_RANGE)
+
+            ranges.append((lba, count))
+
+        if len(ranges) > self.MAX_UNMAP_DESCRIPTORS:
+            return self._fail(cbw, self.ASC_INVALID_FIELD_IN_PARAMETERS)
+
+        for lba, count in ranges:
+            if count:
+                self.disk_image.discard(lba, count)
+
+        return self.STATUS_OKAY, None
+
+
+    def handle_write_same_16(self, cbw):
+        base_lba   = int.from_bytes(cbw.cb[2:10], 'big')
+        num_blocks = int.from_bytes(cbw.cb[10:14], 'big')
+
+        self._lba, self._blocks = base_lba, num_blocks
+
+        # We set WSNZ, so a zero length -- which would mean "to the end of the disk" -- isn't allowed.
+        if not 0 < num_blocks <= self.MAX_WRITE_SAME_BLOCKS:
+            error = self.ASC_INVALID_FIELD_IN_CDB
+        elif not self._blocks_in_range(base_lba, num_blocks):
+            error = self.ASC_LBA_OUT_OF_RANGE
+        else:
+            error = None
+
+        if error is not None:
+            log.warning(f"{self.name}: invalid WRITE SAME (LBA {base_lba} + {num_blocks})")
+
+        def perform_write_same(cbw, pattern):
+            if error is not None:
+                return self._fail(cbw, error)
+
+            # With the UNMAP bit set, a block of zeroes can be satisfied by discarding; discarded blocks read as zero.
+            unmap = cbw.cb[1] & 0x08
+            if unmap and not any(pattern) and self.disk_image.supports_discard():
+                self.disk_image.discard(base_lba, num_blocks)
+                return self.STATUS_OKAY, None
+
+            # Otherwise, write the block out repeatedly; a chunk at a time.
+            chunk_blocks = max(1, self.TRANSFER_CHUNK_SIZE // len(pattern))
+
+            for offset in range(0, num_blocks, chunk_blocks):
+                count = min(chunk_blocks, num_blocks - offset)
+                self.disk_image.put_data(base_lba + offset, pattern * count)
+
+            return self.STATUS_OKAY, None
+
+        return self._receive_parameters(cbw, self.disk_image.get_sector_size(), perform_write_same)
+
+
     def _register_scsi_commands(self):
-        self.commands = {}
+
+        # Every opcode has an entry, so dispatch is a single index; unsupported ones share a handler.
+        self.commands = [ScsiCommand(number, f"Unknown (0x{number:02x})", self.handle_unknown_command)
+            for number in range(256)]
 
         self._register_scsi_command(0x00, "Test Unit Ready", self.handle_ignored_event)
         self._register_scsi_command(0x03, "Request Sense", self.handle_sense)
@@ -481,6 +880,8 @@ class ScsiCommandHandler:
         self._register_scsi_command(0x2a, "Write (10)", self.handle_write)
         self._register_scsi_command(0x8a, "Write (16)", self.handle_write_16)
         self._register_scsi_command(0x36, "Synchronize Cache", self.handle_ignored_event)
+        self._register_scsi_command(0x42, "Unmap", self.handle_unmap)
+        self._register_scsi_command(0x93, "Write Same (16)", self.handle_write_same_16)
         self._register_scsi_command(0x9e, "Service Action In", self.handle_service_action_in)
 
 
@@ -488,12 +889,7 @@ class ScsiCommandHandler:
         if handler is None:
             handler = self.handle_unknown_command
 
-        descriptor = {
-            "number": number,
-            "name": name,
-            "handler": handler,
-        }
-        self.commands[number] = descriptor
+        self.commands[number] = ScsiCommand(number, name, handler)
 
 
 class CommandBlockWrapper:
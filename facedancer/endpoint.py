@@ -4,8 +4,10 @@
 """ Functionality for describing USB endpoints. """
 
 import struct
+import asyncio
 
-from typing      import Iterable
+from typing      import AsyncIterator, Iterable
+from collections import deque
 from dataclasses import dataclass
 
 from .magic      import AutoInstantiable
@@ -36,6 +38,12 @@ class USBEndpoint(USBDescribable, AutoInstantiable, USBRequestHandler):
     """
     DESCRIPTOR_TYPE_NUMBER      = 0x05
 
+    # The number of write() transfers that can be waiting to be sent, before further writers must wait.
+    WRITE_QUEUE_DEPTH           = 8
+
+    # The number of received packets that can be waiting for read_stream(), before the host is NAK'd.
+    READ_QUEUE_DEPTH            = 16
+
     # Core identifiers.
 
     number               : int
@@ -65,7 +73,7 @@ class USBEndpoint(USBDescribable, AutoInstantiable, USBRequestHandler):
         number        = address & 0x7F
         direction     = address >> 7
         transfer_type = attributes & 0b11
-        sync_type     = attributes >> 2 & 0b1111
+        sync_type     = attributes >> 2 & 0b11
         usage_type    = attributes >> 4 & 0b11
 
         return cls(
@@ -84,6 +92,18 @@ class USBEndpoint(USBDescribable, AutoInstantiable, USBRequestHandler):
         # Grab our request handlers.
         self._request_handler_methods = get_request_handler_methods(self)
 
+        # Transfers queued by write(), as [data, future] pairs; and how far into the first we've sent.
+        self._write_queue  = deque()
+        self._write_offset = 0
+        self._write_space  = None
+
+        # Packets received and waiting for read_stream(), once it's started; whether we've asked the
+        # backend to stop receiving more; and an event set whenever a packet arrives, once anyone's
+        # waiting for one.
+        self._read_queue     = None
+        self._read_held      = False
+        self._read_available = None
+
     #
     # User interface.
     #
@@ -112,6 +132,106 @@ class USBEndpoint(USBDescribable, AutoInstantiable, USBRequestHandler):
             packet_size=self.max_packet_size, blocking=blocking)
 
 
+    async def write(self, data: bytes):
+        """ Queues data to be sent on this IN endpoint; returning once the backend has accepted all of it.
+
+        Queued data is handed to the backend automatically whenever the host asks for data on this
+        endpoint; handle_data_requested() isn't called while any is waiting. The backend's transmit
+        FIFO takes data as soon as it has room, and the backend sends it without involving the device
+        model.
+        If WRITE_QUEUE_DEPTH transfers are already queued, this waits for space first.
+
+        Args:
+            data : The data to be sent. An empty transfer sends a zero-length packet.
+        """
+
+        while len(self._write_queue) >= self.WRITE_QUEUE_DEPTH:
+            if self._write_space is None:
+                self._write_space = asyncio.Event()
+            self._write_space.clear()
+            await self._write_space.wait()
+
+        accepted = asyncio.get_running_loop().create_future()
+        self._write_queue.append((memoryview(bytes(data)), accepted))
+
+        # Hand the data straight to the backend's FIFO, if it has room.
+        self._fill_transmit_fifo(self.get_device().backend)
+
+        await accepted
+
+
+    async def read_stream(self) -> AsyncIterator[bytes]:
+        """ Yields each packet of data the host sends to this OUT endpoint, for as long as it's iterated.
+
+        Data is collected by the default handle_data_received(); so any overriding handler (on this
+        endpoint, or on its interface) must pass data along for this to see it. Packets are kept from
+        the moment iteration first starts, including while the iterating code is busy elsewhere. Once
+        READ_QUEUE_DEPTH packets are waiting, backends that support it NAK the host until they're read.
+        """
+
+        if self._read_queue is None:
+            self._read_queue = deque()
+
+        while True:
+            while not self._read_queue:
+                if self._read_available is None:
+                    self._read_available = asyncio.Event()
+                self._read_available.clear()
+                await self._read_available.wait()
+
+            data = self._read_queue.popleft()
+
+            # If we'd stopped the host sending, and now have room again, let it resume.
+            if self._read_held and len(self._read_queue) < self.READ_QUEUE_DEPTH:
+                self._hold_receive(False)
+
+            yield data
+
+
+    def send_queued_data(self) -> bool:
+        """ Sends the next chunk of any data queued by write(). Returns true iff anything was sent. """
+
+        if not self._write_queue:
+            return False
+
+        backend = self.get_device().backend
+
+        # Top up the backend's transmit FIFO; it primes the endpoint from there on.
+        self._fill_transmit_fifo(backend)
+        backend.prime_from_tx_fifo(self.number)
+        return True
+
+
+    def _fill_transmit_fifo(self, backend):
+        """ Moves as much write() data into the backend's transmit FIFO as it will hold. """
+
+        while self._write_queue:
+            data, _ = self._write_queue[0]
+
+            # The backend returns None when its FIFO is full; including for zero-length packets.
+            accepted = backend.queue_on_endpoint(self.number, data[self._write_offset:], self.max_packet_size)
+            if accepted is None:
+                return
+
+            self._write_offset += accepted
+            if self._write_offset < len(data):
+                return
+
+            self._complete_write()
+
+
+    def _complete_write(self):
+        """ Retires the first write() transfer, once it's all with the backend; releasing its writer. """
+
+        data, accepted = self._write_queue.popleft()
+        self._write_offset = 0
+
+        if not accepted.done():
+            accepted.set_result(len(data))
+        if self._write_space is not None:
+            self._write_space.set()
+
+
     #
     # Event handlers.
     #
@@ -122,8 +242,35 @@ class USBEndpoint(USBDescribable, AutoInstantiable, USBRequestHandler):
         Args:
             data   : The raw bytes received.
         """
-        log.info(f"EP{self.number} received {len(data)} bytes of data; "
-                "but has no handler.")
+
+        # Until someone's reading our data with read_stream(), there's nowhere for it to go.
+        if self._read_queue is None:
+            log.info(f"EP{self.number} received {len(data)} bytes of data; "
+                    "but has no handler.")
+            return
+
+        self._read_queue.append(data)
+        if self._read_available is not None:
+            self._read_available.set()
+
+        # Once our queue is full, ask the backend to NAK the host until read_stream() catches up.
+        # Packets already on their way when we do are still kept; they've been acknowledged.
+        if not self._read_held and len(self._read_queue) >= self.READ_QUEUE_DEPTH:
+            log.debug(f"EP{self.number} has {len(self._read_queue)} packets waiting to be read; "
+                    "holding off the host.")
+            self._hold_receive(True)
+
+
+    def _hold_receive(self, held: bool):
+        """ Asks our backend to stop (or resume) receiving data on this endpoint; where it supports it. """
+
+        self._read_held = held
+
+        backend = self.get_device().backend
+        if held:
+            backend.hold_out_endpoint(self.number)
+        else:
+            backend.release_out_endpoint(self.number)
 
 
     def handle_data_requested(self):
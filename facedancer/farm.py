@@ -0,0 +1,477 @@
+#
+# This file is part of Facedancer.
+#
+""" Runs a large number of emulated devices, sharded across worker processes.
+
+A single interpreter can only service so many boards before its devices start competing for
+the GIL. A :class:`DeviceFarm` shards its devices across worker processes -- by default, one
+per core, each pinned to its own core -- and runs each shard with a
+:class:`~facedancer.orchestrator.DeviceOrchestrator`::
+
+    farm = DeviceFarm()
+    for serial_number in serial_numbers:
+        farm.add(USBKeyboardDevice, serial_number=serial_number)
+    farm.add(FTDIDevice, virtual=True)
+    farm.run()
+
+The supervisor restarts any worker that exits or stops making progress. Workers report each
+device's metrics, and forward their log output, through a block of shared memory per worker;
+so the supervisor never has to stop a worker to find out what it's doing.
+
+Workers are forked, so device factories needn't be picklable; but the supervisor must not
+itself open any boards.
+"""
+
+import os
+import mmap
+import time
+import struct
+import asyncio
+import logging
+import multiprocessing
+
+from typing      import Callable, Dict, List, Tuple
+from dataclasses import dataclass
+
+from .device       import USBDevice
+from .orchestrator import DeviceOrchestrator, DEFAULT_BUDGET
+from .logging      import log
+
+
+# Per-worker shared memory header: log ring head; time of the last metrics update (on the
+# system-wide monotonic clock); and the worker's PID.
+HEADER_FORMAT      = "<Qdq"
+HEADER_SIZE        = struct.calcsize(HEADER_FORMAT)
+
+# Per-device metrics record: polls, deferrals, and busy time.
+METRICS_FORMAT     = "<QQd"
+METRICS_SIZE       = struct.calcsize(METRICS_FORMAT)
+
+# Log ring slot: sequence number, device index, log level, and message length; then the message.
+LOG_SLOT_FORMAT    = "<QHBH"
+LOG_SLOT_HEADER    = struct.calcsize(LOG_SLOT_FORMAT)
+LOG_SLOT_SIZE      = 256
+LOG_MESSAGE_SIZE   = LOG_SLOT_SIZE - LOG_SLOT_HEADER
+
+# Device index used for log output that doesn't belong to any one device.
+WORKER_LOG_INDEX   = 0xFFFF
+
+# How often workers publish their metrics, in seconds.
+METRICS_INTERVAL   = 0.25
+
+# The shortest time we'll leave between restarts of a single worker, in seconds.
+RESTART_BACKOFF    = 1.0
+
+# The most packets a virtual device's simulated host keeps per IN endpoint; nothing in the farm reads them.
+VIRTUAL_RECEIVED_LIMIT = 64
+
+
+@dataclass
+class FarmDeviceSpec:
+    """ Describes a device to be run by a farm; it's created in its worker process.
+
+    Fields:
+        factory :
+            Callable (e.g. a USBDevice subclass) that creates the device.
+        name :
+            The name used to identify the device in metrics and log output.
+        serial_number, bus_path :
+            The board the device should be emulated on.
+        virtual :
+            If true, the device is emulated against a simulated host, rather than a board.
+        budget :
+            The device's per-round time budget; see DeviceOrchestrator.
+    """
+
+    factory       : Callable[[], USBDevice]
+    name          : str
+    serial_number : str   = None
+    bus_path      : str   = None
+    virtual       : bool  = False
+    budget        : float = None
+
+
+class SharedLogRing:
+    """ Fixed-slot ring of log records, written by one process and read by another.
+
+    The writer never waits: if the reader falls more than a ring's worth of records behind,
+    the oldest records are overwritten, and the reader counts them as dropped. Each slot
+    carries its record's sequence number, so the reader can tell a record that was
+    overwritten while it was being read.
+    """
+
+    def __init__(self, buffer, offset: int, slots: int):
+        self.buffer = buffer
+        self.offset = offset
+        self.slots  = slots
+        self.head   = 0
+
+
+    @staticmethod
+    def size_for(slots: int) -> int:
+        return slots * LOG_SLOT_SIZE
+
+
+    def append(self, device_index: int, level: int, message: str):
+        """ Writes a record; called only by the writing process. Returns the new head. """
+        encoded = message.encode("utf-8", errors="replace")[:LOG_MESSAGE_SIZE]
+        slot    = self.offset + (self.head % self.slots) * LOG_SLOT_SIZE
+
+        # Invalidate the slot while it's being rewritten; then publish it with its sequence number.
+        struct.pack_into("<Q", self.buffer, slot, 0)
+        self.buffer[slot + LOG_SLOT_HEADER:slot + LOG_SLOT_HEADER + len(encoded)] = encoded
+        struct.pack_into(LOG_SLOT_FORMAT, self.buffer, slot, self.head + 1, device_index,
+            min(level, 0xFF), len(encoded))
+
+        self.head += 1
+        return self.head
+
+
+    def read(self, cursor: int, head: int) -> Tuple[List[Tuple[int, int, str]], int, int]:
+        """ Reads the records from ``cursor`` up to ``head``.
+
+        Returns the records, as (device index, level, message); the new cursor; and the
+        number of records that were lost to the writer lapping us.
+        """
+
+        records = []
+        dropped = 0
+
+        if head - cursor > self.slots:
+            dropped = head - cursor - self.slots
+            cursor  = head - self.slots
+
+        for sequence in range(cursor, head):
+            slot = self.offset + (sequence % self.slots) * LOG_SLOT_SIZE
+            stamp, device_index, level, length = struct.unpack_from(LOG_SLOT_FORMAT, self.buffer, slot)
+            message = bytes(self.buffer[slot + LOG_SLOT_HEADER:slot + LOG_SLOT_HEADER + length])
+
+            # If the slot has moved on since we read its header, the record is gone.
+            if stamp != sequence + 1 or struct.unpack_from("<Q", self.buffer, slot)[0] != stamp:
+                dropped += 1
+                continue
+
+            records.append((device_index, level, message.decode("utf-8", errors="replace")))
+
+        return records, head, dropped
+
+
+
+class WorkerSharedState:
+    """ A worker's block of shared memory: a header, per-device metrics, and a log ring.
+
+    The block is an anonymous shared mapping, created by the supervisor before the worker is
+    forked; so it survives the worker, and is inherited by any replacement.
+    """
+
+    def __init__(self, device_count: int, log_slots: int):
+        self.device_count = device_count
+
+        metrics_size = device_count * METRICS_SIZE
+        self.buffer  = mmap.mmap(-1, HEADER_SIZE + metrics_size + SharedLogRing.size_for(log_slots))
+        self.ring    = SharedLogRing(self.buffer, HEADER_SIZE + metrics_size, log_slots)
+
+
+    def read_header(self) -> Tuple[int, float, int]:
+        """ Returns the log ring's head, the time of the last metrics update, and the worker's PID. """
+        return struct.unpack_from(HEADER_FORMAT, self.buffer, 0)
+
+
+    def write_header(self, updated: float = None):
+        """ Called by the worker: publishes the log ring's head and, optionally, a metrics update time. """
+        _, last_update, _ = self.read_header()
+        struct.pack_into(HEADER_FORMAT, self.buffer, 0, self.ring.head,
+            last_update if updated is None else updated, os.getpid())
+
+
+    def publish_metrics(self, members):
+        """ Called by the worker: publishes each of its devices' metrics. """
+        for index, member in enumerate(members):
+            struct.pack_into(METRICS_FORMAT, self.buffer, HEADER_SIZE + index * METRICS_SIZE,
+                member.polls, member.deferrals, member.busy_time)
+
+        self.write_header(time.monotonic())
+
+
+    def read_metrics(self, index: int) -> Tuple[int, int, float]:
+        """ Returns one device's (polls, deferrals, busy time). """
+        return struct.unpack_from(METRICS_FORMAT, self.buffer, HEADER_SIZE + index * METRICS_SIZE)
+
+
+    def reset(self):
+        """ Clears the header and metrics; e.g. before a worker is (re)started. """
+        self.buffer[:self.ring.offset] = bytes(self.ring.offset)
+        self.ring.head = 0
+
+
+
+class _SharedRingHandler(logging.Handler):
+    """ Log handler used in workers: writes records into the worker's log ring. """
+
+    def __init__(self, state: WorkerSharedState, orchestrator: DeviceOrchestrator):
+        super().__init__()
+        self.state        = state
+        self.orchestrator = orchestrator
+
+
+    def emit(self, record):
+        try:
+            current = self.orchestrator.current
+            index   = self.orchestrator.members.index(current) if current else WORKER_LOG_INDEX
+
+            self.state.ring.append(index, record.levelno, self.format(record))
+            self.state.write_header()
+        except Exception:
+            self.handleError(record)
+
+
+
+def _run_worker(specs: List[FarmDeviceSpec], state: WorkerSharedState, cpu: int, stop):
+    """ Entry point of each worker process: runs one shard of the farm's devices. """
+
+    if cpu is not None:
+        os.sched_setaffinity(0, {cpu})
+
+    orchestrator = DeviceOrchestrator()
+
+    # Route our log output to the supervisor, rather than to the terminal we inherited.
+    logger = logging.getLogger("facedancer")
+    logger.handlers.clear()
+    logger.propagate = False
+    logger.addHandler(_SharedRingHandler(state, orchestrator))
+
+    for spec in specs:
+        backend = None
+        if spec.virtual:
+            from .backends.virtual import VirtualHostBackend
+            backend = VirtualHostBackend(max_received=VIRTUAL_RECEIVED_LIMIT)
+
+        orchestrator.add(spec.factory(), backend=backend, serial_number=spec.serial_number,
+            bus_path=spec.bus_path, budget=spec.budget)
+
+    async def serve():
+        emulation = asyncio.ensure_future(orchestrator.run())
+
+        try:
+            while not stop.is_set() and not emulation.done():
+                state.publish_metrics(orchestrator.members)
+                await asyncio.sleep(METRICS_INTERVAL)
+        finally:
+            emulation.cancel()
+            await asyncio.gather(emulation, return_exceptions=True)
+            state.publish_metrics(orchestrator.members)
+
+        # If the emulation itself failed, let the supervisor see us crash.
+        if not stop.is_set():
+            emulation.result()
+
+    orchestrator.connect()
+    try:
+        asyncio.run(serve())
+    finally:
+        orchestrator.disconnect()
+
+
+
+@dataclass
+class _Worker:
+    """ Supervisor-side record of a single worker process. """
+
+    index      : int
+    cpu        : int
+    devices    : List[int]
+    state      : WorkerSharedState
+    process    : multiprocessing.Process = None
+    restarts   : int   = 0
+    started_at : float = 0.0
+    log_cursor : int   = 0
+    dropped    : int   = 0
+
+
+class DeviceFarm:
+    """ Supervises a set of worker processes, each emulating a shard of a farm's devices.
+
+    Args:
+        workers      : The number of worker processes to shard devices across; defaults to one per core.
+        pin          : If true, each worker is pinned to its own core.
+        hang_timeout : If provided, a worker that hasn't published metrics in this many seconds
+                       is considered hung, and is restarted.
+        log_slots    : The number of records each worker's log ring holds.
+    """
+
+    def __init__(self, *, workers: int = None, pin: bool = True, hang_timeout: float = None,
+            log_slots: int = 1024):
+        self.cpus         = sorted(os.sched_getaffinity(0))
+        self.worker_count = workers or len(self.cpus)
+        self.pin          = pin
+        self.hang_timeout = hang_timeout
+        self.log_slots    = log_slots
+
+        self.devices : List[FarmDeviceSpec] = []
+        self.workers : List[_Worker]        = []
+
+        self._context = multiprocessing.get_context("fork")
+        self._stop    = self._context.Event()
+
+
+    def add(self, factory: Callable[[], USBDevice], *, name: str = None, serial_number: str = None,
+            bus_path: str = None, virtual: bool = False, budget: float = None) -> int:
+        """ Adds a device to the farm. Must be called before the farm is started.
+
+        Args:
+            factory       : Callable (e.g. a USBDevice subclass) that creates the device, in its worker.
+            name          : The name to identify the device by; defaults to one based on its board.
+            serial_number : The serial number of the board to emulate the device on.
+            bus_path      : The USB bus path (e.g. "1-4.2") of the board to emulate the device on.
+            virtual       : If true, emulate the device against a simulated host, rather than a board.
+            budget        : The device's per-round time budget, in seconds; see DeviceOrchestrator.
+
+        Returns the device's index; e.g. for use with metrics().
+        """
+
+        if self.workers:
+            raise RuntimeError("devices can't be added to a farm once it's started")
+
+        if name is None:
+            board = serial_number or bus_path or ("virtual" if virtual else "auto")
+            name  = f"{getattr(factory, '__name__', 'device')}@{board}#{len(self.devices)}"
+
+        self.devices.append(FarmDeviceSpec(factory, name, serial_number, bus_path, virtual,
+            DEFAULT_BUDGET if budget is None else budget))
+        return len(self.devices) - 1
+
+
+    #
+    # Worker management.
+    #
+
+    def start(self):
+        """ Shards our devices across workers, and starts each of them. """
+
+        shards = min(self.worker_count, len(self.devices))
+
+        for index in range(shards):
+            devices = list(range(index, len(self.devices), shards))
+            cpu     = self.cpus[index % len(self.cpus)] if self.pin else None
+            worker  = _Worker(index, cpu, devices, WorkerSharedState(len(devices), self.log_slots))
+
+            self.workers.append(worker)
+            self._start_worker(worker)
+
+        log.info(f"farm: running {len(self.devices)} devices on {shards} workers")
+
+
+    def _start_worker(self, worker: _Worker):
+        worker.state.reset()
+        worker.log_cursor = 0
+
+        specs = [self.devices[index] for index in worker.devices]
+        worker.process = self._context.Process(target=_run_worker, name=f"facedancer-farm-{worker.index}",
+            args=(specs, worker.state, worker.cpu, self._stop), daemon=True)
+        worker.started_at = time.monotonic()
+        worker.process.start()
+
+
+    def _is_hung(self, worker: _Worker) -> bool:
+        if self.hang_timeout is None:
+            return False
+
+        _, updated, _ = worker.state.read_header()
+        last_sign_of_life = max(updated, worker.started_at)
+        return time.monotonic() - last_sign_of_life > self.hang_timeout
+
+
+    def poll(self):
+        """ Forwards any new worker log output, and restarts any worker that's died or hung. """
+
+        for worker in self.workers:
+            self._forward_logs(worker)
+
+            if self._stop.is_set():
+                continue
+
+            alive = worker.process.is_alive()
+
+            if alive and self._is_hung(worker):
+                log.warning(f"farm: worker {worker.index} has stopped responding; killing it")
+                worker.process.kill()
+                worker.process.join()
+                alive = False
+
+            if alive or time.monotonic() - worker.started_at < RESTART_BACKOFF:
+                continue
+
+            log.warning(f"farm: worker {worker.index} exited with code {worker.process.exitcode}; restarting it")
+            worker.restarts += 1
+            self._start_worker(worker)
+
+
+    def _forward_logs(self, worker: _Worker):
+        head, _, _ = worker.state.read_header()
+        records, worker.log_cursor, dropped = worker.state.ring.read(worker.log_cursor, head)
+
+        for device_index, level, message in records:
+            if device_index == WORKER_LOG_INDEX:
+                source = f"worker {worker.index}"
+            else:
+                source = self.devices[worker.devices[device_index]].name
+
+            log.log(level, f"[{source}] {message}")
+
+        if dropped:
+            worker.dropped += dropped
+            log.warning(f"farm: dropped {dropped} log records from worker {worker.index}")
+
+
+    def stop(self, timeout: float = 5.0):
+        """ Asks each worker to stop; killing any that don't within the timeout. """
+
+        self._stop.set()
+
+        for worker in self.workers:
+            worker.process.join(timeout)
+            if worker.process.is_alive():
+                worker.process.kill()
+                worker.process.join()
+
+            self._forward_logs(worker)
+
+
+    def run(self, *, interval: float = 0.5):
+        """ Starts the farm, and supervises it until interrupted. """
+
+        self.start()
+
+        try:
+            while True:
+                self.poll()
+                time.sleep(interval)
+        except KeyboardInterrupt:
+            pass
+        finally:
+            self.stop()
+
+
+    #
+    # Metrics.
+    #
+
+    def metrics(self) -> Dict[str, dict]:
+        """ Returns the latest metrics for each device, keyed by device name. """
+
+        metrics = {}
+
+        for worker in self.workers:
+            for slot, device_index in enumerate(worker.devices):
+                polls, deferrals, busy_time = worker.state.read_metrics(slot)
+
+                metrics[self.devices[device_index].name] = {
+                    'worker':    worker.index,
+                    'pid':       worker.process.pid,
+                    'restarts':  worker.restarts,
+                    'polls':     polls,
+                    'deferrals': deferrals,
+                    'busy_time': busy_time,
+                }
+
+        return metrics
@@ -0,0 +1,436 @@
+#
+# This file is part of Facedancer.
+#
+""" Fuzzing of host USB stacks, by mutating our responses at the byte level.
+
+A fuzzer is installed as a device's ``hooks``. It rewrites the device's serialized
+descriptors and control responses, cycles the connection as quickly as the backend
+allows, and uses the host's reaction to each cycle -- which requests it made, when,
+and whether it reset or configured the device -- as feedback to grow its corpus::
+
+    device = USBKeyboardDevice()
+    fuzzer = USBHostFuzzer(device, corpus=FuzzCorpus("keyboard-corpus"))
+    fuzzer.fuzz()
+"""
+
+import os
+import json
+import time
+import random
+import asyncio
+import hashlib
+
+from typing      import Dict, List, Tuple
+from dataclasses import dataclass, field
+
+from .types      import USBRequestType, USBStandardRequests
+from .logging    import log
+
+
+# Identifies a request whose response can be mutated: (bmRequestType, bRequest, wValue, wIndex).
+# wLength is omitted, so e.g. a host's short and full reads of a descriptor see the same mutation.
+RequestKey = Tuple[int, int, int, int]
+
+
+def request_key(request) -> RequestKey:
+    """ Returns the key used to identify a given request's response. """
+    return (request.request_type, request.number, request.value, request.index)
+
+
+class USBDeviceHooks:
+    """ Base class for objects installed as a USBDevice's ``hooks``.
+
+    The default implementations observe nothing and pass every response through unchanged.
+    """
+
+    def request_received(self, request):
+        """ Called for every control request the device receives, before it's handled. """
+
+    def bus_reset(self):
+        """ Called whenever the host resets the device. """
+
+    def mutate_descriptor(self, request, descriptor: bytes) -> bytes:
+        """ Called with the full descriptor for a GET_DESCRIPTOR request, before it's truncated to wLength. """
+        return descriptor
+
+    def mutate_reply(self, request, data: bytes) -> bytes:
+        """ Called with the data for every control IN response, just before it's sent. """
+        return data
+
+
+#
+# Mutators. Each takes a random source and a bytearray, which it modifies in place.
+#
+
+INTERESTING_BYTES = (0x00, 0x01, 0x02, 0x7f, 0x80, 0xfe, 0xff)
+
+
+def flip_bit(rng: random.Random, data: bytearray):
+    if data:
+        data[rng.randrange(len(data))] ^= 1 << rng.randrange(8)
+
+
+def set_interesting_byte(rng: random.Random, data: bytearray):
+    if data:
+        data[rng.randrange(len(data))] = rng.choice(INTERESTING_BYTES)
+
+
+def nudge_byte(rng: random.Random, data: bytearray):
+    if data:
+        position = rng.randrange(len(data))
+        data[position] = (data[position] + rng.choice((-2, -1, 1, 2))) & 0xff
+
+
+def corrupt_descriptor_length(rng: random.Random, data: bytearray):
+    """ Walks the bLength chain of a descriptor set, and corrupts one of its lengths. """
+
+    offsets  = []
+    position = 0
+    while position < len(data) and data[position]:
+        offsets.append(position)
+        position += data[position]
+
+    if offsets:
+        data[rng.choice(offsets)] = rng.choice(INTERESTING_BYTES + (rng.randrange(256),))
+
+
+def insert_bytes(rng: random.Random, data: bytearray):
+    position = rng.randrange(len(data) + 1)
+    data[position:position] = bytes(rng.getrandbits(8) for _ in range(rng.randint(1, 16)))
+
+
+def delete_bytes(rng: random.Random, data: bytearray):
+    if data:
+        position = rng.randrange(len(data))
+        del data[position:position + rng.randint(1, 16)]
+
+
+def truncate(rng: random.Random, data: bytearray):
+    if data:
+        del data[rng.randrange(len(data)):]
+
+
+def duplicate_chunk(rng: random.Random, data: bytearray):
+    if data:
+        start = rng.randrange(len(data))
+        chunk = data[start:start + rng.randint(1, 32)]
+        position = rng.randrange(len(data) + 1)
+        data[position:position] = chunk
+
+
+MUTATORS = (
+    flip_bit, set_interesting_byte, nudge_byte, corrupt_descriptor_length,
+    insert_bytes, delete_bytes, truncate, duplicate_chunk,
+)
+
+
+#
+# Corpus and feedback.
+#
+
+@dataclass
+class FuzzCase:
+    """ A set of response overrides, applied for the duration of a single connection cycle. """
+
+    overrides : Dict[RequestKey, bytes] = field(default_factory=dict)
+    mutations : List[str]               = field(default_factory=list)
+
+    def to_json(self) -> dict:
+        return {
+            'overrides': [[list(key), data.hex()] for key, data in self.overrides.items()],
+            'mutations': self.mutations,
+        }
+
+    @classmethod
+    def from_json(cls, data: dict):
+        overrides = {tuple(key): bytes.fromhex(value) for key, value in data['overrides']}
+        return cls(overrides=overrides, mutations=data.get('mutations', []))
+
+
+@dataclass
+class HostReaction:
+    """ How the host responded to a single connection cycle. """
+
+    # Each request we received, as (seconds since connect, request key).
+    requests   : List[Tuple[float, RequestKey]] = field(default_factory=list)
+    resets     : int   = 0
+    configured : bool  = False
+    timed_out  : bool  = False
+    duration   : float = 0
+
+    @property
+    def time_to_first_request(self):
+        return self.requests[0][0] if self.requests else None
+
+
+    def signature(self) -> tuple:
+        """ Summarizes this reaction; cases producing a signature we haven't seen are kept in our corpus.
+
+        Repeated identical requests are collapsed, so e.g. a host retrying a request
+        a varying number of times doesn't look like new behavior.
+        """
+        sequence = []
+        for _, (request_type, number, value, _) in self.requests:
+            entry = (request_type, number, value)
+            if not sequence or sequence[-1] != entry:
+                sequence.append(entry)
+
+        return (tuple(sequence), min(self.resets, 4), self.configured, self.timed_out)
+
+
+    def to_json(self) -> dict:
+        return {
+            'requests':   [[timestamp, list(key)] for timestamp, key in self.requests],
+            'resets':     self.resets,
+            'configured': self.configured,
+            'timed_out':  self.timed_out,
+            'duration':   self.duration,
+        }
+
+
+class FuzzCorpus:
+    """ Collection of fuzz cases that each produced distinct host behavior.
+
+    If a path is provided, the corpus is loaded from -- and each new case saved to -- that directory.
+    """
+
+    def __init__(self, path: str = None):
+        self.path       = path
+        self.cases      = [FuzzCase()]
+        self.signatures = set()
+
+        if path:
+            os.makedirs(path, exist_ok=True)
+            self._load()
+
+
+    def __len__(self):
+        return len(self.cases)
+
+
+    def _load(self):
+        for filename in sorted(os.listdir(self.path)):
+            if filename.endswith(".json"):
+                with open(os.path.join(self.path, filename)) as f:
+                    self.cases.append(FuzzCase.from_json(json.load(f)['case']))
+
+
+    def choose(self, rng: random.Random) -> FuzzCase:
+        """ Picks a case to be mutated further. """
+        return rng.choice(self.cases)
+
+
+    def add(self, case: FuzzCase, reaction: HostReaction) -> bool:
+        """ Records the reaction to a case; keeping the case if the reaction was new. Returns True if kept. """
+
+        signature = reaction.signature()
+        if signature in self.signatures:
+            return False
+
+        self.signatures.add(signature)
+        self.cases.append(case)
+
+        if self.path:
+            record = json.dumps({'case': case.to_json(), 'reaction': reaction.to_json()}, indent=1)
+            filename = hashlib.sha1(record.encode()).hexdigest()[:16] + ".json"
+
+            with open(os.path.join(self.path, filename), "w") as f:
+                f.write(record)
+
+        return True
+
+
+
+class USBHostFuzzer(USBDeviceHooks):
+    """ Fuzzes a host's USB stack by repeatedly connecting a device with mutated responses.
+
+    Args:
+        device          : The USBDevice whose responses should be mutated.
+        corpus          : The FuzzCorpus to draw cases from, and add new cases to.
+        seed            : Seed for our random source; for reproducible runs.
+        max_mutations   : The most mutations stacked onto a case in a single iteration.
+        fuzz_replies    : If true, non-descriptor control responses are mutated as well as descriptors.
+        cycle_timeout   : The longest we'll wait on the host during a single cycle, in seconds.
+        settle_time     : How long the host must be idle after configuring us for a cycle to end.
+        idle_timeout    : How long the host may be idle, without configuring us, before a cycle ends.
+        reconnect_delay : How long we stay disconnected between cycles; the host must notice us leaving.
+        report_interval : How often we log our progress, in seconds.
+    """
+
+    def __init__(self, device, *, corpus: FuzzCorpus = None, seed: int = None, max_mutations: int = 4,
+            fuzz_replies: bool = True, cycle_timeout: float = 3.0, settle_time: float = 0.25,
+            idle_timeout: float = 1.0, reconnect_delay: float = 0.05, report_interval: float = 5.0):
+
+        self.device          = device
+        self.corpus          = corpus if corpus else FuzzCorpus()
+        self.rng             = random.Random(seed)
+        self.max_mutations   = max_mutations
+        self.fuzz_replies    = fuzz_replies
+
+        self.cycle_timeout   = cycle_timeout
+        self.settle_time     = settle_time
+        self.idle_timeout    = idle_timeout
+        self.reconnect_delay = reconnect_delay
+        self.report_interval = report_interval
+
+        # The unmodified response to each request we've seen; these are our mutation targets.
+        self.baseline        = {}
+
+        self.case            = None
+        self.reaction        = None
+        self.iterations      = 0
+        self.start_time      = None
+        self._cycle_start    = 0
+
+        device.hooks = self
+
+
+    @property
+    def iterations_per_second(self) -> float:
+        if not self.start_time:
+            return 0.0
+
+        return self.iterations / (time.monotonic() - self.start_time)
+
+
+    #
+    # Device hooks.
+    #
+
+    def request_received(self, request):
+        if self.reaction:
+            self.reaction.requests.append((time.monotonic() - self._cycle_start, request_key(request)))
+
+
+    def bus_reset(self):
+        if self.reaction:
+            self.reaction.resets += 1
+
+
+    def mutate_descriptor(self, request, descriptor: bytes) -> bytes:
+        return self._apply_case(request, descriptor)
+
+
+    def mutate_reply(self, request, data: bytes) -> bytes:
+
+        # Standard descriptors were already mutated whole, before being truncated; leave them be.
+        if request.type == USBRequestType.STANDARD and request.number == USBStandardRequests.GET_DESCRIPTOR:
+            return data
+
+        if not self.fuzz_replies:
+            return data
+
+        return self._apply_case(request, data)
+
+
+    def _apply_case(self, request, data: bytes) -> bytes:
+        key = request_key(request)
+
+        # Learn each response the first time we see it, so it can be targeted by later cases.
+        if data and key not in self.baseline:
+            self.baseline[key] = bytes(data)
+
+        if self.case and key in self.case.overrides:
+            return self.case.overrides[key]
+
+        return data
+
+
+    #
+    # Fuzzing.
+    #
+
+    def next_case(self) -> FuzzCase:
+        """ Generates a new case, by mutating one of the responses in a case drawn from our corpus. """
+
+        parent = self.corpus.choose(self.rng)
+
+        # Until we've seen the host's requests, there's nothing to mutate; run the parent as-is.
+        if not self.baseline:
+            return FuzzCase(dict(parent.overrides), list(parent.mutations))
+
+        key  = self.rng.choice(list(self.baseline))
+        data = bytearray(parent.overrides.get(key, self.baseline[key]))
+
+        mutations = []
+        for _ in range(self.rng.randint(1, self.max_mutations)):
+            mutator = self.rng.choice(MUTATORS)
+            mutator(self.rng, data)
+            mutations.append(mutator.__name__)
+
+        overrides      = dict(parent.overrides)
+        overrides[key] = bytes(data)
+
+        return FuzzCase(overrides, parent.mutations + [f"{key}: {', '.join(mutations)}"])
+
+
+    async def run_cycle(self, case: FuzzCase) -> HostReaction:
+        """ Connects our device with a given case applied, and records how the host reacts. """
+
+        device   = self.device
+        reaction = HostReaction()
+
+        self.case          = case
+        self.reaction      = reaction
+        self._cycle_start  = time.monotonic()
+
+        device.connect()
+
+        try:
+            while True:
+                device.backend.service_irqs()
+                await asyncio.sleep(0)
+
+                elapsed   = time.monotonic() - self._cycle_start
+                idle_time = elapsed - (reaction.requests[-1][0] if reaction.requests else 0)
+
+                # End the cycle as soon as the host has either settled on a configuration, or given up on us.
+                if device.configuration and idle_time > self.settle_time:
+                    break
+                if reaction.requests and idle_time > self.idle_timeout:
+                    break
+                if elapsed > self.cycle_timeout:
+                    reaction.timed_out = True
+                    break
+
+        finally:
+            reaction.configured = device.configuration is not None
+            reaction.duration   = time.monotonic() - self._cycle_start
+
+            self.case     = None
+            self.reaction = None
+
+            device.disconnect()
+            device.configuration = None
+            device.address       = 0
+
+        await asyncio.sleep(self.reconnect_delay)
+        return reaction
+
+
+    async def run(self, iterations: int = None):
+        """ Runs fuzzing cycles; either for a given number of iterations, or forever. """
+
+        self.start_time = time.monotonic()
+        last_report     = self.start_time
+
+        while iterations is None or self.iterations < iterations:
+            case     = self.next_case()
+            reaction = await self.run_cycle(case)
+            self.iterations += 1
+
+            if self.corpus.add(case, reaction):
+                log.info(f"New host behavior after {case.mutations[-1:] or 'unmodified enumeration'}: "
+                    f"{len(reaction.requests)} requests, {reaction.resets} resets, "
+                    f"{'configured' if reaction.configured else 'not configured'}.")
+
+            now = time.monotonic()
+            if now - last_report > self.report_interval:
+                last_report = now
+                log.info(f"{self.iterations} iterations ({self.iterations_per_second:.2f}/s); "
+                    f"corpus contains {len(self.corpus)} cases.")
+
+
+    def fuzz(self, iterations: int = None):
+        """ Convenience method that runs the fuzzer in a blocking manner. """
+        asyncio.run(self.run(iterations))
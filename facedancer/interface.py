@@ -104,6 +104,11 @@ class USBInterface(USBDescribable, AutoInstantiable, USBRequestHandler):
         self.endpoints[endpoint.get_identifier()] = endpoint
         endpoint.parent = self
 
+        # Let our configuration know its endpoint index is out of date.
+        endpoints_changed = getattr(self.parent, 'endpoints_changed', None)
+        if endpoints_changed is not None:
+            endpoints_changed()
+
 
     def get_endpoint(self, endpoint_number: int, direction: USBDirection) -> USBEndpoint:
         """ Attempts to find a subordinate endpoint matching the given number/direction.
@@ -0,0 +1,703 @@
+#
+# This file is part of Facedancer.
+#
+""" Builds emulated devices from captured descriptors.
+
+Profiles can be loaded from:
+
+    - raw descriptor blobs; a device descriptor followed by each full configuration descriptor,
+    - Linux sysfs device directories (or their ``descriptors`` files), and
+    - the output of ``lsusb -v``.
+
+Each source is first normalized into a DeviceProfile -- raw descriptors, plus a string table --
+which can be cached in a compact binary form; and then built into a USBDevice model, complete
+with its strings, class-specific descriptors and alternate settings::
+
+    device = load_device("/sys/bus/usb/devices/1-1", cache_dir="~/.cache/facedancer")
+    device.emulate()
+"""
+
+import os
+import re
+import struct
+import hashlib
+import tempfile
+
+from typing        import Dict, List, Tuple
+from dataclasses   import dataclass, field
+
+from .device        import USBDevice
+from .configuration import USBConfiguration
+from .interface     import USBInterface
+from .endpoint      import USBEndpoint
+from .request       import standard_request_handler, to_this_interface
+from .types         import USBStandardRequests, LanguageIDs
+from .descriptor    import USBDescribable, USBDescriptorTypeNumber
+
+from .logging       import log
+
+
+# Magic and version for our binary profile cache format.
+PROFILE_MAGIC   = b"FDPROF"
+PROFILE_VERSION = 1
+
+# Language used for strings whose language we don't know; e.g. those scraped from lsusb.
+DEFAULT_LANGUAGE = LanguageIDs.ENGLISH_US
+
+
+@dataclass
+class DeviceProfile:
+    """ Normalized, source-independent capture of a device's descriptors.
+
+    Fields:
+        device_descriptor :
+            The raw device descriptor.
+        configuration_descriptors :
+            Each raw configuration descriptor, with all of its subordinate descriptors.
+        strings :
+            Maps (index, language ID) to each string the device provides.
+        languages :
+            The language IDs from string descriptor zero, in order.
+    """
+
+    device_descriptor         : bytes
+    configuration_descriptors : List[bytes]                 = field(default_factory=list)
+    strings                   : Dict[Tuple[int, int], str]  = field(default_factory=dict)
+    languages                 : Tuple[int, ...]             = (DEFAULT_LANGUAGE,)
+
+
+    def to_bytes(self) -> bytes:
+        """ Serializes this profile into our binary cache format. """
+
+        out = bytearray(PROFILE_MAGIC)
+        out += struct.pack("<BB", PROFILE_VERSION, len(self.languages))
+        out += struct.pack(f"<{len(self.languages)}H", *self.languages)
+
+        out += struct.pack("<H", len(self.device_descriptor)) + self.device_descriptor
+
+        out += struct.pack("<B", len(self.configuration_descriptors))
+        for descriptor in self.configuration_descriptors:
+            out += struct.pack("<H", len(descriptor)) + descriptor
+
+        out += struct.pack("<H", len(self.strings))
+        for (index, language), string in self.strings.items():
+            encoded = string.encode("utf-16-le")
+            out += struct.pack("<BHH", index, language, len(encoded)) + encoded
+
+        return bytes(out)
+
+
+    @classmethod
+    def from_bytes(cls, data: bytes):
+        """ Deserializes a profile from our binary cache format.
+
+        Raises ValueError if the data isn't a complete, well-formed profile; e.g. if it was truncated.
+        """
+
+        view = memoryview(data)
+        if bytes(view[0:len(PROFILE_MAGIC)]) != PROFILE_MAGIC:
+            raise ValueError("not a Facedancer device profile")
+
+        try:
+            return cls._parse(view, len(PROFILE_MAGIC))
+        except (IndexError, struct.error, UnicodeDecodeError) as e:
+            raise ValueError(f"malformed device profile: {e}") from e
+
+
+    @classmethod
+    def _parse(cls, view: memoryview, offset: int):
+        version, language_count = struct.unpack_from("<BB", view, offset)
+        if version != PROFILE_VERSION:
+            raise ValueError(f"unsupported device profile version {version}")
+        offset += 2
+
+        languages = struct.unpack_from(f"<{language_count}H", view, offset)
+        offset += 2 * language_count
+
+        def take(length):
+            nonlocal offset
+            if offset + length > len(view):
+                raise ValueError("truncated device profile")
+
+            offset += length
+            return bytes(view[offset - length:offset])
+
+        def take_blob():
+            length, = struct.unpack_from("<H", view, offset)
+            take(2)
+            return take(length)
+
+        device_descriptor = take_blob()
+
+        configuration_count = view[offset]
+        offset += 1
+        configurations = [take_blob() for _ in range(configuration_count)]
+
+        string_count, = struct.unpack_from("<H", view, offset)
+        offset += 2
+
+        strings = {}
+        for _ in range(string_count):
+            index, language, length = struct.unpack_from("<BHH", view, offset)
+            offset += 5
+            strings[(index, language)] = take(length).decode("utf-16-le")
+
+        return cls(device_descriptor, configurations, strings, tuple(languages))
+
+
+#
+# Sources.
+#
+
+def _split_descriptor_blob(data: bytes) -> Tuple[bytes, List[bytes]]:
+    """ Splits a device descriptor followed by full configuration descriptors into its parts. """
+
+    view   = memoryview(data)
+    length = view[0]
+    device_descriptor = bytes(view[0:length])
+
+    configurations = []
+    offset         = length
+    while offset + 4 <= len(view):
+        total_length, = struct.unpack_from("<H", view, offset + 2)
+        if view[offset + 1] != USBDescriptorTypeNumber.CONFIGURATION or total_length < 9:
+            log.warning(f"Ignoring {len(view) - offset} trailing bytes that aren't a configuration descriptor.")
+            break
+
+        configurations.append(bytes(view[offset:offset + total_length]))
+        offset += total_length
+
+    return device_descriptor, configurations
+
+
+def profile_from_descriptors(data: bytes, strings: Dict[Tuple[int, int], str] = None,
+        languages: Tuple[int, ...] = (DEFAULT_LANGUAGE,)) -> DeviceProfile:
+    """ Creates a profile from a raw blob; a device descriptor followed by configuration descriptors.
+
+    This is the format of sysfs ``descriptors`` files, and is easily assembled from proxy captures.
+    """
+    device_descriptor, configurations = _split_descriptor_blob(data)
+    return DeviceProfile(device_descriptor, configurations, dict(strings or {}), tuple(languages))
+
+
+def _read_sysfs_attribute(path: str, name: str):
+    try:
+        with open(os.path.join(path, name), encoding="utf-8", errors="replace") as f:
+            return f.read().rstrip("\n")
+    except OSError:
+        return None
+
+
+def profile_from_sysfs(path: str) -> DeviceProfile:
+    """ Creates a profile from a Linux sysfs USB device directory, or its ``descriptors`` file.
+
+    sysfs only exposes some strings: the device's manufacturer, product and serial strings, the
+    active configuration's string, and the strings of the active alternate setting of each interface.
+    """
+
+    if os.path.basename(path) == "descriptors":
+        path = os.path.dirname(path)
+
+    with open(os.path.join(path, "descriptors"), "rb") as f:
+        profile = profile_from_descriptors(f.read())
+
+    language = DEFAULT_LANGUAGE
+    device   = profile.device_descriptor
+
+    # Recover device-level strings, whose indexes are in the device descriptor.
+    for name, index in (("manufacturer", device[14]), ("product", device[15]), ("serial", device[16])):
+        value = _read_sysfs_attribute(path, name)
+        if index and value is not None:
+            profile.strings[(index, language)] = value
+
+    # Recover the active configuration's string, and the strings of its interfaces.
+    active = _read_sysfs_attribute(path, "bConfigurationValue")
+    for configuration in profile.configuration_descriptors:
+        if not active or configuration[5] != int(active):
+            continue
+
+        value = _read_sysfs_attribute(path, "configuration")
+        if configuration[6] and value:
+            profile.strings[(configuration[6], language)] = value
+
+        interface_strings = {}
+        for entry in os.listdir(path):
+            interface_path = os.path.join(path, entry)
+            number    = _read_sysfs_attribute(interface_path, "bInterfaceNumber")
+            alternate = _read_sysfs_attribute(interface_path, "bAlternateSetting")
+            value     = _read_sysfs_attribute(interface_path, "interface")
+            if number is not None and alternate is not None and value is not None:
+                interface_strings[(int(number, 16), int(alternate))] = value
+
+        for descriptor in USBDescribable.iterate_binary_descriptors(configuration):
+            if descriptor[1] == USBDescriptorTypeNumber.INTERFACE and descriptor[8]:
+                value = interface_strings.get((descriptor[2], descriptor[3]))
+                if value is not None:
+                    profile.strings[(descriptor[8], language)] = value
+
+    return profile
+
+
+# Blocks lsusb prints without their length/type/subtype fields; mapped to the header they need.
+_LSUSB_HEADERLESS_BLOCKS = {
+    "CDC Header":           (0x24, 0x00),
+    "CDC Call Management":  (0x24, 0x01),
+    "CDC ACM":              (0x24, 0x02),
+    "CDC Union":            (0x24, 0x06),
+    "CDC Ethernet":         (0x24, 0x0F),
+    "CDC NCM":              (0x24, 0x1A),
+    "CDC MBIM":             (0x24, 0x1B),
+    "CDC MBIM Extended":    (0x24, 0x1C),
+}
+
+# Blocks that follow the configuration descriptors in lsusb output, and end them.
+_LSUSB_TERMINAL_BLOCKS = ("Device Qualifier", "Binary Object Store Descriptor", "Device Status")
+
+_LSUSB_DEVICE   = re.compile(r"^Bus \d+ Device \d+: ID ")
+_LSUSB_FIELD    = re.compile(r"^\s+([a-z]+)([A-Z0-9][A-Za-z0-9_]*)?\s*(?:\([ \d]+\)|\[[ \d]+\])?\s+(\S+)\s*(.*)$")
+_LSUSB_BLOCK    = re.compile(r"^\s*([A-Z][^:]*):\s*$")
+_LSUSB_UNKNOWN  = re.compile(r"^\s*\*\* UNRECOGNIZED:\s*((?:[0-9a-fA-F]{2}\s*)+)$")
+_LSUSB_POWER    = re.compile(r"^\s+MaxPower\s+(\d+)mA")
+
+# Widths of fields, by their Hungarian-notation prefix.
+_LSUSB_FIELD_WIDTHS = {'b': 1, 'ba': 1, 'i': 1, 'w': 2, 'wa': 2, 'bcd': 2, 'id': 2, 't': 3, 'dw': 4}
+
+
+def _lsusb_field_value(prefix: str, token: str) -> bytes:
+    """ Converts one lsusb field into its descriptor bytes. """
+
+    if prefix == 'bcd':
+        major, _, minor = token.partition('.')
+        return ((int(major, 16) << 8) | int(minor or '0', 16)).to_bytes(2, 'little')
+
+    value = int(token, 0)
+
+    # Bitmaps are printed with as many hex digits as they have bits; so take their width from that.
+    if prefix in ('bm', 'bma'):
+        width = max(1, (len(token) - 2) // 2) if token.startswith("0x") else 1
+    else:
+        width = _LSUSB_FIELD_WIDTHS.get(prefix, 1)
+
+    return value.to_bytes(width, 'little')
+
+
+def _lsusb_profiles(text: str):
+    """ Yields a (blocks, strings) pair for each device in some lsusb -v output. """
+
+    blocks  = None
+    strings = None
+
+    for line in text.splitlines():
+        if _LSUSB_DEVICE.match(line):
+            if blocks is not None:
+                yield blocks, strings
+            blocks, strings = [], {}
+            continue
+
+        if blocks is None:
+            # Tolerate output for a single device, without its "Bus ... Device ..." line.
+            if line.strip() != "Device Descriptor:":
+                continue
+            blocks, strings = [], {}
+
+        unknown = _LSUSB_UNKNOWN.match(line)
+        if unknown:
+            blocks.append(("UNRECOGNIZED", bytes.fromhex(unknown.group(1))))
+            continue
+
+        block = _LSUSB_BLOCK.match(line)
+        if block:
+            blocks.append((block.group(1), []))
+            continue
+
+        # bMaxPower is printed in mA, without its Hungarian prefix.
+        power = _LSUSB_POWER.match(line)
+        if power and blocks and isinstance(blocks[-1][1], list):
+            blocks[-1][1].append(bytes([min(int(power.group(1)) // 2, 0xff)]))
+            continue
+
+        field = _LSUSB_FIELD.match(line)
+        if field and blocks and isinstance(blocks[-1][1], list):
+            prefix, name, token, rest = field.groups()
+            if name is None:
+                continue
+
+            try:
+                blocks[-1][1].append(_lsusb_field_value(prefix, token))
+            except ValueError:
+                continue
+
+            # String fields carry their string after their index.
+            if prefix == 'i' and rest and int(token, 0):
+                strings[(int(token, 0), DEFAULT_LANGUAGE)] = rest.strip()
+
+    if blocks is not None:
+        yield blocks, strings
+
+
+def profiles_from_lsusb(text: str) -> List[DeviceProfile]:
+    """ Creates a profile for each device in some ``lsusb -v`` output.
+
+    lsusb prints descriptors field-by-field; we rebuild each descriptor from its fields. Descriptors
+    lsusb doesn't decode are recovered from their hex dumps; a few that it decodes in ways we
+    can't reverse are dropped, with a warning. Prefer binary captures where they're available.
+    """
+
+    profiles = []
+
+    for blocks, strings in _lsusb_profiles(text):
+        device_descriptor = None
+        configurations    = []
+
+        for name, content in blocks:
+            if name.startswith(_LSUSB_TERMINAL_BLOCKS):
+                break
+
+            if isinstance(content, bytes):
+                descriptor = content
+            elif name in _LSUSB_HEADERLESS_BLOCKS:
+                descriptor_type, subtype = _LSUSB_HEADERLESS_BLOCKS[name]
+                body       = b"".join(content)
+                descriptor = bytes([len(body) + 3, descriptor_type, subtype]) + body
+            elif content:
+                # Everything else starts with bLength; pad or trim to it, in case lsusb left anything out.
+                descriptor = b"".join(content)
+                descriptor = descriptor[:descriptor[0]].ljust(descriptor[0], b"\0")
+            else:
+                continue
+
+            if len(descriptor) < 2:
+                log.warning(f"Dropping lsusb block '{name}', which couldn't be reconstructed.")
+            elif name == "Device Descriptor":
+                device_descriptor = descriptor
+            elif name == "Configuration Descriptor":
+                configurations.append(bytearray(descriptor))
+            elif configurations:
+                configurations[-1] += descriptor
+
+        if device_descriptor is None:
+            continue
+
+        # Fix up each configuration's total length, in case anything was dropped.
+        for configuration in configurations:
+            struct.pack_into("<H", configuration, 2, len(configuration))
+
+        profiles.append(DeviceProfile(device_descriptor, [bytes(c) for c in configurations], strings))
+
+    return profiles
+
+
+def load_profile(path: str, *, cache_dir: str = None) -> DeviceProfile:
+    """ Loads a device profile from any supported source, detecting its format.
+
+    Args:
+        path      : A binary profile, a sysfs device directory or descriptors file,
+                    a raw descriptor blob, or a file containing lsusb -v output.
+        cache_dir : If provided, profiles are cached here in binary form; keyed on
+                    their source's path, size and modification time.
+    """
+
+    path = os.path.expanduser(path)
+
+    cache_path = None
+    if cache_dir:
+        cache_dir = os.path.expanduser(cache_dir)
+        status    = os.stat(os.path.join(path, "descriptors") if os.path.isdir(path) else path)
+        key       = f"{os.path.abspath(path)}:{status.st_size}:{status.st_mtime_ns}".encode()
+        cache_path = os.path.join(cache_dir, hashlib.sha1(key).hexdigest() + ".fdprof")
+
+        try:
+            with open(cache_path, "rb") as f:
+                return DeviceProfile.from_bytes(f.read())
+        except (OSError, ValueError):
+            pass
+
+    if os.path.isdir(path) or os.path.basename(path) == "descriptors":
+        profile = profile_from_sysfs(path)
+    else:
+        with open(path, "rb") as f:
+            data = f.read()
+
+        if data.startswith(PROFILE_MAGIC):
+            return DeviceProfile.from_bytes(data)
+        elif b"Device Descriptor:" in data:
+            profiles = profiles_from_lsusb(data.decode("utf-8", errors="replace"))
+            if not profiles:
+                raise ValueError(f"no devices found in lsusb output {path}")
+            profile = profiles[0]
+        else:
+            profile = profile_from_descriptors(data)
+
+    # Write the cache entry under a temporary name, and then move it into place; so an interrupted
+    # write never leaves a truncated entry behind.
+    if cache_path:
+        os.makedirs(cache_dir, exist_ok=True)
+
+        handle, temporary = tempfile.mkstemp(dir=cache_dir, prefix=".tmp-", suffix=".fdprof")
+        try:
+            with os.fdopen(handle, "wb") as f:
+                f.write(profile.to_bytes())
+            os.replace(temporary, cache_path)
+        except BaseException:
+            os.unlink(temporary)
+            raise
+
+    return profile
+
+
+#
+# Model.
+#
+
+@dataclass
+class LoadedEndpoint(USBEndpoint):
+    """ Endpoint built from a captured descriptor; reproducing any extended fields and trailing descriptors.
+
+    Fields:
+        extra_fields :
+            Any bytes past the standard seven; e.g. bRefresh and bSynchAddress on audio endpoints.
+        trailing_descriptors :
+            Any class-specific (or unrecognized) descriptors that followed this endpoint.
+    """
+
+    extra_fields         : bytes = b""
+    trailing_descriptors : bytes = b""
+
+    def get_descriptor(self) -> bytes:
+        d = super().get_descriptor()
+        d[0] = len(d) + len(self.extra_fields)
+        return d + self.extra_fields + self.trailing_descriptors
+
+
+@dataclass
+class LoadedInterface(USBInterface):
+    """ Interface built from a captured descriptor; including any alternate settings.
+
+    Alternate settings other than zero are kept as their own LoadedInterface objects in
+    ``alternates``; the host can select between them with SET_INTERFACE.
+    """
+
+    alternates : Dict[int, USBInterface] = field(default_factory=dict)
+
+
+    def __post_init__(self):
+        super().__post_init__()
+        self.active_alternate = self.alternate
+
+
+    def add_alternate(self, interface: USBInterface):
+        """ Adds an alternate setting to this interface. """
+        self.alternates[interface.alternate] = interface
+        interface.parent = self.parent
+
+
+    def _active_setting(self) -> USBInterface:
+        return self.alternates.get(self.active_alternate, self)
+
+
+    def get_endpoint(self, endpoint_number, direction):
+        active = self._active_setting()
+
+        if active is not self:
+            endpoint = active.get_endpoint(endpoint_number, direction)
+            if endpoint is not None:
+                return endpoint
+
+        return super().get_endpoint(endpoint_number, direction)
+
+
+    def get_endpoints(self):
+        """ Returns all endpoints used by any of our alternate settings; one per address. """
+        endpoints = dict(self.endpoints)
+        for alternate in self.alternates.values():
+            for address, endpoint in alternate.endpoints.items():
+                if address not in endpoints or endpoint.max_packet_size > endpoints[address].max_packet_size:
+                    endpoints[address] = endpoint
+
+        return endpoints.values()
+
+
+    def get_descriptor(self) -> bytes:
+        d = super().get_descriptor()
+
+        for alternate in sorted(self.alternates):
+            d += self.alternates[alternate].get_descriptor()
+
+        return d
+
+
+    @standard_request_handler(number=USBStandardRequests.SET_INTERFACE)
+    @to_this_interface
+    def handle_set_interface_request(self, request):
+        if request.value != self.alternate and request.value not in self.alternates:
+            request.stall()
+            return
+
+        self.active_alternate = request.value
+        self.get_device().endpoints_changed()
+        request.acknowledge()
+
+
+    @standard_request_handler(number=USBStandardRequests.GET_INTERFACE)
+    @to_this_interface
+    def handle_get_interface_request(self, request):
+        request.reply(bytes([self.active_alternate]))
+
+
+@dataclass
+class LoadedConfiguration(USBConfiguration):
+    """ Configuration built from a captured descriptor.
+
+    Fields:
+        leading_descriptors :
+            Any descriptors between the configuration descriptor and its first interface.
+    """
+
+    leading_descriptors : bytes = b""
+
+    def get_descriptor(self) -> bytes:
+        d = bytearray(super().get_descriptor())
+
+        if self.leading_descriptors:
+            d[9:9] = self.leading_descriptors
+            struct.pack_into("<H", d, 2, len(d))
+
+        return bytes(d)
+
+
+def build_configuration(data: bytes) -> LoadedConfiguration:
+    """ Builds a configuration model from a full configuration descriptor. """
+
+    view = memoryview(data)
+
+    number, string_index, attributes, max_power = struct.unpack_from("<xxxxxBBBB", view)
+
+    configuration = LoadedConfiguration(
+        number=number,
+        configuration_string=string_index,
+        max_power=max_power * 2,
+        self_powered=bool(attributes & (1 << 6)),
+        supports_remote_wakeup=bool(attributes & (1 << 5)),
+    )
+
+    # Descriptors that aren't interfaces or endpoints are attached to whatever they follow;
+    # so we reproduce them, in order, when the configuration descriptor is regenerated.
+    leading   = bytearray()
+    pending   = bytearray()
+    owner     = None
+    interface = None
+
+    for descriptor in USBDescribable.iterate_binary_descriptors(view[view[0]:len(view)]):
+        descriptor_type = descriptor[1]
+
+        if descriptor_type == USBDescriptorTypeNumber.INTERFACE and len(descriptor) >= 9:
+            _attach_descriptors(owner, pending, leading)
+
+            interface = LoadedInterface.from_binary_descriptor(descriptor)
+            interface.name = f"interface {interface.number}"
+
+            primary = configuration.interfaces.get(interface.number)
+            if primary is None:
+                configuration.add_interface(interface)
+            else:
+                primary.add_alternate(interface)
+
+            owner = interface
+
+        elif descriptor_type == USBDescriptorTypeNumber.ENDPOINT and interface is not None and len(descriptor) >= 7:
+            _attach_descriptors(owner, pending, leading)
+
+            endpoint = LoadedEndpoint.from_binary_descriptor(descriptor)
+            endpoint.extra_fields = bytes(descriptor[7:])
+            interface.add_endpoint(endpoint)
+
+            owner = endpoint
+
+        else:
+            pending += descriptor
+
+    _attach_descriptors(owner, pending, leading)
+
+    configuration.leading_descriptors = bytes(leading)
+    return configuration
+
+
+def _attach_descriptors(owner, pending: bytearray, leading: bytearray):
+    """ Moves descriptors collected after an interface or endpoint onto that object. """
+
+    if not pending:
+        return
+
+    if owner is None:
+        leading += pending
+    elif isinstance(owner, LoadedEndpoint):
+        owner.trailing_descriptors += bytes(pending)
+    else:
+        owner.class_descriptor = (owner.class_descriptor or b"") + bytes(pending)
+
+    pending.clear()
+
+
+def populate_device(device: USBDevice, profile: DeviceProfile):
+    """ Fills in an existing device object from a profile; replacing its descriptors and configurations. """
+
+    data = profile.device_descriptor.ljust(18, b"\0")
+
+    # Our device model stores its BCD fields byte-swapped; see USBBaseDevice.get_descriptor.
+    device.usb_spec_version         = (data[2] << 8) | data[3]
+    device.device_class             = data[4]
+    device.device_subclass          = data[5]
+    device.protocol_revision_number = data[6]
+    device.max_packet_size_ep0      = data[7]
+    device.vendor_id, device.product_id = struct.unpack_from("<HH", data, 8)
+    device.device_revision          = (data[12] << 8) | data[13]
+    device.manufacturer_string      = data[14]
+    device.product_string           = data[15]
+    device.serial_number_string     = data[16]
+
+    device.supported_languages = tuple(profile.languages)
+
+    # Install each string at its original index, in each language; the primary language is also our fallback.
+    primary = profile.languages[0] if profile.languages else DEFAULT_LANGUAGE
+    for (index, language), string in sorted(profile.strings.items()):
+        device.strings.add_string(string, index=index, language=language)
+        if language == primary:
+            device.strings.add_string(string, index=index)
+
+    device.configurations = {}
+    for descriptor in profile.configuration_descriptors:
+        device.add_configuration(build_configuration(descriptor))
+
+    return device
+
+
+def build_device(profile: DeviceProfile, device_type: type = USBDevice) -> USBDevice:
+    """ Builds a device model from a profile.
+
+    Args:
+        profile     : The DeviceProfile to build from.
+        device_type : The USBDevice subclass to instantiate; e.g. one adding class request handlers.
+    """
+    device = device_type(name=f"device {profile.device_descriptor[8:12].hex()}")
+    return populate_device(device, profile)
+
+
+def compile_device_class(profile: DeviceProfile, name: str = None, base: type = USBDevice) -> type:
+    """ Creates a USBDevice subclass whose instances are copies of the profiled device.
+
+    The resulting class can be subclassed further, like any other Facedancer device.
+    """
+
+    vendor_id, product_id = struct.unpack_from("<HH", profile.device_descriptor, 8)
+
+    def __post_init__(self):
+        base.__post_init__(self)
+        populate_device(self, profile)
+
+    name = name or f"Device_{vendor_id:04x}_{product_id:04x}"
+    return type(name, (base,), {'__post_init__': __post_init__, 'profile': profile})
+
+
+def load_device(path: str, *, cache_dir: str = None, device_type: type = USBDevice) -> USBDevice:
+    """ Convenience function that loads a profile from a path, and builds a device from it. """
+    return build_device(load_profile(path, cache_dir=cache_dir), device_type)
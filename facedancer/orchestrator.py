@@ -0,0 +1,184 @@
+#
+# This file is part of Facedancer.
+#
+""" Runs many emulated devices, each on its own board, from a single process.
+
+Each device normally owns an event loop of its own: :meth:`USBDevice.emulate` connects to the
+first board it finds, and services it until the emulation ends. A :class:`DeviceOrchestrator`
+instead connects each device to an explicitly chosen board, and services all of them from one
+event loop::
+
+    orchestrator = DeviceOrchestrator()
+    orchestrator.add(USBKeyboardDevice(), serial_number="000000000000000075b068dc317e7e4f")
+    orchestrator.add(FTDIDevice(), bus_path="1-4.2", budget=0.005)
+    orchestrator.emulate(*coroutines)
+
+Boards are serviced in rounds. Each device is given a time budget per round; the time spent
+servicing its board (including running its request handlers) is charged against that budget,
+and a device that overspends sits out subsequent rounds until it has paid its debt. One busy
+device thus gets its fair share of the loop, and no more; and can't starve its neighbours.
+"""
+
+import time
+import asyncio
+
+from typing      import Coroutine, Iterable, List
+from dataclasses import dataclass
+
+from .core       import FacedancerUSBApp
+from .device     import USBDevice
+from .logging    import log
+
+
+# Default time, in seconds, each device may spend being serviced per round.
+DEFAULT_BUDGET = 0.002
+
+
+@dataclass
+class OrchestratedDevice:
+    """ A device being serviced by an orchestrator; and its scheduling bookkeeping.
+
+    Fields:
+        device :
+            The device being emulated.
+        budget :
+            The time, in seconds, the device may spend being serviced per round.
+        credit :
+            The time the device may currently spend; negative while it's paying off an overspend.
+        busy_time :
+            The total time spent servicing the device.
+        polls :
+            The number of times the device's backend has been serviced.
+        deferrals :
+            The number of rounds the device has sat out, for having overspent.
+    """
+
+    device    : USBDevice
+    budget    : float
+    credit    : float = 0.0
+    busy_time : float = 0.0
+    polls     : int   = 0
+    deferrals : int   = 0
+
+
+class DeviceOrchestrator:
+    """ Services a set of devices, on a set of boards, fairly and from a single event loop.
+
+    Args:
+        budget : The default per-round time budget for each device, in seconds.
+    """
+
+    def __init__(self, *, budget: float = DEFAULT_BUDGET):
+        self.budget  = budget
+        self.members : List[OrchestratedDevice] = []
+
+        # The member currently being serviced, if any; e.g. so log output can be attributed to it.
+        self.current : OrchestratedDevice = None
+
+
+    def add(self, device: USBDevice, *, backend=None, serial_number: str = None,
+            bus_path: str = None, budget: float = None) -> USBDevice:
+        """ Adds a device to be emulated.
+
+        Args:
+            device        : The device to emulate.
+            backend       : The backend to emulate it on. If not provided, and the device doesn't
+                            already have one, one is created for the selected board.
+            serial_number : The serial number of the board to emulate the device on.
+            bus_path      : The USB bus path (e.g. "1-4.2") of the board to emulate the device on.
+            budget        : The device's per-round time budget, in seconds; or None for our default.
+
+        Returns the device, for convenience.
+        """
+
+        if backend is not None:
+            device.backend = backend
+        elif device.backend is None:
+            device.backend = FacedancerUSBApp(serial_number=serial_number, bus_path=bus_path)
+
+        self.members.append(OrchestratedDevice(device, self.budget if budget is None else budget))
+        return device
+
+
+    def connect(self):
+        """ Connects each of our devices to its host. """
+        for member in self.members:
+            member.device.connect()
+
+
+    def disconnect(self):
+        """ Disconnects each of our devices from its host. """
+        for member in self.members:
+            try:
+                member.device.disconnect()
+            except Exception as e:
+                log.warning(f"failed to disconnect {member.device.name}: {e}")
+
+
+    def service(self):
+        """ Performs a single round of servicing; giving each device in credit one service call. """
+
+        for member in self.members:
+
+            # Top up the device's credit; but don't let a quiet device bank up a burst.
+            member.credit = min(member.credit + member.budget, member.budget)
+
+            if member.credit <= 0:
+                member.deferrals += 1
+                continue
+
+            self.current = member
+            start        = time.perf_counter()
+
+            try:
+                member.device.backend.service_irqs()
+            finally:
+                elapsed      = time.perf_counter() - start
+                self.current = None
+
+            member.credit    -= elapsed
+            member.busy_time += elapsed
+            member.polls     += 1
+
+
+    async def run(self):
+        """ Services all of our devices, and runs their background coroutines; until cancelled. """
+
+        if not self.members:
+            log.warning("orchestrator has no devices to run")
+
+        # We service each device's backend in place of its run(); so do everything else run() would.
+        background = []
+        for member in self.members:
+            member.device.check_configurations()
+            background.extend(member.device.get_background_coroutines())
+
+        await asyncio.gather(self._service_forever(), *background)
+
+
+    async def _service_forever(self):
+        while True:
+            self.service()
+
+            # Let the devices' own coroutines run between rounds.
+            await asyncio.sleep(0)
+
+
+    def run_with(self, *coroutines: Iterable[Coroutine]):
+        """ Runs all of our devices synchronously; running any provided coroutines alongside them. """
+
+        async def inner():
+            await asyncio.gather(self.run(), *coroutines)
+
+        asyncio.run(inner())
+
+
+    def emulate(self, *coroutines: Iterable[Coroutine]):
+        """ Connects all of our devices, runs them and any provided coroutines, and then disconnects them. """
+
+        self.connect()
+
+        try:
+            self.run_with(*coroutines)
+        finally:
+            self.disconnect()
@@ -251,6 +251,11 @@ class USBControlRequest:
 
     def reply(self, data: bytes):
         """ Replies to the given request with a given set of bytes. """
+
+        # Give any installed hooks a chance to rewrite our response.
+        if self.device.hooks:
+            data = self.device.hooks.mutate_reply(self, data)
+
         self.device.send(endpoint_number=0, data=data)
 
 
@@ -0,0 +1,244 @@
+#
+# This file is part of Facedancer.
+#
+""" Snapshot and restore of emulated device state.
+
+A snapshot captures the state of a device model -- the device itself, its configurations,
+interfaces and endpoints, its string table, its backend's bookkeeping, and any helper objects
+the device holds (e.g. a mass storage device's SCSI command handler) -- into an immutable
+structure. Restoring a snapshot returns all of those objects to the captured state, without
+rebuilding them; so a fuzzer or test can return to e.g. a mid-enumeration state as often as it
+likes::
+
+    enumerated = device.snapshot()
+
+    for case in cases:
+        device.restore(enumerated)
+        ...
+
+Only Python-side state is captured; hardware state (and data behind e.g. file handles or
+mmaps) is not, so restores are most useful with virtual backends, or against a host that
+is itself being reset.
+"""
+
+import enum
+import types
+import dataclasses
+
+from collections import deque
+from typing      import Iterable, NamedTuple, Tuple
+
+from .descriptor import USBDescribable, StringDescriptorManager
+
+
+# Values of these types are immutable, and so are shared directly between snapshots and live objects.
+_IMMUTABLE_TYPES = (type(None), bool, int, float, complex, str, bytes, enum.Enum, range, frozenset, type,
+    types.FunctionType, types.BuiltinFunctionType, types.MethodType, types.ModuleType)
+
+
+class _FrozenContainer(NamedTuple):
+    """ Immutable stand-in for a mutable container; recreated (or refilled in place) on restore. """
+    kind  : type
+    items : tuple
+    extra : object = None
+
+
+class _FrozenObject(NamedTuple):
+    """ Immutable stand-in for a plain-data object (e.g. a pending control request); copied on restore. """
+    kind  : type
+    state : tuple
+
+
+def _freeze(value):
+    """ Returns an immutable representation of a value; sharing any parts that are already immutable. """
+
+    if isinstance(value, _IMMUTABLE_TYPES):
+        return value
+
+    kind = type(value)
+
+    if kind is tuple:
+        frozen = tuple(_freeze(item) for item in value)
+        return value if all(a is b for a, b in zip(frozen, value)) else _FrozenContainer(tuple, frozen)
+    if isinstance(value, bytearray):
+        return _FrozenContainer(kind, bytes(value))
+    if isinstance(value, list):
+        return _FrozenContainer(kind, tuple(_freeze(item) for item in value))
+    if isinstance(value, dict):
+        return _FrozenContainer(kind, tuple((key, _freeze(item)) for key, item in value.items()))
+    if isinstance(value, set):
+        return _FrozenContainer(kind, tuple(_freeze(item) for item in value))
+    if isinstance(value, deque):
+        return _FrozenContainer(kind, tuple(_freeze(item) for item in value), value.maxlen)
+
+    # Plain data objects that aren't part of our model are copied, so they can't change underneath us.
+    if dataclasses.is_dataclass(value) and not isinstance(value, USBDescribable):
+        return _FrozenObject(kind, _freeze_attributes(value))
+
+    # Anything else -- model objects, hardware handles, and the like -- is kept by reference.
+    return value
+
+
+def _thaw(frozen, current=None):
+    """ Recreates a live value from its frozen form; refilling ``current`` in place where possible.
+
+    Refilling in place keeps any other references to a container (e.g. memoryviews over a
+    bytearray, or a second attribute aliasing the same list) pointed at the restored data.
+    """
+
+    if isinstance(frozen, _FrozenObject):
+        restored = frozen.kind.__new__(frozen.kind)
+        _restore_attributes(restored, frozen.state)
+        return restored
+
+    if not isinstance(frozen, _FrozenContainer):
+        return frozen
+
+    kind, items, extra = frozen
+
+    if issubclass(kind, bytearray):
+        if type(current) is kind:
+            try:
+                current[:] = items
+                return current
+            except BufferError:
+                pass
+        return kind(items)
+
+    if kind is tuple:
+        return tuple(_thaw(item) for item in items)
+
+    if issubclass(kind, dict):
+        contents = ((key, _thaw(item)) for key, item in items)
+    else:
+        contents = (_thaw(item) for item in items)
+
+    if type(current) is kind:
+        if isinstance(current, list) or (isinstance(current, deque) and current.maxlen == extra):
+            current.clear()
+            current.extend(contents)
+            return current
+        if isinstance(current, (dict, set)):
+            current.clear()
+            current.update(contents)
+            return current
+
+    if issubclass(kind, deque):
+        return kind(contents, extra)
+
+    return kind(contents)
+
+
+def _unchanged(a, b) -> bool:
+    """ Returns true iff two frozen values are the same; comparing referenced objects by identity. """
+
+    if a is b:
+        return True
+
+    if type(a) is not type(b):
+        return False
+
+    if isinstance(a, tuple):
+        return len(a) == len(b) and all(_unchanged(x, y) for x, y in zip(a, b))
+
+    return isinstance(a, _IMMUTABLE_TYPES) and a == b
+
+
+def _freeze_attributes(obj) -> tuple:
+    return tuple((name, _freeze(value)) for name, value in vars(obj).items())
+
+
+def _restore_attributes(obj, state: tuple):
+    attributes = vars(obj)
+
+    # Drop anything that didn't exist when the snapshot was taken...
+    captured = {name for name, _ in state}
+    for name in [name for name in attributes if name not in captured]:
+        del attributes[name]
+
+    # ... and return everything else to its captured value.
+    for name, frozen in state:
+        attributes[name] = _thaw(frozen, attributes.get(name))
+
+
+def _is_helper_object(value) -> bool:
+    """ Returns true iff a value looks like a stateful helper object, rather than data or a handle. """
+    return hasattr(value, '__dict__') and not isinstance(value, _IMMUTABLE_TYPES) and not callable(value)
+
+
+def device_participants(device) -> Iterable:
+    """ Yields each object whose state makes up a device's emulation state. """
+
+    yield device
+    yield device.strings
+
+    for configuration in device.configurations.values():
+        yield configuration
+
+        for interface in configuration.get_interfaces():
+            yield interface
+            yield from interface.endpoints.values()
+
+    # Include any helper objects the device holds directly; such as its backend, or a command handler.
+    # Its hooks are skipped; they typically belong to whatever is driving the snapshots.
+    for name, value in vars(device).items():
+        if name == 'hooks' or isinstance(value, (USBDescribable, StringDescriptorManager)):
+            continue
+        if _is_helper_object(value):
+            yield value
+
+
+class DeviceSnapshot:
+    """ Immutable capture of the state of a set of objects; see the module documentation.
+
+    Snapshots share any state that hasn't changed with the snapshot they were based on,
+    and all immutable values with the live objects; so taking many snapshots is cheap.
+    """
+
+    __slots__ = ('_states',)
+
+    def __init__(self, states: Tuple[Tuple[object, tuple], ...]):
+        self._states = states
+
+
+    @classmethod
+    def capture(cls, device, *extra_participants, base: 'DeviceSnapshot' = None):
+        """ Captures the state of a device, and of any additional objects provided.
+
+        Args:
+            device             : The device whose state should be captured.
+            extra_participants : Any additional objects whose state should be captured.
+            base               : An earlier snapshot of the same device; any unchanged
+                                  per-object state is shared with it.
+        """
+
+        previous = {id(obj): state for obj, state in base._states} if base else {}
+
+        states = []
+        seen   = set()
+
+        for participant in (*device_participants(device), *extra_participants):
+            if id(participant) in seen:
+                continue
+            seen.add(id(participant))
+
+            state = _freeze_attributes(participant)
+
+            # Share the previous snapshot's copy of this object's state, if it hasn't changed.
+            earlier = previous.get(id(participant))
+            if earlier is not None and _unchanged(earlier, state):
+                state = earlier
+
+            states.append((participant, state))
+
+        return cls(tuple(states))
+
+
+    def restore(self):
+        """ Returns every captured object to its captured state. Can be called any number of times. """
+        for participant, state in self._states:
+            _restore_attributes(participant, state)
+
+
+    def __len__(self):
+        return len(self._states)
@@ -19,6 +19,9 @@ IN_ENDPOINT  = 0x82
 # and is board dependent.
 MAX_TRANSFER_LENGTH = 768
 
+# Control transfers larger than the command size; these are split up by Facedancer.
+LARGE_CONTROL_TRANSFER_LENGTH = 4096
+
 
 class FacedancerTestCase(unittest.TestCase):
 
@@ -105,14 +108,14 @@ class FacedancerTestCase(unittest.TestCase):
         )
         return response
 
-    def get_last_out_transfer_data(self):
+    def get_last_out_transfer_data(self, length=MAX_TRANSFER_LENGTH):
         logging.debug("Getting last OUT transfer data")
         response = self.device_handle.controlRead(
             request_type = usb1.TYPE_VENDOR | usb1.RECIPIENT_DEVICE,
             request      = 2,
             index        = 0,
             value        = 0,
-            length       = MAX_TRANSFER_LENGTH,
+            length       = length,
             timeout      = 1000,
         )
         logging.debug(f"[host] sent '{len(response)}' bytes with last out transfer")
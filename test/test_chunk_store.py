@@ -0,0 +1,158 @@
+#
+# This file is part of Facedancer.
+#
+""" Deduplicated chunk store tests; run entirely on temporary files, so no hardware is needed. """
+
+import os
+import tempfile
+import unittest
+
+from facedancer.devices.umass import ChunkStore, ChunkMap, ChunkedDiskImage
+
+
+CHUNK_SIZE = 4096
+BLOCK_SIZE = 512
+
+# The number of chunks in each test image.
+CHUNKS     = 8
+
+
+class TestChunkStore(unittest.TestCase):
+    """ Exercises chunk sharing, copy-on-write, flushing, discards, and chunk map files. """
+
+    # - life-cycle ------------------------------------------------------------
+
+    def setUp(self):
+        directory      = tempfile.TemporaryDirectory()
+        self.directory = directory.name
+        self.addCleanup(directory.cleanup)
+
+        self.store = ChunkStore(os.path.join(self.directory, "chunks"), chunk_size=CHUNK_SIZE)
+        self.addCleanup(self.store.close)
+
+        # An image with distinct contents in every chunk, except for one chunk of zeroes.
+        self.contents = bytearray(os.urandom(CHUNKS * CHUNK_SIZE))
+        self.contents[CHUNK_SIZE:2 * CHUNK_SIZE] = bytes(CHUNK_SIZE)
+
+
+    def path(self, name):
+        return os.path.join(self.directory, name)
+
+
+    def write_image(self, name, contents):
+        with open(self.path(name), "wb") as f:
+            f.write(contents)
+        return self.path(name)
+
+
+    def stored_chunks(self):
+        return sum(len(files) for _, _, files in os.walk(self.store.directory))
+
+
+    def image(self, chunk_map, **kwargs):
+        return ChunkedDiskImage(self.store, chunk_map, block_size=BLOCK_SIZE, **kwargs)
+
+
+    # - tests -----------------------------------------------------------------
+
+    def test_imported_images_share_chunks(self):
+        first = self.store.import_image(self.write_image("first.img", self.contents))
+
+        # A second image that differs in only one chunk.
+        modified = bytearray(self.contents)
+        modified[3 * CHUNK_SIZE] ^= 0xff
+        second = self.store.import_image(self.write_image("second.img", modified))
+
+        # The all-zero chunk isn't stored; and the images share everything but the modified chunk.
+        self.assertIsNone(first.chunks[1])
+        self.assertEqual(self.stored_chunks(), (CHUNKS - 1) + 1)
+        self.assertEqual([a == b for a, b in zip(first.chunks, second.chunks)],
+            [index != 3 for index in range(CHUNKS)])
+
+        self.assertEqual(self.image(second).get_data(0, len(modified)), bytes(modified))
+
+
+    def test_copy_on_write_isolates_images(self):
+        chunk_map = self.store.import_image(self.write_image("base.img", self.contents))
+        first     = self.image(chunk_map.copy())
+        second    = self.image(chunk_map.copy())
+
+        first.put_data(3, b"\xa5" * BLOCK_SIZE)
+
+        # Only the image we wrote sees the change; and nothing's been stored yet.
+        self.assertEqual(first.get_sector_data(3), b"\xa5" * BLOCK_SIZE)
+        self.assertEqual(second.get_sector_data(3), bytes(self.contents[3 * BLOCK_SIZE:4 * BLOCK_SIZE]))
+        self.assertEqual(first.chunk_map.chunks, second.chunk_map.chunks)
+
+
+    def test_flush_stores_modified_chunks(self):
+        chunk_map = self.store.import_image(self.write_image("base.img", self.contents))
+        original  = list(chunk_map.chunks)
+        image     = self.image(chunk_map, map_filename=self.path("device.map"), max_dirty=2)
+
+        # Modifying a single chunk stays private...
+        image.put_data(0, b"\x5a" * BLOCK_SIZE)
+        self.assertEqual(image.chunk_map.chunks, original)
+        self.assertFalse(os.path.exists(self.path("device.map")))
+
+        # ... until max_dirty chunks have been modified; then they're stored, and the map saved.
+        image.put_data(2 * CHUNK_SIZE // BLOCK_SIZE, b"\x5a" * BLOCK_SIZE)
+        self.assertNotEqual(image.chunk_map.chunks[0], original[0])
+        self.assertNotEqual(image.chunk_map.chunks[2], original[2])
+        self.assertEqual(image.chunk_map.chunks[3:], original[3:])
+
+        saved = ChunkMap.load(self.path("device.map"))
+        self.assertEqual(saved.chunks, image.chunk_map.chunks)
+        self.assertEqual(self.image(saved).get_sector_data(0), b"\x5a" * BLOCK_SIZE)
+
+
+    def test_whole_chunk_discard(self):
+        chunk_map = self.store.import_image(self.write_image("base.img", self.contents))
+        image     = self.image(chunk_map)
+        blocks    = CHUNK_SIZE // BLOCK_SIZE
+
+        # Discard all of chunk 2, and part of chunk 4.
+        image.discard(2 * blocks, blocks)
+        image.discard(4 * blocks, 1)
+
+        # The whole chunk is simply dropped from the map; the partial one is zeroed.
+        self.assertIsNone(image.chunk_map.chunks[2])
+        self.assertIsNotNone(image.chunk_map.chunks[4])
+        self.assertEqual(image.get_data(2 * blocks, CHUNK_SIZE), bytes(CHUNK_SIZE))
+        self.assertEqual(image.get_sector_data(4 * blocks), bytes(BLOCK_SIZE))
+        self.assertEqual(image.get_sector_data(4 * blocks + 1),
+            bytes(self.contents[4 * CHUNK_SIZE + BLOCK_SIZE:4 * CHUNK_SIZE + 2 * BLOCK_SIZE]))
+
+
+    def test_chunk_map_round_trip(self):
+        chunk_map = self.store.import_image(self.write_image("base.img", self.contents))
+        chunk_map.save(self.path("base.map"))
+
+        loaded = ChunkMap.load(self.path("base.map"))
+        self.assertEqual((loaded.chunk_size, loaded.size), (CHUNK_SIZE, len(self.contents)))
+        self.assertEqual(loaded.chunks, chunk_map.chunks)
+
+
+    def test_damaged_chunk_map_is_rejected(self):
+        chunk_map = self.store.import_image(self.write_image("base.img", self.contents))
+        chunk_map.save(self.path("base.map"))
+
+        with open(self.path("base.map"), "rb") as f:
+            data = f.read()
+
+        # Truncated digests, a chunk count that doesn't match the size, and a truncated header.
+        header    = ChunkMap.HEADER
+        miscount  = header.pack(ChunkMap.MAGIC, CHUNK_SIZE, len(self.contents), CHUNKS + 1) + data[header.size:]
+        damaged   = [data[:-1], miscount, data[:header.size - 1]]
+
+        for contents in damaged:
+            with self.subTest(length=len(contents)):
+                with open(self.path("damaged.map"), "wb") as f:
+                    f.write(contents)
+
+                with self.assertRaises(ValueError):
+                    ChunkMap.load(self.path("damaged.map"))
+
+
+if __name__ == "__main__":
+    unittest.main()
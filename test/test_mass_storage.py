@@ -0,0 +1,431 @@
+#
+# This file is part of Facedancer.
+#
+""" Mass storage tests; run against the simulated host, or in memory, so no hardware is needed. """
+
+import os
+import struct
+import asyncio
+import tempfile
+import unittest
+import threading
+
+from facedancer.backends.virtual    import VirtualHostBackend, simulate
+from facedancer.devices.umass       import USBMassStorageDevice, RawDiskImage, CachedDiskImage, DiskImage
+from facedancer.devices.umass       import disk_image
+from facedancer.devices.umass.umass import ENDPOINT_IN, ENDPOINT_OUT
+
+
+# A sparse image this large needs 64-bit LBAs; and only takes up the blocks we write.
+IMAGE_SIZE = 4 << 40
+BLOCK_SIZE = 512
+
+# Give up on a command if the device hasn't answered within this many polls of the host.
+MAX_POLLS  = 10000
+
+
+class TestMassStorage(unittest.TestCase):
+    """ Exercises the 64-bit LBA path of the mass storage device, on a sparse multi-terabyte image. """
+
+    # - life-cycle ------------------------------------------------------------
+
+    def setUp(self):
+        handle, self.filename = tempfile.mkstemp(suffix=".img")
+        os.ftruncate(handle, IMAGE_SIZE)
+        os.close(handle)
+
+        self.backend = VirtualHostBackend()
+        self.device  = USBMassStorageDevice(RawDiskImage(self.filename, BLOCK_SIZE))
+        self.tag     = 0
+
+
+    def tearDown(self):
+        self.device.disk_image.close()
+        os.unlink(self.filename)
+
+
+    def run_host(self, script):
+        """ Runs a host-side coroutine against our device; and returns its result. """
+        return simulate(self.device, script(), backend=self.backend)[0]
+
+
+    # - host-side helpers -----------------------------------------------------
+
+    async def command(self, command_block, data_in_length=0, data_out=b""):
+        """ Performs a single bulk-only transport command; returns (data, status). """
+
+        self.tag += 1
+        length = data_in_length or len(data_out)
+        flags  = 0x80 if data_in_length else 0x00
+
+        cbw  = struct.pack("<4sIIBBB", b"USBC", self.tag, length, flags, 0, len(command_block))
+        cbw += command_block.ljust(16, b"\0")
+
+        self.backend.send(ENDPOINT_OUT, cbw)
+        if data_out:
+            self.backend.send(ENDPOINT_OUT, data_out)
+
+        # Wait for the data stage, if any, and the 13-byte status wrapper.
+        response = b""
+        for _ in range(MAX_POLLS):
+            response += self.backend.read(ENDPOINT_IN)
+            if len(response) >= data_in_length + 13:
+                break
+            await asyncio.sleep(0.001)
+        else:
+            self.fail(f"device didn't complete command {command_block.hex()}")
+
+        data, csw = response[:-13], response[-13:]
+        signature, tag, residue, status = struct.unpack("<4sIIB", csw)
+
+        self.assertEqual(signature, b"USBS")
+        self.assertEqual(tag, self.tag)
+
+        return data, status
+
+
+    async def read_16(self, lba, count):
+        command_block = struct.pack(">BBQIBB", 0x88, 0, lba, count, 0, 0)
+        return await self.command(command_block, data_in_length=count * BLOCK_SIZE)
+
+
+    async def write_16(self, lba, data):
+        command_block = struct.pack(">BBQIBB", 0x8a, 0, lba, len(data) // BLOCK_SIZE, 0, 0)
+        return await self.command(command_block, data_out=data)
+
+
+    async def unmap(self, *ranges):
+        descriptors = b"".join(struct.pack(">QIxxxx", lba, count) for lba, count in ranges)
+        parameters  = struct.pack(">HHxxxx", len(descriptors) + 6, len(descriptors)) + descriptors
+        return await self.command(struct.pack(">BxxxxxxHx", 0x42, len(parameters)), data_out=parameters)
+
+
+    def allocated_bytes(self):
+        return os.stat(self.filename).st_blocks * 512
+
+
+    # - tests -----------------------------------------------------------------
+
+    def test_read_capacity(self):
+        last_lba = IMAGE_SIZE // BLOCK_SIZE - 1
+
+        async def host():
+            capacity_10, status_10 = await self.command(b"\x25", data_in_length=8)
+            capacity_16, status_16 = await self.command(
+                struct.pack(">BBQIBB", 0x9e, 0x10, 0, 32, 0, 0), data_in_length=32)
+            return capacity_10, status_10, capacity_16, status_16
+
+        capacity_10, status_10, capacity_16, status_16 = self.run_host(host)
+
+        # READ CAPACITY (10) can't describe this disk; and should direct the host to READ CAPACITY (16).
+        self.assertEqual(status_10, 0)
+        self.assertEqual(struct.unpack(">II", capacity_10), (0xffffffff, BLOCK_SIZE))
+
+        self.assertEqual(status_16, 0)
+        self.assertEqual(len(capacity_16), 32)
+        self.assertEqual(struct.unpack(">QI", capacity_16[:12]), (last_lba, BLOCK_SIZE))
+
+
+    def test_read_write_16_past_2tib(self):
+        last_lba = IMAGE_SIZE // BLOCK_SIZE - 1
+        targets  = [(1 << 32) + 12345, last_lba - 7]
+        payloads = [os.urandom(8 * BLOCK_SIZE) for _ in targets]
+
+        async def host():
+            results = []
+
+            for lba, payload in zip(targets, payloads):
+                _, write_status = await self.write_16(lba, payload)
+                data, read_status = await self.read_16(lba, 8)
+                results.append((write_status, read_status, data))
+
+            return results
+
+        results = self.run_host(host)
+
+        for (write_status, read_status, data), payload in zip(results, payloads):
+            self.assertEqual(write_status, 0)
+            self.assertEqual(read_status, 0)
+            self.assertEqual(data, payload)
+
+        # The data should have landed at the right place in the image itself.
+        with open(self.filename, "rb") as f:
+            for lba, payload in zip(targets, payloads):
+                self.assertEqual(os.pread(f.fileno(), len(payload), lba * BLOCK_SIZE), payload)
+
+
+    def test_read_16_past_end_fails(self):
+        last_lba = IMAGE_SIZE // BLOCK_SIZE - 1
+
+        async def host():
+            read  = await self.read_16(last_lba, 2)
+            sense = await self.command(b"\x03\x00\x00\x00\x12", data_in_length=18)
+            return read, sense
+
+        (data, status), (sense, sense_status) = self.run_host(host)
+
+        # The host still gets the data phase it asked for; padded with zeroes.
+        self.assertNotEqual(status, 0)
+        self.assertEqual(data, bytes(2 * BLOCK_SIZE))
+
+        # ... and can then find out why: ILLEGAL REQUEST, LOGICAL BLOCK ADDRESS OUT OF RANGE.
+        self.assertEqual(sense_status, 0)
+        self.assertEqual((sense[0], sense[2], sense[12], sense[13]), (0x70, 0x05, 0x21, 0x00))
+
+
+    def test_logical_block_provisioning_vpd(self):
+        if not self.device.disk_image.supports_discard():
+            self.skipTest("filesystem can't punch holes")
+
+        async def host():
+            return await self.command(b"\x12\x01\xb2\x00\x08", data_in_length=8)
+
+        page, status = self.run_host(host)
+
+        # UNMAP and WRITE SAME (16) with UNMAP are supported; unmapped blocks read as zero; thin provisioned.
+        self.assertEqual(status, 0)
+        self.assertEqual(page[1], 0xb2)
+        self.assertEqual(page[5] & 0xc0, 0xc0)
+        self.assertEqual((page[5] >> 2) & 0x07, 1)
+        self.assertEqual(page[6] & 0x07, 2)
+
+
+    def test_unmap_and_write_same_punch_holes(self):
+        if not self.device.disk_image.supports_discard():
+            self.skipTest("filesystem can't punch holes")
+
+        lba      = (1 << 32) + 4096
+        blocks   = 256
+        payload  = os.urandom(blocks * BLOCK_SIZE)
+        baseline = self.allocated_bytes()
+
+        async def host():
+            results = {}
+
+            await self.write_16(lba, payload)
+            await self.write_16(lba + blocks, payload)
+            results['written'] = self.allocated_bytes()
+
+            # Discard the first run with UNMAP; and the second with WRITE SAME (16) of zeroes, with UNMAP set.
+            _, results['unmap'] = await self.unmap((lba, blocks))
+            _, results['write_same'] = await self.command(
+                struct.pack(">BBQIBB", 0x93, 0x08, lba + blocks, blocks, 0, 0), data_out=bytes(BLOCK_SIZE))
+
+            results['discarded'] = self.allocated_bytes()
+            results['data'], _   = await self.read_16(lba, blocks * 2)
+
+            # Out-of-range UNMAPs should fail.
+            _, results['bad_unmap'] = await self.unmap((IMAGE_SIZE // BLOCK_SIZE - 1, 2))
+            return results
+
+        results = self.run_host(host)
+
+        self.assertEqual(results['unmap'], 0)
+        self.assertEqual(results['write_same'], 0)
+        self.assertNotEqual(results['bad_unmap'], 0)
+        self.assertEqual(results['data'], bytes(blocks * 2 * BLOCK_SIZE))
+
+        # If the filesystem supports hole punching, the image should be back to its original footprint.
+        if results['written'] > baseline:
+            self.assertLessEqual(results['discarded'], baseline)
+
+
+    def test_command_statistics(self):
+        lba     = (1 << 32) + 64
+        payload = os.urandom(16 * BLOCK_SIZE)
+
+        async def host():
+            await self.write_16(lba, payload)
+            await self.write_16(lba + 16, payload[:4 * BLOCK_SIZE])
+
+            for _ in range(3):
+                await self.read_16(lba, 16)
+
+        self.run_host(host)
+
+        handler    = self.device.scsi_command_handler
+        statistics = handler.get_statistics()
+        reads      = statistics["Read (16)"]
+        writes     = statistics["Write (16)"]
+
+        self.assertEqual((reads.count, reads.failures), (3, 0))
+        self.assertEqual((reads.bytes_in, reads.bytes_out), (3 * len(payload), 0))
+        self.assertEqual(sum(reads.latency_histogram), 3)
+
+        self.assertEqual((writes.count, writes.failures), (2, 0))
+        self.assertEqual((writes.bytes_in, writes.bytes_out), (0, 20 * BLOCK_SIZE))
+        self.assertEqual(sum(writes.latency_histogram), 2)
+
+        self.assertIn("Read (16)", handler.format_statistics())
+
+        # Resetting clears everything.
+        handler.reset_statistics()
+        self.assertEqual(handler.get_statistics(), {})
+
+
+    def test_no_thin_provisioning_without_hole_punching(self):
+        original = disk_image._fallocate
+        disk_image._fallocate = None
+
+        try:
+            self.device.disk_image.close()
+            self.device = USBMassStorageDevice(RawDiskImage(self.filename, BLOCK_SIZE))
+        finally:
+            disk_image._fallocate = original
+
+        async def host():
+            page, _  = await self.command(b"\x12\x01\xb2\x00\x08", data_in_length=8)
+            _, unmap = await self.unmap((0, 8))
+            return page, unmap
+
+        page, unmap = self.run_host(host)
+
+        # We mustn't claim to be thin provisioned; or accept discards we'd have to write out as zeroes.
+        self.assertFalse(self.device.disk_image.supports_discard())
+        self.assertEqual(page[5], 0)
+        self.assertNotEqual(unmap, 0)
+
+
+
+class MemoryDiskImage(DiskImage):
+    """ Small in-memory image, whose reads can be paused part-way; for exercising the cache. """
+
+    def __init__(self, sectors):
+        self.data  = bytearray(os.urandom(sectors * BLOCK_SIZE))
+        self.reads = 0
+
+        # If set, reads of this sector take their data, signal read_started, then wait for read_gate
+        # before returning it.
+        self.gated_sector = None
+        self.read_started = threading.Event()
+        self.read_gate    = threading.Event()
+
+
+    def get_sector_count(self):
+        return len(self.data) // BLOCK_SIZE - 1
+
+
+    def get_data(self, address, length):
+        self.reads += 1
+        data = bytes(self.data[address * BLOCK_SIZE:address * BLOCK_SIZE + length])
+
+        if self.gated_sector is not None and address <= self.gated_sector < address + length // BLOCK_SIZE:
+            self.read_started.set()
+            self.read_gate.wait()
+
+        return data
+
+
+    def get_sector_data(self, address):
+        return self.get_data(address, BLOCK_SIZE)
+
+
+    def put_sector_data(self, address, data):
+        self.data[address * BLOCK_SIZE:(address + 1) * BLOCK_SIZE] = data
+
+
+    def supports_discard(self):
+        return True
+
+
+    def discard(self, address, count):
+        self.data[address * BLOCK_SIZE:(address + count) * BLOCK_SIZE] = bytes(count * BLOCK_SIZE)
+
+
+    def sector(self, address):
+        return bytes(self.data[address * BLOCK_SIZE:(address + 1) * BLOCK_SIZE])
+
+
+
+class TestCachedDiskImage(unittest.TestCase):
+    """ Exercises the sector cache's eviction, invalidation, and read-ahead. """
+
+    RUN_SECTORS = 8
+
+    # - life-cycle ------------------------------------------------------------
+
+    def setUp(self):
+        self.backing = MemoryDiskImage(64 * self.RUN_SECTORS)
+
+
+    def cached(self, **kwargs):
+        image = CachedDiskImage(self.backing, run_sectors=self.RUN_SECTORS, **kwargs)
+        self.addCleanup(image.close)
+        return image
+
+
+    # - tests -----------------------------------------------------------------
+
+    def test_reads_whole_runs(self):
+        image = self.cached(readahead_runs=0)
+
+        for address in range(self.RUN_SECTORS):
+            self.assertEqual(image.get_sector_data(address), self.backing.sector(address))
+
+        # The first read fetches the whole run, in one read of the backing image; the rest hit.
+        self.assertEqual(self.backing.reads, 1)
+        self.assertEqual((image.misses, image.hits), (1, self.RUN_SECTORS - 1))
+
+
+    def test_lru_eviction(self):
+        image = self.cached(cache_runs=4, readahead_runs=0)
+
+        # Fill the cache with runs 0-3; then use run 0 again, so run 1 is least recently used.
+        for run in (0, 1, 2, 3, 0):
+            image.get_sector_data(run * self.RUN_SECTORS)
+        self.assertEqual(image.misses, 4)
+
+        # Reading a fifth run should evict run 1, and only run 1.
+        image.get_sector_data(4 * self.RUN_SECTORS)
+        self.assertEqual(image.misses, 5)
+
+        for run in (0, 2, 3, 4):
+            image.get_sector_data(run * self.RUN_SECTORS)
+        self.assertEqual(image.misses, 5)
+
+        image.get_sector_data(1 * self.RUN_SECTORS)
+        self.assertEqual(image.misses, 6)
+
+
+    def test_discard_invalidates(self):
+        image   = self.cached(readahead_runs=0)
+        address = 3 * self.RUN_SECTORS + 2
+
+        self.assertEqual(image.get_sector_data(address), self.backing.sector(address))
+        self.assertTrue(any(image.get_sector_data(address)))
+
+        image.discard(address, 1)
+
+        self.assertEqual(image.get_sector_data(address), bytes(BLOCK_SIZE))
+        self.assertEqual(image.misses, 2)
+
+
+    def test_write_during_prefetch_reads_fresh_data(self):
+        image = self.cached(readahead_runs=1)
+
+        # Cache runs 0-2, in an order that doesn't look sequential.
+        for run in (2, 0, 1):
+            image.get_sector_data(run * self.RUN_SECTORS)
+
+        # Pause the read-ahead of run 3 part-way through.
+        target = 3 * self.RUN_SECTORS + 1
+        self.backing.gated_sector = target
+
+        # Reading runs 0-2 in order does look sequential; so run 3 is prefetched.
+        for run in range(3):
+            image.get_sector_data(run * self.RUN_SECTORS)
+        self.assertTrue(self.backing.read_started.wait(5))
+
+        # Write to run 3 while it's being fetched; letting the fetch finish shortly after we start.
+        payload = bytes([0xa5]) * BLOCK_SIZE
+        threading.Timer(0.05, self.backing.read_gate.set).start()
+        image.put_sector_data(target, payload)
+
+        # Whichever order those land in, we must never see the stale, prefetched copy.
+        self.assertEqual(image.prefetches, 1)
+        self.assertEqual(image.get_sector_data(target), payload)
+        self.assertEqual(image.get_data(target - 1, 3 * BLOCK_SIZE), self.backing.data[(target - 1) * BLOCK_SIZE:(target + 2) * BLOCK_SIZE])
+
+
+if __name__ == "__main__":
+    unittest.main()
@@ -0,0 +1,114 @@
+#
+# This file is part of Facedancer.
+#
+""" Block access trace tests; run entirely in memory, or on temporary files, so no hardware is needed. """
+
+import os
+import tempfile
+import unittest
+
+from facedancer.devices.umass.trace import BlockAccessTracer, BlockAccess, read_trace
+from facedancer.devices.umass.trace import build_heatmap, summarize_access_pattern
+
+
+READ_10  = 0x28
+WRITE_10 = 0x2a
+
+
+class TestBlockAccessTrace(unittest.TestCase):
+    """ Exercises trace recording, ring wrap-around, and offline analysis. """
+
+    # - helpers ---------------------------------------------------------------
+
+    def access(self, lba, length, opcode=READ_10, timestamp=0.0, latency=0.001):
+        return BlockAccess(timestamp, opcode, lba, length, latency)
+
+
+    # - recording -------------------------------------------------------------
+
+    def test_records_in_order(self):
+        tracer = BlockAccessTracer(capacity=8)
+        self.addCleanup(tracer.close)
+
+        for lba in range(5):
+            tracer.record(READ_10, lba * 8, 8, 0.001, tracer._origin + lba)
+
+        records = list(tracer)
+        self.assertEqual([record.lba for record in records], [0, 8, 16, 24, 32])
+        self.assertEqual([record.timestamp for record in records], [0.0, 1.0, 2.0, 3.0, 4.0])
+        self.assertTrue(all(record.is_read and record.length == 8 for record in records))
+
+
+    def test_ring_wraps_oldest_first(self):
+        directory = tempfile.TemporaryDirectory()
+        self.addCleanup(directory.cleanup)
+
+        filename = os.path.join(directory.name, "wrapped.trace")
+        tracer   = BlockAccessTracer(filename, capacity=4)
+
+        for lba in range(10):
+            tracer.record(WRITE_10, lba, 1, 0.0, tracer._origin)
+        tracer.close()
+
+        # Only the last four records survive; and they're read back oldest first.
+        records = read_trace(filename)
+        self.assertEqual([record.lba for record in records], [6, 7, 8, 9])
+        self.assertFalse(any(record.is_read for record in records))
+
+
+    def test_rejects_other_files(self):
+        with tempfile.NamedTemporaryFile(suffix=".trace") as f:
+            f.write(bytes(64))
+            f.flush()
+
+            with self.assertRaises(ValueError):
+                read_trace(f.name)
+
+
+    # - analysis --------------------------------------------------------------
+
+    def test_heatmap_splits_spanning_commands(self):
+        accesses = [
+            self.access(0, 4),                     # entirely in region 0
+            self.access(14, 4, opcode=WRITE_10),   # 2 blocks in region 0, 2 in region 1
+            self.access(20, 24),                   # 12 blocks in region 1, and all of region 2
+        ]
+
+        regions = build_heatmap(accesses, region_blocks=16)
+
+        self.assertEqual(sorted(regions), [0, 1, 2])
+
+        self.assertEqual((regions[0].reads, regions[0].writes), (1, 1))
+        self.assertEqual((regions[0].blocks_read, regions[0].blocks_written), (4, 2))
+
+        self.assertEqual((regions[1].reads, regions[1].writes), (1, 1))
+        self.assertEqual((regions[1].blocks_read, regions[1].blocks_written), (12, 2))
+
+        self.assertEqual((regions[2].reads, regions[2].blocks_read), (1, 12))
+        self.assertEqual(regions[2].accesses, 1)
+
+
+    def test_access_pattern_summary(self):
+        accesses = [
+            self.access(0,   8, timestamp=0.0),
+            self.access(8,   8, timestamp=1.0),                     # follows on from the last read
+            self.access(100, 1, timestamp=2.0),                     # random
+            self.access(8,   2, opcode=WRITE_10, timestamp=3.0),
+            self.access(10,  3, opcode=WRITE_10, timestamp=4.0),    # follows on from the last write
+        ]
+
+        summaries = summarize_access_pattern(accesses)
+        reads, writes = summaries['read'], summaries['write']
+
+        self.assertEqual((reads.commands, reads.sequential, reads.random), (3, 1, 2))
+        self.assertEqual((reads.blocks, reads.sequential_blocks), (17, 8))
+        self.assertEqual(reads.length_histogram, {8: 2, 1: 1})
+        self.assertAlmostEqual(reads.duration, 2.001)
+
+        self.assertEqual((writes.commands, writes.sequential), (2, 1))
+        self.assertEqual(writes.length_histogram, {2: 1, 4: 1})
+        self.assertAlmostEqual(writes.sequential_fraction, 0.5)
+
+
+if __name__ == "__main__":
+    unittest.main()
@@ -6,8 +6,12 @@ import asyncio, logging, random, sys, time
 import unittest
 import usb1
 
+from facedancer                     import USBDevice
+from facedancer.backends.greatdancer import GreatDancerApp
+from facedancer.backends.moondancer  import MoondancerApp
+
 from .base   import FacedancerTestCase
-from .base   import VENDOR_ID, PRODUCT_ID, MAX_TRANSFER_LENGTH
+from .base   import VENDOR_ID, PRODUCT_ID, MAX_TRANSFER_LENGTH, LARGE_CONTROL_TRANSFER_LENGTH
 from .device import generate_data
 
 
@@ -37,7 +41,7 @@ class TestTransfers(FacedancerTestCase):
 
     def check_out_transfer(self, length, sent_data, bytes_sent):
         # request a copy of the received data to compare against
-        received_data = self.get_last_out_transfer_data()
+        received_data = self.get_last_out_transfer_data(max(length, MAX_TRANSFER_LENGTH))
 
         # did we send the right amount of data?
         self.assertEqual(bytes_sent, length)
@@ -110,5 +114,63 @@ class TestTransfers(FacedancerTestCase):
         self.check_in_transfer(length, received_data)
 
 
+    def test_large_control_out_transfer(self):
+        # generate test data larger than a single board command
+        length = LARGE_CONTROL_TRANSFER_LENGTH
+        data = generate_data(length)
+
+        # perform Control OUT transfer
+        bytes_sent = self.control_out_transfer(data)
+
+        # check transfer
+        self.check_out_transfer(length, data, bytes_sent)
+
+
+    def test_large_control_in_transfer(self):
+        # request a reply larger than a single board command
+        length = LARGE_CONTROL_TRANSFER_LENGTH
+
+        # perform Control IN transfer
+        received_data = self.control_in_transfer(length)
+
+        # check transfer
+        self.check_in_transfer(length, received_data)
+
+
+
+class TestControlTransferSplitting(unittest.TestCase):
+    """Checks, without hardware, that large control replies fit each pygreat backend's commands"""
+
+    # Backends whose commands are limited by LIBGREAT_MAX_COMMAND_SIZE.
+    PYGREAT_BACKENDS = (GreatDancerApp, MoondancerApp)
+
+    def sent_control_chunks(self, backend_class, length):
+        sent = []
+
+        class RecordingBackend:
+            MAX_TRANSFER_SIZE = backend_class.MAX_TRANSFER_SIZE
+
+            def send_on_endpoint(self, endpoint_number, data, blocking=True):
+                sent.append((endpoint_number, bytes(data)))
+
+        device = USBDevice()
+        device.backend = RecordingBackend()
+        device._send_control_data(generate_data(length))
+
+        return sent
+
+
+    def test_large_control_in_reply_is_split(self):
+        for backend_class in self.PYGREAT_BACKENDS:
+            with self.subTest(backend=backend_class.__name__):
+                sent = self.sent_control_chunks(backend_class, LARGE_CONTROL_TRANSFER_LENGTH)
+
+                # Every piece must fit in a single command, and all but the last must be whole packets.
+                self.assertTrue(all(len(data) <= MAX_TRANSFER_LENGTH for _, data in sent))
+                self.assertTrue(all(len(data) % 64 == 0 for _, data in sent[:-1]))
+                self.assertTrue(all(endpoint == 0 for endpoint, _ in sent))
+                self.assertEqual(b"".join(data for _, data in sent), generate_data(LARGE_CONTROL_TRANSFER_LENGTH))
+
+
 if __name__ == "__main__":
     unittest.main(verbosity=1)